@@ -0,0 +1,1030 @@
+/**
+ * @file chat_bench.cc
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief Load generator for the chat coordinator and session servers
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "strings.h"
+#include "socket_utils.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+/** Number of simulated clients unless -c is given */
+const int DEFAULT_CLIENTS = 100;
+/** Number of threads the clients are spread across unless -t is given */
+const int DEFAULT_THREADS = 4;
+/** Number of sessions the clients are spread across unless -s is given */
+const int DEFAULT_SESSIONS = 10;
+/** Length of the run unless -d is given.  Value is in seconds. */
+const int DEFAULT_DURATION = 10;
+/** Length of each submitted message unless -l is given */
+const int DEFAULT_MESSAGE_LENGTH = 64;
+/** How long to wait for the coordinator before counting a request as lost.  Value is in milliseconds. */
+const int LOOKUP_TIMEOUT = 1000;
+/** Most readiness events handled per epoll_wait() call */
+const int MAX_EPOLL_EVENTS = 256;
+/** epoll user data for the coordinator socket.  Clients use their index. */
+const uint32_t COORDINATOR_EVENT = 0xFFFFFFFF;
+
+/** Commands a simulated client can run */
+enum BenchCommand {
+	BENCH_START,
+	BENCH_JOIN,
+	BENCH_SUBMIT,
+	BENCH_GET_NEXT,
+	BENCH_GET_ALL,
+	NUM_BENCH_COMMANDS
+};
+
+/** Names of the commands in -m and in the report */
+const char* const BENCH_COMMAND_NAMES[NUM_BENCH_COMMANDS] = { "start", "join", "submit", "getnext", "getall" };
+
+/** Default share of each command, in the order of BenchCommand */
+const int DEFAULT_MIX[NUM_BENCH_COMMANDS] = { 0, 1, 50, 30, 19 };
+
+/** What a simulated client is doing */
+enum BenchClientState {
+	/** Nothing outstanding - runs its next command on the next round */
+	CLIENT_READY,
+	/** Waiting for the coordinator to answer a Start or Find */
+	CLIENT_LOOKUP,
+	/** Waiting for the session server to answer */
+	CLIENT_WAITING
+};
+
+/**
+  * A session the clients were spread across during setup.
+  */
+struct BenchSession {
+	BenchSession() :
+		name(),
+		address(),
+		session_id(0) {
+	}
+
+	/** Session name */
+	string name;
+	/** Address of the session server */
+	struct sockaddr_in address;
+	/** Session ID to select the session with */
+	unsigned int session_id;
+};
+
+/**
+  * Settings for the run.  Read-only once the threads start.
+  */
+struct BenchSettings {
+	BenchSettings() :
+		coordinator(),
+		num_clients(DEFAULT_CLIENTS),
+		num_threads(DEFAULT_THREADS),
+		num_sessions(DEFAULT_SESSIONS),
+		duration(DEFAULT_DURATION),
+		message_length(DEFAULT_MESSAGE_LENGTH),
+		total_weight(0),
+		name_prefix(),
+		sessions() {
+		std::copy(DEFAULT_MIX, DEFAULT_MIX + NUM_BENCH_COMMANDS, weights);
+	}
+
+	/** Address of the chat coordinator */
+	struct sockaddr_in coordinator;
+	/** Number of simulated clients */
+	int num_clients;
+	/** Number of threads */
+	int num_threads;
+	/** Number of sessions */
+	int num_sessions;
+	/** Length of the run in seconds */
+	int duration;
+	/** Length of each submitted message */
+	int message_length;
+	/** Share of each command */
+	int weights[NUM_BENCH_COMMANDS];
+	/** Sum of weights */
+	int total_weight;
+	/** Start of every session name we create, so runs don't collide */
+	string name_prefix;
+	/** Sessions created during setup */
+	vector<BenchSession> sessions;
+};
+
+/**
+  * Counters for one command.
+  */
+struct CommandStats {
+	CommandStats() :
+		ops(0),
+		errors(0),
+		latencies() {
+	}
+
+	/** Number of commands completed */
+	unsigned long ops;
+	/** Number of commands that failed */
+	unsigned long errors;
+	/** Latency of each completed command in microseconds.  Empty for commands with no response. */
+	vector<unsigned int> latencies;
+};
+
+/**
+  * One simulated client.
+  */
+struct BenchClient {
+	BenchClient() :
+		socket(-1),
+		state(CLIENT_READY),
+		command(BENCH_JOIN),
+		started(0),
+		reader(),
+		remaining(0) {
+	}
+
+	/** Connection to the session server.  -1 if the client has none. */
+	int socket;
+	/** What the client is doing */
+	BenchClientState state;
+	/** Command being run */
+	BenchCommand command;
+	/** When the command was sent, in microseconds */
+	uint64_t started;
+	/** Bytes received from the session server that have not been decoded yet */
+	ConnectionReader reader;
+	/** GetAll - messages still to come.  -1 until the count arrives. */
+	int remaining;
+};
+
+/**
+  * State owned by one thread.  Its clients share one epoll instance and one UDP
+  * socket to the coordinator.
+  */
+struct BenchThread {
+	BenchThread() :
+		index(0),
+		settings(NULL),
+		epoll_fd(-1),
+		coordinator_socket(-1),
+		clients(),
+		ready(),
+		lookups(),
+		seed(0),
+		next_request_id(0),
+		next_session(0),
+		bytes_sent(0),
+		bytes_received(0),
+		messages_sent(0),
+		messages_received(0) {
+	}
+
+	/** Thread number */
+	int index;
+	/** Settings for the run */
+	const BenchSettings* settings;
+	/** epoll instance for this thread's sockets */
+	int epoll_fd;
+	/** UDP socket for this thread's coordinator requests */
+	int coordinator_socket;
+	/** Clients owned by this thread */
+	vector<BenchClient> clients;
+	/** Clients that run their next command on the next round */
+	vector<int> ready;
+	/** Outstanding coordinator requests: request ID to client */
+	map<unsigned int, int> lookups;
+	/** rand_r() state */
+	unsigned int seed;
+	/** Last coordinator request ID used */
+	unsigned int next_request_id;
+	/** Number of sessions this thread has started */
+	int next_session;
+	/** Counters for each command */
+	CommandStats stats[NUM_BENCH_COMMANDS];
+	/** Bytes written to session servers */
+	unsigned long bytes_sent;
+	/** Bytes read from session servers */
+	unsigned long bytes_received;
+	/** Messages submitted */
+	unsigned long messages_sent;
+	/** Messages received by GetNext and GetAll */
+	unsigned long messages_received;
+
+private:
+	/* not copyable */
+	BenchThread(const BenchThread&);
+	BenchThread& operator=(const BenchThread&);
+};
+
+
+/* function declarations */
+int parse_mix(const char* const, BenchSettings&);
+int setup_sessions(BenchSettings&);
+int coordinator_lookup(const int, const struct sockaddr_in&, const unsigned char, const string&, BenchSession&);
+int connect_session(const struct sockaddr_in&, const unsigned int);
+int init_thread(BenchThread&);
+void* bench_thread(void*);
+void run_thread(BenchThread&);
+void run_command(BenchThread&, const int);
+void handle_lookups(BenchThread&);
+void expire_lookups(BenchThread&);
+void handle_response(BenchThread&, const int);
+void finish_command(BenchThread&, const int);
+void fail_command(BenchThread&, const int);
+void watch_client(BenchThread&, const int);
+uint64_t now_us();
+void print_report(const BenchSettings&, const BenchThread* const, const double);
+
+/**
+  * Main - entry point of program
+  *
+  * @param argc Number of command line arguments
+  * @param argv Command line arguments
+  * @return 0 if success; any other value if error
+  */
+int main(const int argc, char** const argv) {
+	BenchSettings settings;
+
+	int option;
+	while (-1 != (option = getopt(argc, argv, "c:t:s:d:l:m:"))) {
+		switch (option) {
+			case 'c':
+				settings.num_clients = atoi(optarg);
+				break;
+			case 't':
+				settings.num_threads = atoi(optarg);
+				break;
+			case 's':
+				settings.num_sessions = atoi(optarg);
+				break;
+			case 'd':
+				settings.duration = atoi(optarg);
+				break;
+			case 'l':
+				settings.message_length = atoi(optarg);
+				break;
+			case 'm':
+				if (-1 == parse_mix(optarg, settings)) {
+					exit(1);
+				}
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+
+	if (2 != argc - optind) {
+		fprintf(stderr, "Usage: chat_bench.exe [-c clients] [-t threads] [-s sessions] [-d seconds] [-l message length] [-m command=weight,...] host/IP port\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < NUM_BENCH_COMMANDS; ++i) {
+		settings.total_weight += settings.weights[i];
+	}
+
+	if (settings.num_clients < 1 || settings.num_threads < 1 || settings.num_sessions < 1 || settings.duration < 1 || settings.total_weight < 1) {
+		fprintf(stderr, "clients, threads, sessions, seconds and the command mix must all be at least 1\n");
+		exit(1);
+	}
+
+	if (settings.message_length < 0 || settings.message_length >= BUFFER_SIZE) {
+		fprintf(stderr, "message length must be less than %d\n", BUFFER_SIZE);
+		exit(1);
+	}
+
+	if (settings.num_threads > settings.num_clients) {
+		settings.num_threads = settings.num_clients;
+	}
+
+	if (-1 == util_create_sockaddr(argv[optind], atoi(argv[optind + 1]), &settings.coordinator)) {
+		fprintf(stderr, "Failed to create sockaddr for coordinator\n");
+		exit(1);
+	}
+
+	// one socket per client
+	util_raise_descriptor_limit();
+
+	char prefix[32];
+	sprintf(prefix, "b%d.", static_cast<int>(getpid()));
+	settings.name_prefix = prefix;
+
+	if (-1 == setup_sessions(settings)) {
+		exit(1);
+	}
+
+	BenchThread* const threads = new BenchThread[settings.num_threads];
+	for (int i = 0; i < settings.num_threads; ++i) {
+		threads[i].index = i;
+		threads[i].settings = &settings;
+		if (-1 == init_thread(threads[i])) {
+			exit(1);
+		}
+	}
+
+	// everybody is connected - start the clock
+	const uint64_t run_start = now_us();
+	vector<pthread_t> thread_ids(settings.num_threads);
+	for (int i = 0; i < settings.num_threads; ++i) {
+		const int thread_code = pthread_create(&thread_ids[i], NULL, bench_thread, &threads[i]);
+		if (0 != thread_code) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(thread_code));
+			exit(1);
+		}
+	}
+
+	for (int i = 0; i < settings.num_threads; ++i) {
+		pthread_join(thread_ids[i], NULL);
+	}
+	const double elapsed = (now_us() - run_start) / 1e6;
+
+	print_report(settings, threads, elapsed);
+	delete[] threads;
+	return 0;
+}
+
+/**
+  * Parses a command mix such as "join=1,submit=50,getnext=30,getall=19".
+  * Commands that are not named get a weight of 0.
+  *
+  * @pre none
+  * @post in_settings.weights holds the mix if successful
+  * @param in_mix Command mix from the command line
+  * @param in_settings Settings to update
+  * @return 0 if successful; -1 if error
+  */
+int parse_mix(const char* const in_mix,
+              BenchSettings& in_settings) {
+	int weights[NUM_BENCH_COMMANDS];
+	std::fill(weights, weights + NUM_BENCH_COMMANDS, 0);
+
+	const string mix = in_mix;
+	size_t begin = 0;
+	while (begin < mix.length()) {
+		size_t end = mix.find(',', begin);
+		if (string::npos == end) {
+			end = mix.length();
+		}
+
+		const string entry = mix.substr(begin, end - begin);
+		const size_t equals = entry.find('=');
+		int command = 0;
+		while (command < NUM_BENCH_COMMANDS && (string::npos == equals || entry.substr(0, equals) != BENCH_COMMAND_NAMES[command])) {
+			++command;
+		}
+		if (NUM_BENCH_COMMANDS == command) {
+			fprintf(stderr, "bad command mix entry ->%s<-\n", entry.c_str());
+			return -1;
+		}
+
+		weights[command] = atoi(entry.c_str() + equals + 1);
+		begin = end + 1;
+	}
+
+	std::copy(weights, weights + NUM_BENCH_COMMANDS, in_settings.weights);
+	return 0;
+}
+
+/**
+  * Starts the sessions the clients will be spread across.  A session that already
+  * exists is joined instead.
+  *
+  * @pre in_settings.coordinator is set
+  * @post in_settings.sessions holds every session if successful
+  * @param in_settings Settings for the run
+  * @return 0 if successful; -1 if error
+  */
+int setup_sessions(BenchSettings& in_settings) {
+	const int udp_socket = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, NULL, 0);
+	if (-1 == udp_socket) {
+		return -1;
+	}
+
+	// setup is not timed, so a lost datagram just costs a retry
+	struct timeval timeout;
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	setsockopt(udp_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	for (int i = 0; i < in_settings.num_sessions; ++i) {
+		char name[64];
+		sprintf(name, "%s%d", in_settings.name_prefix.c_str(), i);
+
+		BenchSession session;
+		session.name = name;
+		if (-1 == coordinator_lookup(udp_socket, in_settings.coordinator, OP_COORDINATOR_START, session.name, session) &&
+		    -1 == coordinator_lookup(udp_socket, in_settings.coordinator, OP_COORDINATOR_FIND, session.name, session)) {
+			fprintf(stderr, "Failed to start session \"%s\"\n", name);
+			close(udp_socket);
+			return -1;
+		}
+		in_settings.sessions.push_back(session);
+	}
+
+	close(udp_socket);
+	return 0;
+}
+
+/**
+  * Sends one request to the chat coordinator and waits for the answer.  Lost
+  * requests are sent again.
+  *
+  * @pre in_socket is a UDP socket with a receive timeout
+  * @post none
+  * @param in_socket Socket to talk to the coordinator on
+  * @param in_coord Address of the chat coordinator
+  * @param in_opcode OP_COORDINATOR_START or OP_COORDINATOR_FIND
+  * @param in_session_name Session the request is about
+  * @param out_session Where the session is if successful
+  * @return 0 if successful; -1 if the coordinator refused or did not answer
+  */
+int coordinator_lookup(const int in_socket,
+                       const struct sockaddr_in& in_coord,
+                       const unsigned char in_opcode,
+                       const string& in_session_name,
+                       BenchSession& out_session) {
+	static unsigned int next_request_id = 0;
+
+	for (int attempt = 0; attempt < 5; ++attempt) {
+		const unsigned int request_id = ++next_request_id;
+		const unsigned int net_request_id = htonl(request_id);
+		string request(reinterpret_cast<const char*>(&net_request_id), REQUEST_ID_SIZE);
+		request += in_session_name;
+		if (-1 == util_send_udp_frame(in_socket, in_opcode, 0, request.data(), request.length(), (const struct sockaddr*)&in_coord)) {
+			return -1;
+		}
+
+		for (;;) {
+			char reply[BUFFER_SIZE];
+			struct sockaddr_in from;
+			const int num_bytes = util_recv_udp(in_socket, reply, BUFFER_SIZE, (struct sockaddr*)&from, sizeof(from));
+			if (-1 == num_bytes) {
+				break;
+			}
+
+			FrameHeader header;
+			const char* payload;
+			unsigned int reply_id;
+			if (-1 == util_decode_frame(reply, num_bytes, header, payload) ||
+			    REQUEST_ID_SIZE + sizeof(int) + sizeof(unsigned int) != header.length ||
+			    (memcpy(&reply_id, payload, REQUEST_ID_SIZE), request_id != ntohl(reply_id))) {
+				continue;
+			}
+
+			int net_port;
+			unsigned int net_session_id;
+			memcpy(&net_port, payload + REQUEST_ID_SIZE, sizeof(net_port));
+			memcpy(&net_session_id, payload + REQUEST_ID_SIZE + sizeof(net_port), sizeof(net_session_id));
+			if (-1 == static_cast<int>(ntohl(net_port))) {
+				return -1;
+			}
+
+			// session servers run on the coordinator's host
+			out_session.address = in_coord;
+			out_session.address.sin_port = htons(ntohl(net_port));
+			out_session.session_id = ntohl(net_session_id);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+  * Connects to a chat session server and selects the session if the server hosts several.
+  *
+  * @pre none
+  * @post The connection belongs to the session if successful
+  * @param in_address Address of the chat session server
+  * @param in_session_id Session ID from the chat coordinator.  0 if the server has only one session.
+  * @return Socket file descriptor if successful; -1 if error
+  */
+int connect_session(const struct sockaddr_in& in_address,
+                    const unsigned int in_session_id) {
+	const int new_socket = util_create_client_socket(SOCK_STREAM, IPPROTO_TCP, in_address);
+	if (-1 == new_socket) {
+		return -1;
+	}
+
+	// a Submit followed by a request must not wait for the Submit to be ACKed
+	const int enable = 1;
+	setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+	if (0 == in_session_id) {
+		return new_socket;
+	}
+
+	const unsigned int net_session_id = htonl(in_session_id);
+	if (-1 == util_send_frame(new_socket, OP_SERVER_SELECT_SESSION, 0, reinterpret_cast<const char*>(&net_session_id), sizeof(net_session_id))) {
+		close(new_socket);
+		return -1;
+	}
+
+	return new_socket;
+}
+
+/**
+  * Creates a thread's sockets and connects its share of the clients, spread evenly
+  * across the sessions.
+  *
+  * @pre in_thread.index and in_thread.settings are set
+  * @post Every client of in_thread is connected and ready
+  * @param in_thread Thread to initialize
+  * @return 0 if successful; -1 if error
+  */
+int init_thread(BenchThread& in_thread) {
+	const BenchSettings& settings = *in_thread.settings;
+	in_thread.seed = static_cast<unsigned int>(time(NULL)) ^ (in_thread.index * 7919);
+
+	in_thread.epoll_fd = epoll_create1(0);
+	if (in_thread.epoll_fd < 0) {
+		fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+		return -1;
+	}
+
+	in_thread.coordinator_socket = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, NULL, 0);
+	if (-1 == in_thread.coordinator_socket || -1 == util_set_nonblocking(in_thread.coordinator_socket)) {
+		return -1;
+	}
+
+	struct epoll_event coordinator_event;
+	memset(&coordinator_event, 0, sizeof(coordinator_event));
+	coordinator_event.events = EPOLLIN;
+	coordinator_event.data.u32 = COORDINATOR_EVENT;
+	if (epoll_ctl(in_thread.epoll_fd, EPOLL_CTL_ADD, in_thread.coordinator_socket, &coordinator_event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// clients are numbered across all threads so the sessions fill up evenly
+	for (int client_number = in_thread.index; client_number < settings.num_clients; client_number += settings.num_threads) {
+		const BenchSession& session = settings.sessions[client_number % settings.num_sessions];
+
+		BenchClient client;
+		client.socket = connect_session(session.address, session.session_id);
+		if (-1 == client.socket) {
+			fprintf(stderr, "Failed to connect client %d to session \"%s\"\n", client_number, session.name.c_str());
+			return -1;
+		}
+
+		in_thread.clients.push_back(client);
+		in_thread.ready.push_back(in_thread.clients.size() - 1);
+		watch_client(in_thread, in_thread.clients.size() - 1);
+	}
+
+	return 0;
+}
+
+/**
+  * pthread entry point.
+  *
+  * @param in_thread Pointer to the BenchThread to run
+  * @return NULL
+  */
+void* bench_thread(void* in_thread) {
+	run_thread(*static_cast<BenchThread*>(in_thread));
+	return NULL;
+}
+
+/**
+  * Event loop for one thread.  Every ready client runs one command per round, so a
+  * command with no response can't starve the others.
+  *
+  * @pre in_thread has been initialized with init_thread()
+  * @post The run is over
+  * @param in_thread Thread to run
+  */
+void run_thread(BenchThread& in_thread) {
+	const uint64_t deadline = now_us() + static_cast<uint64_t>(in_thread.settings->duration) * 1000000;
+
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	while (now_us() < deadline) {
+		vector<int> round;
+		round.swap(in_thread.ready);
+		for (size_t i = 0; i < round.size(); ++i) {
+			run_command(in_thread, round[i]);
+		}
+
+		// don't sleep while somebody is ready to go
+		const int timeout = in_thread.ready.empty() ? 100 : 0;
+		const int num_events = epoll_wait(in_thread.epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+		if (num_events < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		for (int i = 0; i < num_events; ++i) {
+			if (COORDINATOR_EVENT == events[i].data.u32) {
+				handle_lookups(in_thread);
+			}
+			else {
+				handle_response(in_thread, events[i].data.u32);
+			}
+		}
+
+		expire_lookups(in_thread);
+	}
+
+	for (size_t i = 0; i < in_thread.clients.size(); ++i) {
+		if (-1 != in_thread.clients[i].socket) {
+			close(in_thread.clients[i].socket);
+		}
+	}
+	close(in_thread.coordinator_socket);
+	close(in_thread.epoll_fd);
+}
+
+/**
+  * Sends a client's next command, picked at random according to the mix.  A client
+  * that has lost its connection joins a session first.
+  *
+  * @pre The client is ready
+  * @post The command has been sent, or has completed if it has no response
+  * @param in_thread Thread that owns the client
+  * @param in_client_index Index of the client
+  */
+void run_command(BenchThread& in_thread,
+                 const int in_client_index) {
+	const BenchSettings& settings = *in_thread.settings;
+	BenchClient& client = in_thread.clients[in_client_index];
+
+	int pick = rand_r(&in_thread.seed) % settings.total_weight;
+	int command = 0;
+	while (pick >= settings.weights[command]) {
+		pick -= settings.weights[command];
+		++command;
+	}
+	if (-1 == client.socket && BENCH_START != command) {
+		command = BENCH_JOIN;
+	}
+
+	client.command = static_cast<BenchCommand>(command);
+	client.started = now_us();
+
+	switch (client.command) {
+		case BENCH_START:
+		case BENCH_JOIN: {
+			string session_name;
+			if (BENCH_START == client.command) {
+				char name[64];
+				sprintf(name, "%s%d.%d", settings.name_prefix.c_str(), in_thread.index, in_thread.next_session++);
+				session_name = name;
+			}
+			else {
+				session_name = settings.sessions[rand_r(&in_thread.seed) % settings.num_sessions].name;
+			}
+
+			const unsigned int request_id = ++in_thread.next_request_id;
+			const unsigned int net_request_id = htonl(request_id);
+			string request(reinterpret_cast<const char*>(&net_request_id), REQUEST_ID_SIZE);
+			request += session_name;
+			const unsigned char opcode = (BENCH_START == client.command) ? OP_COORDINATOR_START : OP_COORDINATOR_FIND;
+			if (-1 == util_send_udp_frame(in_thread.coordinator_socket, opcode, 0, request.data(), request.length(), (const struct sockaddr*)&settings.coordinator)) {
+				fail_command(in_thread, in_client_index);
+				return;
+			}
+			in_thread.lookups[request_id] = in_client_index;
+			client.state = CLIENT_LOOKUP;
+			break;
+		}
+		case BENCH_SUBMIT: {
+			const string message(settings.message_length, 'x');
+			if (-1 == util_send_frame(client.socket, OP_SERVER_SUBMIT, 0, message.data(), message.length())) {
+				fail_command(in_thread, in_client_index);
+				return;
+			}
+			in_thread.bytes_sent += FRAME_HEADER_SIZE + message.length();
+			++in_thread.messages_sent;
+
+			// no response - the client goes again next round
+			++in_thread.stats[BENCH_SUBMIT].ops;
+			in_thread.ready.push_back(in_client_index);
+			break;
+		}
+		case BENCH_GET_NEXT:
+		case BENCH_GET_ALL: {
+			const unsigned char opcode = (BENCH_GET_NEXT == client.command) ? OP_SERVER_GET_NEXT : OP_SERVER_GET_ALL;
+			if (-1 == util_send_frame(client.socket, opcode, 0, NULL, 0)) {
+				fail_command(in_thread, in_client_index);
+				return;
+			}
+			in_thread.bytes_sent += FRAME_HEADER_SIZE;
+			client.remaining = -1;
+			client.state = CLIENT_WAITING;
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/**
+  * Takes the coordinator's answers, connects each client to the session it asked
+  * for, and completes its Start or Join.
+  *
+  * @pre in_thread.coordinator_socket is readable
+  * @post Every answered client is connected or has failed
+  * @param in_thread Thread that owns the clients
+  */
+void handle_lookups(BenchThread& in_thread) {
+	static __thread DatagramBatch* replies = NULL;
+	if (NULL == replies) {
+		replies = new DatagramBatch();
+	}
+
+	if (-1 == util_recv_udp_batch(in_thread.coordinator_socket, *replies)) {
+		return;
+	}
+
+	for (int i = 0; i < replies->count; ++i) {
+		FrameHeader header;
+		const char* payload;
+		if (-1 == replies->length[i] ||
+		    -1 == util_decode_frame(replies->data[i], replies->length[i], header, payload) ||
+		    REQUEST_ID_SIZE + sizeof(int) + sizeof(unsigned int) != header.length) {
+			continue;
+		}
+
+		unsigned int net_request_id;
+		int net_port;
+		unsigned int net_session_id;
+		memcpy(&net_request_id, payload, REQUEST_ID_SIZE);
+		memcpy(&net_port, payload + REQUEST_ID_SIZE, sizeof(net_port));
+		memcpy(&net_session_id, payload + REQUEST_ID_SIZE + sizeof(net_port), sizeof(net_session_id));
+
+		// a reply to a request we already gave up on
+		map<unsigned int, int>::iterator lookup = in_thread.lookups.find(ntohl(net_request_id));
+		if (in_thread.lookups.end() == lookup) {
+			continue;
+		}
+		const int client_index = lookup->second;
+		in_thread.lookups.erase(lookup);
+
+		if (-1 == static_cast<int>(ntohl(net_port))) {
+			fail_command(in_thread, client_index);
+			continue;
+		}
+
+		// session servers run on the coordinator's host
+		struct sockaddr_in session_addr = in_thread.settings->coordinator;
+		session_addr.sin_port = htons(ntohl(net_port));
+		const int new_socket = connect_session(session_addr, ntohl(net_session_id));
+		if (-1 == new_socket) {
+			fail_command(in_thread, client_index);
+			continue;
+		}
+
+		BenchClient& client = in_thread.clients[client_index];
+		if (-1 != client.socket) {
+			close(client.socket);
+		}
+		client.socket = new_socket;
+		client.reader = ConnectionReader();
+		watch_client(in_thread, client_index);
+		finish_command(in_thread, client_index);
+	}
+}
+
+/**
+  * Fails the Start and Join requests the coordinator has not answered in time.
+  * UDP may drop them.
+  *
+  * @pre none
+  * @post No lookup is older than LOOKUP_TIMEOUT
+  * @param in_thread Thread that owns the clients
+  */
+void expire_lookups(BenchThread& in_thread) {
+	if (in_thread.lookups.empty()) {
+		return;
+	}
+
+	const uint64_t cutoff = now_us() - static_cast<uint64_t>(LOOKUP_TIMEOUT) * 1000;
+	map<unsigned int, int>::iterator lookup = in_thread.lookups.begin();
+	while (in_thread.lookups.end() != lookup) {
+		if (in_thread.clients[lookup->second].started < cutoff) {
+			const int client_index = lookup->second;
+			in_thread.lookups.erase(lookup++);
+			fail_command(in_thread, client_index);
+		}
+		else {
+			++lookup;
+		}
+	}
+}
+
+/**
+  * Reads whatever a client's session server has sent and completes its command once
+  * the whole response is in.
+  *
+  * @pre none
+  * @post Everything the socket had has been decoded
+  * @param in_thread Thread that owns the client
+  * @param in_client_index Index of the client
+  */
+void handle_response(BenchThread& in_thread,
+                     const int in_client_index) {
+	BenchClient& client = in_thread.clients[in_client_index];
+
+	for (;;) {
+		FrameHeader header;
+		const char* payload;
+		const int status = client.reader.next_frame(header, payload);
+		if (-1 == status) {
+			fail_command(in_thread, in_client_index);
+			return;
+		}
+
+		if (0 == status) {
+			errno = 0;
+			if (-1 == client.reader.fill(client.socket, MSG_DONTWAIT)) {
+				if (EAGAIN != errno && EWOULDBLOCK != errno) {
+					fail_command(in_thread, in_client_index);
+				}
+				return;
+			}
+			continue;
+		}
+
+		in_thread.bytes_received += FRAME_HEADER_SIZE + header.length;
+		if (CLIENT_WAITING != client.state) {
+			continue;
+		}
+
+		switch (header.opcode) {
+			case OP_SERVER_NO_MESSAGE:
+				client.remaining = 0;
+				break;
+			case OP_SERVER_MESSAGE_COUNT:
+				if (sizeof(unsigned int) == header.length) {
+					unsigned int net_count;
+					memcpy(&net_count, payload, sizeof(net_count));
+					client.remaining = ntohl(net_count);
+				}
+				break;
+			case OP_SERVER_MESSAGE:
+				++in_thread.messages_received;
+				client.remaining = (BENCH_GET_NEXT == client.command) ? 0 : client.remaining - 1;
+				break;
+			default:
+				break;
+		}
+
+		if (0 == client.remaining) {
+			finish_command(in_thread, in_client_index);
+		}
+	}
+}
+
+/**
+  * Records a completed command and makes the client ready again.
+  *
+  * @pre The client has a command outstanding
+  * @post The client is ready
+  * @param in_thread Thread that owns the client
+  * @param in_client_index Index of the client
+  */
+void finish_command(BenchThread& in_thread,
+                    const int in_client_index) {
+	BenchClient& client = in_thread.clients[in_client_index];
+	CommandStats& stats = in_thread.stats[client.command];
+
+	++stats.ops;
+	stats.latencies.push_back(static_cast<unsigned int>(now_us() - client.started));
+
+	client.state = CLIENT_READY;
+	in_thread.ready.push_back(in_client_index);
+}
+
+/**
+  * Records a failed command.  A client whose connection broke drops it and joins
+  * a session next time.
+  *
+  * @pre The client has a command outstanding
+  * @post The client is ready
+  * @param in_thread Thread that owns the client
+  * @param in_client_index Index of the client
+  */
+void fail_command(BenchThread& in_thread,
+                  const int in_client_index) {
+	BenchClient& client = in_thread.clients[in_client_index];
+	++in_thread.stats[client.command].errors;
+
+	if (BENCH_START != client.command && BENCH_JOIN != client.command && -1 != client.socket) {
+		close(client.socket);
+		client.socket = -1;
+		client.reader = ConnectionReader();
+	}
+
+	client.state = CLIENT_READY;
+	in_thread.ready.push_back(in_client_index);
+}
+
+/**
+  * Registers a client's socket with its thread's epoll instance.
+  *
+  * @pre The client has a socket
+  * @post The thread is told when the socket is readable
+  * @param in_thread Thread that owns the client
+  * @param in_client_index Index of the client
+  */
+void watch_client(BenchThread& in_thread,
+                  const int in_client_index) {
+	struct epoll_event client_event;
+	memset(&client_event, 0, sizeof(client_event));
+	client_event.events = EPOLLIN;
+	client_event.data.u32 = in_client_index;
+	if (epoll_ctl(in_thread.epoll_fd, EPOLL_CTL_ADD, in_thread.clients[in_client_index].socket, &client_event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+	}
+}
+
+/**
+  * Reads the monotonic clock.
+  *
+  * @pre none
+  * @post none
+  * @return Current time in microseconds
+  */
+uint64_t now_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+  * Prints the results as key=value lines: one per command, then the totals.
+  * Latencies are in microseconds.  Submit has no response, so it has no latency.
+  *
+  * @pre Every thread has finished
+  * @post none
+  * @param in_settings Settings for the run
+  * @param in_threads Every thread
+  * @param in_elapsed Length of the run in seconds
+  */
+void print_report(const BenchSettings& in_settings,
+                  const BenchThread* const in_threads,
+                  const double in_elapsed) {
+	printf("run clients=%d threads=%d sessions=%d seconds=%.3f message_length=%d\n",
+	       in_settings.num_clients, in_settings.num_threads, in_settings.num_sessions, in_elapsed, in_settings.message_length);
+
+	unsigned long total_ops = 0;
+	unsigned long total_errors = 0;
+	for (int command = 0; command < NUM_BENCH_COMMANDS; ++command) {
+		unsigned long ops = 0;
+		unsigned long errors = 0;
+		vector<unsigned int> latencies;
+		for (int i = 0; i < in_settings.num_threads; ++i) {
+			const CommandStats& stats = in_threads[i].stats[command];
+			ops += stats.ops;
+			errors += stats.errors;
+			latencies.insert(latencies.end(), stats.latencies.begin(), stats.latencies.end());
+		}
+		total_ops += ops;
+		total_errors += errors;
+
+		printf("command=%s ops=%lu errors=%lu ops_per_sec=%.1f", BENCH_COMMAND_NAMES[command], ops, errors, ops / in_elapsed);
+		if (!latencies.empty()) {
+			std::sort(latencies.begin(), latencies.end());
+			const size_t count = latencies.size();
+			printf(" p50_us=%u p99_us=%u p999_us=%u max_us=%u",
+			       latencies[count * 50 / 100], latencies[count * 99 / 100], latencies[count * 999 / 1000], latencies[count - 1]);
+		}
+		printf("\n");
+	}
+
+	unsigned long bytes_sent = 0;
+	unsigned long bytes_received = 0;
+	unsigned long messages_sent = 0;
+	unsigned long messages_received = 0;
+	for (int i = 0; i < in_settings.num_threads; ++i) {
+		bytes_sent += in_threads[i].bytes_sent;
+		bytes_received += in_threads[i].bytes_received;
+		messages_sent += in_threads[i].messages_sent;
+		messages_received += in_threads[i].messages_received;
+	}
+
+	printf("total ops=%lu errors=%lu ops_per_sec=%.1f messages_sent_per_sec=%.1f messages_received_per_sec=%.1f bytes_sent_per_sec=%.1f bytes_received_per_sec=%.1f\n",
+	       total_ops, total_errors, total_ops / in_elapsed, messages_sent / in_elapsed, messages_received / in_elapsed,
+	       bytes_sent / in_elapsed, bytes_received / in_elapsed);
+}
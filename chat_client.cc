@@ -10,35 +10,166 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <iostream>
+#include <map>
 #include <string>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
+#include "compress.h"
 #include "strings.h"
 #include "socket_utils.h"
 
 using std::cin;
 using std::cout;
 using std::endl;
+using std::map;
 using std::string;
+using std::vector;
 
 
 /** Maximum length of a message that can be submitted */
 const int MAX_MESSAGE_LENGTH = 80;
 /** Maximum length of a chat session name */
 const int MAX_SESSION_NAME = 8;
+/** How long a session's location is trusted without asking the coordinator, unless -t is given.  Value is in seconds. */
+const int DEFAULT_SESSION_CACHE_TTL = 30;
+/** How long to wait for the coordinator to answer before sending the request again.  Value is in seconds. */
+const int COORDINATOR_TIMEOUT = 1;
+/** Number of times a coordinator request is sent before giving up */
+const int COORDINATOR_ATTEMPTS = 5;
 
-int do_start(const int, const char* const, const struct sockaddr_in&, const string&);
-int do_join(const int, const char* const, const struct sockaddr_in&, const string&);
-int do_submit(const int);
-int do_get_next(const int);
-int do_get_all(const int);
-int print_session_message(const int);
+/** ID for the next coordinator request.  Shared by every request type, since their replies share a socket. */
+static unsigned int g_next_request_id = 1;
+
+/**
+  * Where a session was found the last time we asked the coordinator.
+  */
+struct CachedSession {
+	CachedSession() :
+		address(),
+		session_id(0),
+		expires(0) {
+	}
+
+	/** Address of the session server */
+	struct sockaddr_in address;
+	/** Session ID to select the session with */
+	unsigned int session_id;
+	/** When the entry stops being used */
+	time_t expires;
+};
+
+/**
+  * Session locations by session name.  A Join that finds a fresh entry connects
+  * straight to the session server without asking the coordinator.
+  */
+struct SessionCache {
+	SessionCache() :
+		ttl(DEFAULT_SESSION_CACHE_TTL),
+		entries() {
+	}
+
+	/** How long an entry is used for.  Value is in seconds; 0 turns the cache off. */
+	int ttl;
+	/** Cached locations */
+	map<string, CachedSession> entries;
+};
+
+/**
+  * A session we are in.
+  */
+struct JoinedSession {
+	JoinedSession() :
+		name(),
+		session_id(0),
+		subscribed(false),
+		resume_token() {
+	}
+
+	/** Chat session name */
+	string name;
+	/** Session ID to select the session with.  0 if the server has only one session. */
+	unsigned int session_id;
+	/** The session server pushes new messages to us */
+	bool subscribed;
+	/** Token that gets our read position back if the connection drops.  Opaque. */
+	string resume_token;
+};
+
+/**
+  * One connection to a session server.  Every session we are in on that server
+  * shares it, each on its own channel.  A single session server only has channel 0.
+  */
+struct PooledConnection {
+	PooledConnection() :
+		socket(-1),
+		address(),
+		reader(),
+		sessions() {
+	}
+
+	/** Socket connected to the session server */
+	int socket;
+	/** Address of the session server, to reconnect to */
+	struct sockaddr_in address;
+	/** Bytes received on socket that have not been decoded yet */
+	ConnectionReader reader;
+	/** Sessions we are in over this connection, by channel */
+	map<unsigned short, JoinedSession> sessions;
+};
+
+/** Session server address and port, both in network byte order */
+typedef std::pair<unsigned int, unsigned short> ServerEndpoint;
+/** Open session server connections by endpoint */
+typedef map<ServerEndpoint, PooledConnection> ConnectionPool;
+
+/**
+  * The session that commands go to.
+  */
+struct ActiveSession {
+	ActiveSession() :
+		connection(NULL),
+		channel(0) {
+	}
+
+	/** Connection the session is on.  NULL if we are not in a session. */
+	PooledConnection* connection;
+	/** Channel of the session on connection */
+	unsigned short channel;
+};
+
+int do_start(const int, const struct sockaddr_in&, const string&, SessionCache&, ConnectionPool&, ActiveSession&);
+int do_join(const int, const struct sockaddr_in&, const string&, SessionCache&, ConnectionPool&, ActiveSession&);
+int do_submit(const ActiveSession&);
+int coordinator_request(const int, const struct sockaddr_in&, const unsigned char, const string&, unsigned int&, bool&);
+int coordinator_exchange(const int, const struct sockaddr_in&, const unsigned char, const string&, const unsigned char, char* const, FrameHeader&, const char*&);
+int do_list(const int, const struct sockaddr_in&);
+int open_session(ConnectionPool&, const struct sockaddr_in&, const unsigned int, const string&, ActiveSession&);
+bool find_session(ConnectionPool&, const string&, ActiveSession&);
+int resume_session(PooledConnection&, const unsigned short);
+int reconnect(PooledConnection&);
+bool connection_lost(const PooledConnection&);
+void leave_session(ConnectionPool&, const ActiveSession&);
+void cache_session(SessionCache&, const string&, const struct sockaddr_in&, const unsigned int);
+int do_get_next(const ActiveSession&);
+int do_get_all(const ActiveSession&, const bool);
+int do_stats(const ActiveSession&);
+int print_session_messages(const ActiveSession&, unsigned int&);
+int recv_response(const ActiveSession&, FrameHeader&, const char*&);
+int wait_for_command(ConnectionPool&, const ActiveSession&);
+bool handle_unsolicited(PooledConnection&, const ActiveSession&, const FrameHeader&, const char* const);
+unsigned int print_message_frames(const string&, const char* const, const unsigned int);
 
 
 /**
@@ -49,14 +180,34 @@ int print_session_message(const int);
   * @return 0 if success; any other value if error
   */
 int main(const int argc, const char** const argv) {
-	if (3 != argc) {
-		fprintf(stderr, "Usage: chat_client.exe host/IP port\n");
+	// session locations we have been told about
+	SessionCache session_cache;
+	// GetAll lets the server compress a long catch-up
+	bool accept_batch = true;
+
+	int option;
+	while (-1 != (option = getopt(argc, const_cast<char**>(argv), "t:r"))) {
+		switch (option) {
+			case 't':
+				session_cache.ttl = atoi(optarg);
+				break;
+			case 'r':
+				accept_batch = false;
+				break;
+			default:
+				fprintf(stderr, "Usage: chat_client.exe [-t session cache seconds] [-r] host/IP port\n");
+				exit(1);
+		}
+	}
+
+	if (2 != argc - optind) {
+		fprintf(stderr, "Usage: chat_client.exe [-t session cache seconds] [-r] host/IP port\n");
 		exit(1);
 	}
 
 	// how to communicate with the chat coordinator
-	const char* const coordinator_host = argv[1];
-	const int coordinator_port = atoi(argv[2]);
+	const char* const coordinator_host = argv[optind];
+	const int coordinator_port = atoi(argv[optind + 1]);
 
 	// this is the socket that we will send commands to the chat coordinator
 	const int command_socket = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, coordinator_host, 0);
@@ -65,16 +216,25 @@ int main(const int argc, const char** const argv) {
 		return -1;
 	}
 
+	// a lost datagram costs a resend, not a client that hangs forever
+	struct timeval coordinator_timeout;
+	coordinator_timeout.tv_sec = COORDINATOR_TIMEOUT;
+	coordinator_timeout.tv_usec = 0;
+	setsockopt(command_socket, SOL_SOCKET, SO_RCVTIMEO, &coordinator_timeout, sizeof(coordinator_timeout));
+
     // create the info for the coordinator
     struct sockaddr_in si_coord;
 	if( -1 == util_create_sockaddr(coordinator_host, coordinator_port, &si_coord)) {
-		fprintf(stderr, "Failed to create sockaddr for coordinator.  Error is %s\n", strerror(errno));
+		fprintf(stderr, "Failed to create sockaddr for coordinator\n");
 		return -1;
 	}
 
-	// this will hold our chat session sockets
-	string active_session_name = "";
-	int active_session_socket = -1;
+	// connections to the session servers we are in sessions on, and the session commands go to
+	ConnectionPool connection_pool;
+	ActiveSession active_session;
+
+	// unbuffered so that poll() on stdin sees every line we have not read yet
+	setvbuf(stdin, NULL, _IONBF, 0);
 
 	// begin command line processing
 	string user_command;
@@ -86,6 +246,8 @@ int main(const int argc, const char** const argv) {
 
 		// prompt user for command
 		cout << "Chat Client>>  ";
+		cout.flush();
+		wait_for_command(connection_pool, active_session);
 		getline(cin, user_command);
 
 		// these commands require a session name
@@ -103,49 +265,81 @@ int main(const int argc, const char** const argv) {
 			}
 		}
 	
+		// these commands need a session to go to
+		const bool needs_session = (CMD_CLIENT_SUBMIT == user_command || CMD_CLIENT_GET_NEXT == user_command ||
+		                            CMD_CLIENT_GET_ALL == user_command || CMD_CLIENT_STATS == user_command ||
+		                            CMD_CLIENT_SUBSCRIBE == user_command || CMD_CLIENT_UNSUBSCRIBE == user_command ||
+		                            CMD_CLIENT_LEAVE == user_command);
+		if (needs_session && NULL == active_session.connection) {
+			fprintf(stderr, "You have not joined a chat session\n");
+			continue;
+		}
+		JoinedSession* const joined = (NULL == active_session.connection) ? NULL : &active_session.connection->sessions[active_session.channel];
+		int session_code = 0;
+
 		// execute command
 		if (CMD_CLIENT_START == user_command) {
-			const int val = do_start(command_socket, coordinator_host, si_coord, session_name);
-			if (-1 != val) {
+			if (0 == do_start(command_socket, si_coord, session_name, session_cache, connection_pool, active_session)) {
 				printf("A new chat session \"%s\" has been created and you have joined this session\n", session_name.c_str());
-				active_session_name = session_name;
-				active_session_socket = val;
 			}
 		}
 		else if (CMD_CLIENT_JOIN == user_command) {
-			const int val = do_join(command_socket, coordinator_host, si_coord, session_name);
-			if (-1 != val) {
+			if (0 == do_join(command_socket, si_coord, session_name, session_cache, connection_pool, active_session)) {
 				printf("You have joined the chat session \"%s\"\n", session_name.c_str());
-				active_session_name = session_name;
-				active_session_socket = val;
 			}
 		}
 		else if (CMD_CLIENT_SUBMIT == user_command) {
-			do_submit(active_session_socket);
+			session_code = do_submit(active_session);
 		}
 		else if (CMD_CLIENT_GET_NEXT == user_command) {
-			do_get_next(active_session_socket);
+			session_code = do_get_next(active_session);
 		}
 		else if (CMD_CLIENT_GET_ALL == user_command) {
-			do_get_all(active_session_socket);
+			session_code = do_get_all(active_session, accept_batch);
 		}
-		else if (CMD_CLIENT_LEAVE == user_command) {
-			if (0 == util_send_tcp(active_session_socket, CMD_SERVER_LEAVE.c_str(), CMD_SERVER_LEAVE.length())) {
-				printf("You have left the chat session \"%s\"\n", active_session_name.c_str());
-				close(active_session_socket);
-				active_session_name = "";
-				active_session_socket = -1;
+		else if (CMD_CLIENT_LIST == user_command) {
+			do_list(command_socket, si_coord);
+		}
+		else if (CMD_CLIENT_STATS == user_command) {
+			session_code = do_stats(active_session);
+		}
+		else if (CMD_CLIENT_SUBSCRIBE == user_command) {
+			session_code = util_send_frame(active_session.connection->socket, OP_SERVER_SUBSCRIBE, active_session.channel, NULL, 0);
+			if (0 == session_code) {
+				printf("New messages in \"%s\" will be shown as they arrive\n", joined->name.c_str());
+				joined->subscribed = true;
+			}
+		}
+		else if (CMD_CLIENT_UNSUBSCRIBE == user_command) {
+			session_code = util_send_frame(active_session.connection->socket, OP_SERVER_UNSUBSCRIBE, active_session.channel, NULL, 0);
+			if (0 == session_code) {
+				joined->subscribed = false;
 			}
 		}
+		else if (CMD_CLIENT_LEAVE == user_command) {
+			printf("You have left the chat session \"%s\"\n", joined->name.c_str());
+			leave_session(connection_pool, active_session);
+			active_session = ActiveSession();
+		}
 		else if (CMD_CLIENT_EXIT == user_command) {
-			if (-1 != active_session_socket) {
-				close(active_session_socket);
+			for (ConnectionPool::iterator connection_it = connection_pool.begin(); connection_pool.end() != connection_it; ++connection_it) {
+				close(connection_it->second.socket);
 			}
 			break;
 		}
 		else {
 			fprintf(stderr, "Chat client - unrecognized command |%s|\n", user_command.c_str());
 		}
+
+		// the server may still have our place - pick it up on a new connection
+		if (-1 == session_code && connection_lost(*active_session.connection)) {
+			if (0 == reconnect(*active_session.connection)) {
+				fprintf(stderr, "Reconnected to the chat session server - try the command again\n");
+			}
+			else {
+				fprintf(stderr, "Lost the connection to the chat session server - Leave the session and join it again\n");
+			}
+		}
 	}
 
 	close(command_socket);
@@ -158,104 +352,527 @@ int main(const int argc, const char** const argv) {
   * @pre in_socket is a valid socket file descriptor
   * @post Chat session has been started
   * @param in_socket Socket file descriptor to send UDP message to chat coordinator
-  * @param in_coord_host Hostname / IP address of the chat coordinator
   * @param in_coord Address information for the chat coordinator
   * @param in_session_name Chat session name to start
-  * @return TCP port number of new chat session if successful; -1 if error
+  * @param in_cache Session locations.  The new session is added to it.
+  * @param in_pool Open session server connections
+  * @param out_active Set to the new session if successful
+  * @return 0 if successful; -1 if error
   */
 int do_start(const int in_socket,
-             const char* const in_coord_host,
              const struct sockaddr_in& in_coord,
-             const string& in_session_name) {
-	// send the command to the chat coordinator
-	if (-1 == util_send_udp(in_socket, CMD_COORDINATOR_START.c_str(), CMD_COORDINATOR_START.length(), (struct sockaddr*)&in_coord)) {
-		fprintf(stderr, "Failed to send command coordinator.  Error is %s\n", strerror(errno));
-		return -1;
-	}
+             const string& in_session_name,
+             SessionCache& in_cache,
+             ConnectionPool& in_pool,
+             ActiveSession& out_active) {
+	// ask the chat coordinator for the new port number
+	unsigned int session_id = 0;
+	bool resent = false;
+	int new_port = coordinator_request(in_socket, in_coord, OP_COORDINATOR_START, in_session_name, session_id, resent);
 
-	if (-1 == util_send_udp(in_socket, in_session_name.c_str(), in_session_name.length(), (struct sockaddr*)&in_coord)) {
-		fprintf(stderr, "Failed to send command coordinator.  Error is %s\n", strerror(errno));
-		return -1;
+	// Start is not idempotent - if an earlier copy of it worked and only its reply
+	// was lost, the copy that was answered finds the session already there
+	if (-1 == new_port && resent) {
+		new_port = coordinator_request(in_socket, in_coord, OP_COORDINATOR_FIND, in_session_name, session_id, resent);
 	}
-
-	// now recv the new port number
-	int new_port;
-	if (-1 == util_recv_udp(in_socket, new_port, (struct sockaddr*)&in_coord, sizeof(in_coord))) {
-		fprintf(stderr, "Failed to send command coordinator.  Error is %s\n", strerror(errno));
+	if (-1 == new_port) {
+		fprintf(stderr, "Chat session \"%s\" has already been started\n", in_session_name.c_str());
 		return -1;
 	}
 
+	// session servers run on the coordinator's host
+	struct sockaddr_in session_addr = in_coord;
+	session_addr.sin_port = htons(new_port);
+
 	// join the chat
-	int new_socket = -1;
-	if (-1 != new_port) {
-		new_socket = util_create_client_socket(SOCK_STREAM, IPPROTO_TCP, in_coord_host, new_port);
-		if (-1 != new_socket) {
-		}
-		else {
-			fprintf(stderr, "Failed to start chat session \"%s\"\n", in_session_name.c_str());
-			return -1;
-		}
-	}
-	else {
-		fprintf(stderr, "Chat session \"%s\" has already been started\n", in_session_name.c_str());
+	if (-1 == open_session(in_pool, session_addr, session_id, in_session_name, out_active)) {
+		fprintf(stderr, "Failed to start chat session \"%s\"\n", in_session_name.c_str());
 		return -1;
 	}
 
-	return new_socket;
+	cache_session(in_cache, in_session_name, session_addr, session_id);
+	return 0;
 }
 
 /**
-  * Joins an existing chat session server.  Returns the TCP port number of chat session.
+  * Joins an existing chat session server.  A session we are already in just becomes
+  * the active one again.  Otherwise the coordinator is only asked where the session
+  * is if the cache has no fresh entry for it, or connecting to the cached location
+  * fails.
   *
   * @pre in_socket is a valid socket file descriptor
   * @post Chat session has been joined
   * @param in_socket Socket file descriptor to send UDP message to chat coordinator
-  * @param in_coord_host Hostname / IP address of the chat coordinator
   * @param in_coord Address information for the chat coordinator
   * @param in_session_name Chat session name to join
-  * @return TCP port number of new chat session if successful; -1 if error
+  * @param in_cache Session locations
+  * @param in_pool Open session server connections
+  * @param out_active Set to the joined session if successful
+  * @return 0 if successful; -1 if error
   */
 int do_join(const int in_socket,
-            const char* const in_coord_host,
             const struct sockaddr_in& in_coord,
-            const string& in_session_name) {
-	// send the command to the chat coordinator
-	if (-1 == util_send_udp(in_socket, CMD_COORDINATOR_FIND.c_str(), CMD_COORDINATOR_FIND.length(), (struct sockaddr*)&in_coord)) {
-		fprintf(stderr, "Failed to send command coordinator.  Error is %s\n", strerror(errno));
+            const string& in_session_name,
+            SessionCache& in_cache,
+            ConnectionPool& in_pool,
+            ActiveSession& out_active) {
+	if (find_session(in_pool, in_session_name, out_active)) {
+		return 0;
+	}
+
+	map<string, CachedSession>::iterator cached = in_cache.entries.find(in_session_name);
+	if (in_cache.entries.end() != cached) {
+		if (time(NULL) < cached->second.expires &&
+		    0 == open_session(in_pool, cached->second.address, cached->second.session_id, in_session_name, out_active)) {
+			return 0;
+		}
+
+		// stale or gone - start over with the coordinator
+		in_cache.entries.erase(cached);
+	}
+
+	// ask the chat coordinator where the session is
+	unsigned int session_id = 0;
+	bool resent = false;
+	const int new_port = coordinator_request(in_socket, in_coord, OP_COORDINATOR_FIND, in_session_name, session_id, resent);
+	if (-1 == new_port) {
+		fprintf(stderr, "Chat session \"%s\" does not exist\n", in_session_name.c_str());
 		return -1;
 	}
 
-	if (-1 == util_send_udp(in_socket, in_session_name.c_str(), in_session_name.length(), (struct sockaddr*)&in_coord)) {
-		fprintf(stderr, "Failed to send command coordinator.  Error is %s\n", strerror(errno));
+	// session servers run on the coordinator's host
+	struct sockaddr_in session_addr = in_coord;
+	session_addr.sin_port = htons(new_port);
+
+	// join the new session
+	if (-1 == open_session(in_pool, session_addr, session_id, in_session_name, out_active)) {
+		fprintf(stderr, "Failed to join chat session \"%s\"\n", in_session_name.c_str());
 		return -1;
 	}
 
-	int new_port;
-	if (-1 == util_recv_udp(in_socket, new_port, (struct sockaddr*)&in_coord, sizeof(in_coord))) {
-		fprintf(stderr, "Failed to receive session port number.  Error is %s\n", strerror(errno));
+	cache_session(in_cache, in_session_name, session_addr, session_id);
+	return 0;
+}
+
+/**
+  * Remembers where a session is for the next in_cache.ttl seconds.
+  *
+  * @pre none
+  * @post in_cache has a fresh entry for in_session_name unless the cache is off
+  * @param in_cache Session locations
+  * @param in_session_name Chat session name
+  * @param in_address Address of the session server
+  * @param in_session_id Session ID to select the session with
+  */
+void cache_session(SessionCache& in_cache,
+                   const string& in_session_name,
+                   const struct sockaddr_in& in_address,
+                   const unsigned int in_session_id) {
+	if (in_cache.ttl <= 0) {
+		return;
+	}
+
+	CachedSession& entry = in_cache.entries[in_session_name];
+	entry.address = in_address;
+	entry.session_id = in_session_id;
+	entry.expires = time(NULL) + in_cache.ttl;
+}
+
+/**
+  * Sends a Start or Find request to the chat coordinator and waits for its reply.
+  *
+  * @pre in_socket is a valid socket file descriptor
+  * @post The coordinator has answered the request
+  * @param in_socket Socket file descriptor to send UDP message to chat coordinator
+  * @param in_coord Address information for the chat coordinator
+  * @param in_opcode OP_COORDINATOR_START or OP_COORDINATOR_FIND
+  * @param in_session_name Chat session name the request is about
+  * @param out_session_id Session ID from the reply
+  * @param out_resent Set when the reply answers a resent copy of the request, so an
+  *                   earlier copy may have been carried out too
+  * @return TCP port number from the reply if successful; -1 if error
+  */
+int coordinator_request(const int in_socket,
+                        const struct sockaddr_in& in_coord,
+                        const unsigned char in_opcode,
+                        const string& in_session_name,
+                        unsigned int& out_session_id,
+                        bool& out_resent) {
+	// the first attempt gets the next ID, and each resend the one after
+	const unsigned int first_id = g_next_request_id;
+	char reply[BUFFER_SIZE];
+	FrameHeader header;
+	const char* payload;
+	if (-1 == coordinator_exchange(in_socket, in_coord, in_opcode, in_session_name, OP_COORDINATOR_REPLY, reply, header, payload)) {
 		return -1;
 	}
 
-	// join the new session
-	const int new_socket = util_create_client_socket(SOCK_STREAM, IPPROTO_TCP, in_coord_host, new_port);
-	if (-1 != new_socket) {
+	unsigned int net_reply_id;
+	memcpy(&net_reply_id, payload, REQUEST_ID_SIZE);
+	out_resent = (first_id != ntohl(net_reply_id));
+	if (REQUEST_ID_SIZE + sizeof(int) + sizeof(unsigned int) != header.length) {
+		fprintf(stderr, "Ignoring malformed reply from the chat coordinator\n");
+		return -1;
 	}
-	else {
-		fprintf(stderr, "Failed to join chat session \"%s\"\n", in_session_name.c_str());
+
+	int net_port;
+	unsigned int net_session_id;
+	memcpy(&net_port, payload + REQUEST_ID_SIZE, sizeof(net_port));
+	memcpy(&net_session_id, payload + REQUEST_ID_SIZE + sizeof(net_port), sizeof(net_session_id));
+	out_session_id = ntohl(net_session_id);
+	return ntohl(net_port);
+}
+
+/**
+  * Sends one request to the chat coordinator and waits for its reply, sending it
+  * again if no reply comes within COORDINATOR_TIMEOUT.  Every attempt carries a
+  * fresh ID.  A reply to any attempt is taken, and anything else is skipped, so a
+  * late reply to an earlier request is never mistaken for the answer to this one.
+  *
+  * @pre in_socket is a valid socket file descriptor with a receive timeout
+  * @post The coordinator has answered the request if successful
+  * @param in_socket Socket file descriptor to send UDP message to chat coordinator
+  * @param in_coord Address information for the chat coordinator
+  * @param in_opcode Request opcode
+  * @param in_body Payload after the request ID
+  * @param in_reply_opcode Opcode of the expected reply
+  * @param out_reply Buffer of BUFFER_SIZE bytes for the reply
+  * @param out_header Header of the reply
+  * @param out_payload Payload of the reply, inside out_reply.  Starts with the request ID.
+  * @return 0 if successful; -1 if error or the coordinator never answered
+  */
+int coordinator_exchange(const int in_socket,
+                         const struct sockaddr_in& in_coord,
+                         const unsigned char in_opcode,
+                         const string& in_body,
+                         const unsigned char in_reply_opcode,
+                         char* const out_reply,
+                         FrameHeader& out_header,
+                         const char*& out_payload) {
+	const unsigned int first_id = g_next_request_id;
+	for (int attempt = 0; attempt < COORDINATOR_ATTEMPTS; ++attempt) {
+		const unsigned int request_id = g_next_request_id++;
+		const unsigned int net_request_id = htonl(request_id);
+		string request(reinterpret_cast<const char*>(&net_request_id), REQUEST_ID_SIZE);
+		request += in_body;
+		if (-1 == util_send_udp_frame(in_socket, in_opcode, 0, request.data(), request.length(), (const struct sockaddr*)&in_coord)) {
+			fprintf(stderr, "Failed to send command coordinator.  Error is %s\n", strerror(errno));
+			return -1;
+		}
+
+		for (;;) {
+			struct sockaddr_in from;
+			errno = 0;
+			const int num_bytes = util_recv_udp(in_socket, out_reply, BUFFER_SIZE, (struct sockaddr*)&from, sizeof(from));
+			if (-1 == num_bytes) {
+				// timed out - send it again
+				if (EAGAIN == errno || EWOULDBLOCK == errno) {
+					break;
+				}
+				if (EINTR == errno || 0 == errno) {
+					continue;
+				}
+				fprintf(stderr, "Failed to receive a reply from the chat coordinator.  Error is %s\n", strerror(errno));
+				return -1;
+			}
+
+			unsigned int reply_id;
+			if (0 == util_decode_frame(out_reply, num_bytes, out_header, out_payload) &&
+			    in_reply_opcode == out_header.opcode &&
+			    out_header.length >= REQUEST_ID_SIZE &&
+			    (memcpy(&reply_id, out_payload, REQUEST_ID_SIZE), ntohl(reply_id) - first_id <= request_id - first_id)) {
+				return 0;
+			}
+		}
 	}
 
-	return new_socket;
+	fprintf(stderr, "The chat coordinator did not answer\n");
+	return -1;
 }
 
 /**
-  * Submits a message to the chat session.
+  * Lists the chat coordinator's counters and every live session, one page at a time.
   *
   * @pre in_socket is a valid socket file descriptor
+  * @post Every page has been printed
+  * @param in_socket Socket file descriptor to send UDP message to chat coordinator
+  * @param in_coord Address information for the chat coordinator
+  * @return 0 if successful; -1 if error
+  */
+int do_list(const int in_socket,
+            const struct sockaddr_in& in_coord) {
+	// name of the last session printed - the next page starts after it
+	string cursor;
+	for (;;) {
+		FrameHeader header;
+		const char* payload;
+		char reply[BUFFER_SIZE];
+		if (-1 == coordinator_exchange(in_socket, in_coord, OP_COORDINATOR_LIST, cursor, OP_COORDINATOR_LIST_REPLY, reply, header, payload)) {
+			fprintf(stderr, "Failed to receive session list\n");
+			return -1;
+		}
+
+		const string page(payload + REQUEST_ID_SIZE, header.length - REQUEST_ID_SIZE);
+		printf("%s", page.c_str());
+		if (0 == (header.flags & FLAG_LIST_MORE)) {
+			return 0;
+		}
+
+		// name= comes last on a session line and runs to the newline
+		const size_t last_newline = (page.length() < 2) ? string::npos : page.rfind('\n', page.length() - 2);
+		const size_t line_start = (string::npos == last_newline) ? 0 : last_newline + 1;
+		const size_t name_start = page.find(" name=", line_start);
+		if (string::npos == name_start) {
+			fprintf(stderr, "Ignoring malformed session list from the chat coordinator\n");
+			return -1;
+		}
+		cursor = page.substr(name_start + 6, page.length() - 1 - (name_start + 6));
+	}
+}
+
+/**
+  * Puts a session on a connection to its session server.  The connection we already
+  * have to that server is reused; a new one is only made for a server we have no
+  * connection to.  If the server hosts several sessions, ours is selected on a
+  * channel of its own.
+  *
+  * @pre none
+  * @post We are in the session if successful
+  * @param in_pool Open session server connections
+  * @param in_address Address of the chat session server
+  * @param in_session_id Session ID from the chat coordinator.  0 if the server has only one session.
+  * @param in_session_name Chat session name
+  * @param out_active Set to the session if successful
+  * @return 0 if successful; -1 if error
+  */
+int open_session(ConnectionPool& in_pool,
+                 const struct sockaddr_in& in_address,
+                 const unsigned int in_session_id,
+                 const string& in_session_name,
+                 ActiveSession& out_active) {
+	const ServerEndpoint endpoint(in_address.sin_addr.s_addr, in_address.sin_port);
+	ConnectionPool::iterator connection_it = in_pool.find(endpoint);
+	if (in_pool.end() == connection_it) {
+		const int new_socket = util_create_client_socket(SOCK_STREAM, IPPROTO_TCP, in_address);
+		if (-1 == new_socket) {
+			return -1;
+		}
+		connection_it = in_pool.insert(std::make_pair(endpoint, PooledConnection())).first;
+		connection_it->second.socket = new_socket;
+		connection_it->second.address = in_address;
+	}
+	PooledConnection& connection = connection_it->second;
+
+	// a single session server's only session is always on channel 0
+	unsigned short channel = 0;
+	if (0 != in_session_id) {
+		// the lowest free channel - the server keeps its channels in an array
+		channel = 1;
+		while (0 != connection.sessions.count(channel)) {
+			++channel;
+		}
+
+		const unsigned int net_session_id = htonl(in_session_id);
+		if (-1 == util_send_frame(connection.socket, OP_SERVER_SELECT_SESSION, channel, reinterpret_cast<const char*>(&net_session_id), sizeof(net_session_id))) {
+			// the connection is broken - only drop it if nothing else uses it
+			if (connection.sessions.empty()) {
+				close(connection.socket);
+				in_pool.erase(connection_it);
+			}
+			return -1;
+		}
+	}
+
+	JoinedSession& joined = connection.sessions[channel];
+	joined.name = in_session_name;
+	joined.session_id = in_session_id;
+	if (0 != resume_session(connection, channel)) {
+		connection.sessions.erase(channel);
+		if (connection.sessions.empty()) {
+			close(connection.socket);
+			in_pool.erase(connection_it);
+		}
+		return -1;
+	}
+
+	out_active.connection = &connection;
+	out_active.channel = channel;
+	return 0;
+}
+
+/**
+  * Looks for a session we are already in.
+  *
+  * @pre none
+  * @post none
+  * @param in_pool Open session server connections
+  * @param in_session_name Chat session name
+  * @param out_active Set to the session if it was found
+  * @return true if we are in the session
+  */
+bool find_session(ConnectionPool& in_pool,
+                  const string& in_session_name,
+                  ActiveSession& out_active) {
+	for (ConnectionPool::iterator connection_it = in_pool.begin(); in_pool.end() != connection_it; ++connection_it) {
+		PooledConnection& connection = connection_it->second;
+		for (map<unsigned short, JoinedSession>::const_iterator session_it = connection.sessions.begin(); connection.sessions.end() != session_it; ++session_it) {
+			if (in_session_name == session_it->second.name) {
+				out_active.connection = &connection;
+				out_active.channel = session_it->first;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/**
+  * Asks the session server for a resume token for a session we are in.  If we
+  * already have one, it is presented first so the session carries on from where
+  * our read position was left when a connection dropped.  The session is gone if
+  * the server no longer has it, or answers for a session with a different name.
+  *
+  * @pre The session is selected on in_channel
+  * @post The session's resume token is up to date if successful; the channel is
+  *       free on the server if the session is gone
+  * @param in_connection Connection the session is on
+  * @param in_channel Channel of the session
+  * @return 0 if successful; 1 if the session is gone; -1 if the connection failed
+  */
+int resume_session(PooledConnection& in_connection,
+                   const unsigned short in_channel) {
+	JoinedSession& joined = in_connection.sessions[in_channel];
+	if (-1 == util_send_frame(in_connection.socket, OP_SERVER_RESUME, in_channel, joined.resume_token.data(), joined.resume_token.length())) {
+		return -1;
+	}
+
+	ActiveSession session;
+	session.connection = &in_connection;
+	session.channel = in_channel;
+	FrameHeader header;
+	const char* payload;
+	do {
+		if (-1 == util_recv_frame(in_connection.socket, in_connection.reader, header, payload)) {
+			return -1;
+		}
+	} while (handle_unsolicited(in_connection, session, header, payload));
+
+	if (OP_SERVER_NO_SESSION == header.opcode) {
+		fprintf(stderr, "The chat session \"%s\" no longer exists\n", joined.name.c_str());
+		return 1;
+	}
+	if (OP_SERVER_RESUME_TOKEN != header.opcode || header.length < RESUME_TOKEN_SIZE) {
+		fprintf(stderr, "Unexpected response opcode %d\n", header.opcode);
+		return -1;
+	}
+
+	// a cached or reconnected address may now belong to a server with a different session
+	if (0 != joined.name.compare(0, string::npos, payload + RESUME_TOKEN_SIZE, header.length - RESUME_TOKEN_SIZE)) {
+		fprintf(stderr, "Chat session \"%s\" is no longer on that session server\n", joined.name.c_str());
+		return (-1 == util_send_frame(in_connection.socket, OP_SERVER_LEAVE, in_channel, NULL, 0)) ? -1 : 1;
+	}
+
+	joined.resume_token.assign(payload, RESUME_TOKEN_SIZE);
+	return 0;
+}
+
+/**
+  * Replaces a dropped session server connection with a new one.  Every session on
+  * it is selected again and resumed where we left off, and the subscribed ones
+  * are subscribed again.  Sessions the server no longer has are forgotten.
+  *
+  * @pre none
+  * @post in_connection has a new socket if successful
+  * @param in_connection Connection to replace
+  * @return 0 if successful; -1 if error
+  */
+int reconnect(PooledConnection& in_connection) {
+	close(in_connection.socket);
+	in_connection.reader = ConnectionReader();
+	in_connection.socket = util_create_client_socket(SOCK_STREAM, IPPROTO_TCP, in_connection.address);
+	if (-1 == in_connection.socket) {
+		return -1;
+	}
+
+	map<unsigned short, JoinedSession>::iterator session_it = in_connection.sessions.begin();
+	while (in_connection.sessions.end() != session_it) {
+		const JoinedSession& joined = session_it->second;
+		if (0 != joined.session_id) {
+			const unsigned int net_session_id = htonl(joined.session_id);
+			if (-1 == util_send_frame(in_connection.socket, OP_SERVER_SELECT_SESSION, session_it->first, reinterpret_cast<const char*>(&net_session_id), sizeof(net_session_id))) {
+				return -1;
+			}
+		}
+
+		const int resume_code = resume_session(in_connection, session_it->first);
+		if (-1 == resume_code) {
+			return -1;
+		}
+		// one session closing down does not take the others with it
+		if (1 == resume_code) {
+			in_connection.sessions.erase(session_it++);
+			continue;
+		}
+
+		if (joined.subscribed && -1 == util_send_frame(in_connection.socket, OP_SERVER_SUBSCRIBE, session_it->first, NULL, 0)) {
+			return -1;
+		}
+		++session_it;
+	}
+
+	return 0;
+}
+
+/**
+  * Checks whether the session server has closed a connection or it has failed.
+  *
+  * @pre none
+  * @post none
+  * @param in_connection Connection to check
+  * @return true if the connection is no longer usable
+  */
+bool connection_lost(const PooledConnection& in_connection) {
+	char byte;
+	const ssize_t num_bytes = recv(in_connection.socket, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+	return 0 == num_bytes || (num_bytes < 0 && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno);
+}
+
+/**
+  * Leaves a session.  The connection is closed once we have left every session on it.
+  *
+  * @pre in_session is a session we are in
+  * @post We are no longer in the session
+  * @param in_pool Open session server connections
+  * @param in_session Session to leave
+  */
+void leave_session(ConnectionPool& in_pool,
+                   const ActiveSession& in_session) {
+	PooledConnection& connection = *in_session.connection;
+	util_send_frame(connection.socket, OP_SERVER_LEAVE, in_session.channel, NULL, 0);
+	connection.sessions.erase(in_session.channel);
+	if (!connection.sessions.empty()) {
+		return;
+	}
+
+	close(connection.socket);
+	for (ConnectionPool::iterator connection_it = in_pool.begin(); in_pool.end() != connection_it; ++connection_it) {
+		if (&connection_it->second == &connection) {
+			in_pool.erase(connection_it);
+			return;
+		}
+	}
+}
+
+/**
+  * Submits a message to the chat session.
+  *
+  * @pre in_session is a session we are in
   * @post Message has been submitted to chat session
-  * @param in_socket Socket file descriptor for chat session server
+  * @param in_session Session to submit to
   * @return 0 if successful; -1 if error
   */
-int do_submit(const int in_socket) {
+int do_submit(const ActiveSession& in_session) {
 	// we need a message to submit
 	string user_arguments;
 	cout << "Message:  ";
@@ -269,17 +886,7 @@ int do_submit(const int in_socket) {
 	}
 
 	// send the message over TCP
-	if (-1 == util_send_tcp(in_socket, CMD_SERVER_SUBMIT.c_str(), CMD_SERVER_SUBMIT.length())) {
-		fprintf(stderr, "Failed to send submit command.  Error is %s\n", strerror(errno));
-		return -1;
-	}
-
-	if (-1 == util_send_tcp(in_socket, user_message.length())) {
-		fprintf(stderr, "Failed to send message length.  Error is %s\n", strerror(errno));
-		return -1;
-	}
-
-	if (-1 == util_send_tcp(in_socket, user_message.c_str(), user_message.length())) {
+	if (-1 == util_send_frame(in_session.connection->socket, OP_SERVER_SUBMIT, in_session.channel, user_message.data(), user_message.length())) {
 		fprintf(stderr, "Failed to send message.  Error is %s\n", strerror(errno));
 		return -1;
 	}
@@ -290,85 +897,357 @@ int do_submit(const int in_socket) {
 /**
   * Gets the next unread message from the chat session server.
   *
-  * @pre in_socket is a valid socket file descriptor
+  * @pre in_session is a session we are in
   * @post One unread message has been retrieved from chat session if it exists
-  * @param in_socket Socket file descriptor for chat session server
+  * @param in_session Session to read
   * @return 0 if successful; -1 if error
   */
-int do_get_next(const int in_socket) {
+int do_get_next(const ActiveSession& in_session) {
 	// send the coomand
-	if (0 != util_send_tcp(in_socket, CMD_SERVER_GET_NEXT.c_str(), CMD_SERVER_GET_NEXT.length())) {
+	if (0 != util_send_frame(in_session.connection->socket, OP_SERVER_GET_NEXT, in_session.channel, NULL, 0)) {
 		fprintf(stderr, "Failure during get_next\n");
 		return -1;
 	}
 
-	return print_session_message(in_socket);
+	unsigned int num_msgs = 1;
+	return print_session_messages(in_session, num_msgs);
 }
 
 /**
   * Gets all unread messages from the chat session server.
   *
-  * @pre in_socket is a valid socket file descriptor
+  * @pre in_session is a session we are in
   * @post All unread messages have been retrieved from chat session if they exist
-  * @param in_socket Socket file descriptor for chat session server
+  * @param in_session Session to read
+  * @param in_accept_batch Let the server send the messages in compressed batches
   * @return 0 if successful; -1 if error
   */
-int do_get_all(const int in_socket) {
+int do_get_all(const ActiveSession& in_session,
+               const bool in_accept_batch) {
 	// send the coomand
-	if (0 != util_send_tcp(in_socket, CMD_SERVER_GET_ALL.c_str(), CMD_SERVER_GET_ALL.length())) {
+	const char options = in_accept_batch ? GET_ALL_ACCEPT_BATCH : 0;
+	if (0 != util_send_frame(in_session.connection->socket, OP_SERVER_GET_ALL, in_session.channel, &options, sizeof(options))) {
 		fprintf(stderr, "Failure during get_all\n");
 		return -1;
 	}
 
-	int num_msgs;
-	if (-1 == util_recv_tcp(in_socket, num_msgs)) {
+	FrameHeader header;
+	const char* payload;
+	if (-1 == recv_response(in_session, header, payload)) {
 		fprintf(stderr, "Failed to receive number of messages\n");
 		return -1;
 	}
 
-	if (-1 == num_msgs) {
+	if (OP_SERVER_NO_MESSAGE == header.opcode) {
 		printf("No new messages in the chat session\n");
 	}
-	else {
-		for (int i = 0; i < num_msgs; i++) {
-			print_session_message(in_socket);
+	else if (OP_SERVER_MESSAGE_COUNT == header.opcode && sizeof(unsigned int) == header.length) {
+		unsigned int net_num_msgs;
+		memcpy(&net_num_msgs, payload, sizeof(net_num_msgs));
+		unsigned int num_msgs = ntohl(net_num_msgs);
+
+		while (num_msgs > 0) {
+			if (-1 == print_session_messages(in_session, num_msgs)) {
+				return -1;
+			}
 		}
 	}
+	else {
+		fprintf(stderr, "Unexpected response opcode %d\n", header.opcode);
+		return -1;
+	}
 
 	return 0;
 }
 
 /**
-  * Implementation of GetNext and GetAll methods.
+  * Gets a snapshot of the chat session server's counters and prints it.
   *
-  * @pre in_socket is a valid socket file descriptor
-  * @post Requested number of unread messages have been retrieved from chat session if they exist
-  * @param in_socket Socket file descriptor for chat session server
+  * @pre in_session is a session we are in
+  * @post The snapshot has been printed
+  * @param in_session Session whose server to ask
   * @return 0 if successful; -1 if error
   */
-int print_session_message(const int in_socket) {
-	// get the message length first
-	int msg_len;
-	if(-1 == util_recv_tcp(in_socket, msg_len)) {
-		fprintf(stderr, "Failed to get message length.  Error is %s\n", strerror(errno));
+int do_stats(const ActiveSession& in_session) {
+	if (0 != util_send_frame(in_session.connection->socket, OP_SERVER_STATS, in_session.channel, NULL, 0)) {
+		fprintf(stderr, "Failure during stats\n");
 		return -1;
 	}
-	
-	// if we literally recv'd -1 from the socket then there is no message
-	if (-1 == msg_len) {
+
+	FrameHeader header;
+	const char* payload;
+	if (-1 == recv_response(in_session, header, payload)) {
+		fprintf(stderr, "Failed to receive stats\n");
+		return -1;
+	}
+
+	if (OP_SERVER_STATS_REPLY != header.opcode) {
+		fprintf(stderr, "Unexpected response opcode %d\n", header.opcode);
+		return -1;
+	}
+
+	printf("%.*s", static_cast<int>(header.length), payload);
+	return 0;
+}
+
+/**
+  * Implementation of GetNext and GetAll methods.  Receives one response frame and
+  * prints the messages in it: a single message, or a compressed batch of them.
+  *
+  * @pre in_session is a session we are in
+  * @post The messages in the frame have been printed
+  * @param in_session Session the messages are from
+  * @param io_remaining Number of messages still expected.  Reduced by the number printed.
+  * @return 0 if successful; -1 if error
+  */
+int print_session_messages(const ActiveSession& in_session,
+                           unsigned int& io_remaining) {
+	FrameHeader header;
+	const char* payload;
+	if (-1 == recv_response(in_session, header, payload)) {
+		fprintf(stderr, "Failed to get message.  Error is %s\n", strerror(errno));
+		return -1;
+	}
+
+	// the server has nothing for us
+	if (OP_SERVER_NO_MESSAGE == header.opcode) {
 		printf("No new message in the chat session\n");
+		io_remaining = 0;
+		return 0;
+	}
+
+	if (OP_SERVER_MESSAGE == header.opcode) {
+		printf("%.*s\n", static_cast<int>(header.length), payload);
+		--io_remaining;
 		return 0;
 	}
 
-	// then the response
-	char recv_buffer[BUFFER_SIZE];
+	if (OP_SERVER_MESSAGE_BATCH != header.opcode || header.length < sizeof(uint32_t)) {
+		fprintf(stderr, "Unexpected response opcode %d\n", header.opcode);
+		return -1;
+	}
 
-	if (-1 == util_recv_tcp(in_socket, recv_buffer, msg_len)) {
-		fprintf(stderr, "Failed to get message.  Error is %s\n", strerror(errno));
+	uint32_t net_original_len;
+	memcpy(&net_original_len, payload, sizeof(net_original_len));
+	const uint32_t original_len = ntohl(net_original_len);
+	const char* const block = payload + sizeof(net_original_len);
+	const unsigned int block_len = header.length - sizeof(net_original_len);
+	if (0 == original_len || original_len > MAX_FRAME_PAYLOAD || block_len > original_len) {
+		fprintf(stderr, "Malformed message batch from the chat session server\n");
+		return -1;
+	}
+
+	// a block that did not shrink was sent as is
+	vector<char> original(original_len);
+	if (block_len == original_len) {
+		memcpy(&original[0], block, block_len);
+	}
+	else if (-1 == decompress_block(block, block_len, &original[0], original_len)) {
+		fprintf(stderr, "Malformed message batch from the chat session server\n");
+		return -1;
+	}
+
+	const unsigned int num_printed = print_message_frames(string(), &original[0], original_len);
+	if (0 == num_printed || num_printed > io_remaining) {
+		fprintf(stderr, "Message batch does not match the message count\n");
 		return -1;
 	}
+	io_remaining -= num_printed;
+	return 0;
+}
+
+/**
+  * Receives the response to a request.  Pushes and notices for any session on the
+  * connection that arrive ahead of the response are handled on the way.
+  *
+  * @pre in_session is a session we are in
+  * @post One response frame has been received
+  * @param in_session Session the request was sent for
+  * @param out_header Header of the response
+  * @param out_payload Payload of the response, valid until the connection's reader is used again
+  * @return 0 if successful; -1 if error
+  */
+int recv_response(const ActiveSession& in_session,
+                  FrameHeader& out_header,
+                  const char*& out_payload) {
+	PooledConnection& connection = *in_session.connection;
+	for (;;) {
+		if (-1 == util_recv_frame(connection.socket, connection.reader, out_header, out_payload)) {
+			return -1;
+		}
+
+		if (!handle_unsolicited(connection, in_session, out_header, out_payload)) {
+			break;
+		}
+	}
 
-	printf("%s\n", recv_buffer);
+	if (OP_SERVER_NO_SESSION == out_header.opcode) {
+		fprintf(stderr, "The chat session no longer exists - Leave it and start or join another\n");
+		return -1;
+	}
 	return 0;
 }
 
+/**
+  * Waits for the user to type a command, printing messages the session servers
+  * push for any session we are subscribed to in the meantime.
+  *
+  * @pre stdin is unbuffered
+  * @post stdin has input ready
+  * @param in_pool Open session server connections
+  * @param in_active The session commands go to
+  * @return 0 if successful; -1 if error
+  */
+int wait_for_command(ConnectionPool& in_pool,
+                     const ActiveSession& in_active) {
+	for (;;) {
+		// connections with subscribed sessions - nothing else arrives unasked
+		vector<PooledConnection*> listening;
+		for (ConnectionPool::iterator connection_it = in_pool.begin(); in_pool.end() != connection_it; ++connection_it) {
+			PooledConnection& connection = connection_it->second;
+			for (map<unsigned short, JoinedSession>::const_iterator session_it = connection.sessions.begin(); connection.sessions.end() != session_it; ++session_it) {
+				if (session_it->second.subscribed) {
+					listening.push_back(&connection);
+					break;
+				}
+			}
+		}
+
+		// a whole frame may already be buffered - the socket won't poll readable for it
+		bool handled = false;
+		for (size_t i = 0; i < listening.size() && !handled; ++i) {
+			FrameHeader header;
+			const char* payload;
+			if (1 == listening[i]->reader.next_frame(header, payload)) {
+				printf("\n");
+				handle_unsolicited(*listening[i], in_active, header, payload);
+				cout << "Chat Client>>  ";
+				cout.flush();
+				handled = true;
+			}
+		}
+		if (handled) {
+			continue;
+		}
+
+		vector<struct pollfd> fds(1 + listening.size());
+		fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < listening.size(); ++i) {
+			fds[i + 1].fd = listening[i]->socket;
+			fds[i + 1].events = POLLIN;
+		}
+		if (poll(&fds[0], fds.size(), -1) < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			fprintf(stderr, "poll failed.  Error is %s\n", strerror(errno));
+			return -1;
+		}
+
+		if (0 != fds[0].revents) {
+			return 0;
+		}
+
+		for (size_t i = 0; i < listening.size(); ++i) {
+			if (0 != fds[i + 1].revents && -1 == listening[i]->reader.fill(listening[i]->socket)) {
+				if (0 == reconnect(*listening[i])) {
+					fprintf(stderr, "Reconnected to a chat session server\n");
+					continue;
+				}
+
+				// stop listening - the next command on the connection reports the failure
+				fprintf(stderr, "Lost the connection to a chat session server\n");
+				for (map<unsigned short, JoinedSession>::iterator session_it = listening[i]->sessions.begin(); listening[i]->sessions.end() != session_it; ++session_it) {
+					session_it->second.subscribed = false;
+				}
+			}
+		}
+	}
+}
+
+/**
+  * Handles a frame the server sent without being asked: a push, a notice that
+  * unread history was dropped, or a notice that a session on another channel is gone.
+  *
+  * @pre none
+  * @post A push has been printed; a session that is gone has been forgotten
+  * @param in_connection Connection the frame arrived on
+  * @param in_active The session commands go to
+  * @param in_header Header of the frame
+  * @param in_payload Payload of the frame
+  * @return true if the frame was handled; false if it is a response
+  */
+bool handle_unsolicited(PooledConnection& in_connection,
+                        const ActiveSession& in_active,
+                        const FrameHeader& in_header,
+                        const char* const in_payload) {
+	const bool is_active = (&in_connection == in_active.connection && in_header.flags == in_active.channel);
+	map<unsigned short, JoinedSession>::iterator session_it = in_connection.sessions.find(in_header.flags);
+
+	if (OP_SERVER_PUSH == in_header.opcode) {
+		// messages from another session say where they are from
+		print_message_frames((is_active || in_connection.sessions.end() == session_it) ? string() : session_it->second.name,
+		                     in_payload, in_header.length);
+		return true;
+	}
+
+	// history we never read was dropped - whatever comes next carries on after it
+	if (OP_SERVER_GAP == in_header.opcode) {
+		unsigned int net_num_skipped = 0;
+		if (sizeof(net_num_skipped) == in_header.length) {
+			memcpy(&net_num_skipped, in_payload, sizeof(net_num_skipped));
+		}
+		fprintf(stderr, "%u messages in \"%s\" were dropped from the history before you read them\n", ntohl(net_num_skipped),
+		        (in_connection.sessions.end() == session_it) ? "" : session_it->second.name.c_str());
+		return true;
+	}
+
+	// a session on another channel did not exist when we selected it
+	if (OP_SERVER_NO_SESSION == in_header.opcode && !is_active) {
+		if (in_connection.sessions.end() != session_it) {
+			fprintf(stderr, "The chat session \"%s\" no longer exists\n", session_it->second.name.c_str());
+			in_connection.sessions.erase(session_it);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/**
+  * Prints a run of OP_SERVER_MESSAGE frames, as carried by an OP_SERVER_PUSH frame
+  * or a decompressed OP_SERVER_MESSAGE_BATCH.
+  *
+  * @pre none
+  * @post Every complete message in in_payload has been printed
+  * @param in_session_name Session to label the messages with.  Empty for the active session.
+  * @param in_payload The frames
+  * @param in_payload_len Number of bytes in in_payload
+  * @return Number of messages printed
+  */
+unsigned int print_message_frames(const string& in_session_name,
+                                  const char* const in_payload,
+                                  const unsigned int in_payload_len) {
+	unsigned int num_printed = 0;
+	unsigned int offset = 0;
+	while (in_payload_len - offset >= static_cast<unsigned int>(FRAME_HEADER_SIZE)) {
+		FrameHeader header;
+		if (-1 == util_decode_frame_header(in_payload + offset, header) ||
+		    in_payload_len - offset - FRAME_HEADER_SIZE < header.length) {
+			fprintf(stderr, "Malformed messages from the chat session server\n");
+			break;
+		}
+
+		if (OP_SERVER_MESSAGE == header.opcode) {
+			if (!in_session_name.empty()) {
+				printf("[%s] ", in_session_name.c_str());
+			}
+			printf("%.*s\n", static_cast<int>(header.length), in_payload + offset + FRAME_HEADER_SIZE);
+			++num_printed;
+		}
+		offset += FRAME_HEADER_SIZE + header.length;
+	}
+	fflush(stdout);
+	return num_printed;
+}
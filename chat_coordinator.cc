@@ -5,42 +5,266 @@
  * @brief Chat Coordinator implementation
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <map>
 #include <signal.h>
 #include <string>
 #include <unistd.h>
+#include <vector>
 
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "strings.h"
 #include "socket_utils.h"
 
 using std::map;
 using std::string;
+using std::vector;
 
 /** Name of the chat server executable we will spawn */
 const string SERVER_EXE = "chat_server.exe";
 
 
+/** Number of worker threads each session server runs with unless -w is given */
+const int DEFAULT_SESSION_WORKERS = 1;
+/** Number of session servers kept started ahead of time unless -p is given */
+const int DEFAULT_WARM_SERVERS = 0;
+/** How long to wait before trying again after a warm server failed to start.  Value is in milliseconds. */
+const int REFILL_RETRY_DELAY = 1000;
+/** How long the hosting session server gets to confirm a new session.  Value is in seconds. */
+const int CONTROL_TIMEOUT = 2;
+/** Requests are counted by opcode.  Slot 0 counts the ones we don't recognize. */
+const int NUM_COORDINATOR_REQUESTS = OP_COORDINATOR_LIST + 1;
+/** Name of each request type in a List reply */
+const char* const COORDINATOR_REQUEST_NAMES[NUM_COORDINATOR_REQUESTS] = { "unknown", "start", "find", "terminate", "report", "list" };
+/** Length of the window the recent request rate is measured over.  Value is in seconds. */
+const int RATE_WINDOW = 60;
+/** Number of recent Start latencies the percentiles in a List reply are taken from */
+const int START_LATENCY_SAMPLES = 1024;
+/** Most text in one page of a List reply */
+const unsigned int MAX_LIST_PAGE = BUFFER_SIZE - 1 - FRAME_HEADER_SIZE - REQUEST_ID_SIZE;
+
+/**
+  * Settings handed to every session server the coordinator starts.
+  */
+struct SessionOptions {
+	SessionOptions() :
+		num_workers(DEFAULT_SESSION_WORKERS),
+		persist_dir(),
+		retain_messages(0),
+		retain_bytes(0),
+		retain_seconds(0),
+		num_warm_servers(DEFAULT_WARM_SERVERS),
+		host_sessions(false) {
+	}
+
+	/** Number of worker threads per session server */
+	int num_workers;
+	/** Directory for persistent session logs.  Empty keeps history in memory only. */
+	string persist_dir;
+	/** Most messages each session keeps.  0 for no limit. */
+	unsigned long retain_messages;
+	/** Most bytes of message text each session keeps.  0 for no limit. */
+	unsigned long retain_bytes;
+	/** Longest each session keeps a message, in seconds.  0 for no limit. */
+	unsigned long retain_seconds;
+	/** Number of idle session servers to keep ready for Start */
+	int num_warm_servers;
+	/** Host every session in one session server instead of one process each */
+	bool host_sessions;
+};
+
+/**
+  * A session server started with a control channel: either one that was started
+  * ahead of time and waits for a session, or the one hosting every session (-m).
+  * Its socket is already bound and listening, so Start only has to name the session.
+  */
+struct ControlledServer {
+	ControlledServer() :
+		port(-1),
+		control_socket(-1) {
+	}
+
+	/** TCP port the server is listening on */
+	int port;
+	/** Our end of the server's control channel.  -1 if the server is not running. */
+	int control_socket;
+};
+
+/**
+  * Where clients find a chat session, and what its session server last reported
+  * about it.
+  */
+struct SessionLocation {
+	SessionLocation() :
+		port(-1),
+		session_id(0),
+		started(0),
+		pid(0),
+		clients(0),
+		messages(0),
+		reported(0) {
+	}
+
+	/** TCP port of the session server.  -1 if there is no such session. */
+	int port;
+	/** ID to select the session with on a hosting server.  0 if the server has no other session. */
+	unsigned int session_id;
+	/** When the session was started */
+	time_t started;
+	/** Process ID of the session server.  0 until it reports. */
+	int pid;
+	/** Number of connected clients at the last report */
+	unsigned int clients;
+	/** Number of stored messages at the last report */
+	unsigned int messages;
+	/** When the last report arrived.  0 if there has been none. */
+	time_t reported;
+};
+
+/**
+  * The coordinator's own counters, for List and SIGUSR1.
+  */
+struct CoordinatorStats {
+	CoordinatorStats() :
+		started(time(NULL)),
+		num_batches(0),
+		num_datagrams(0),
+		requests(),
+		window_requests(),
+		window_seconds(),
+		num_starts(0),
+		total_start_us(0),
+		start_latencies(START_LATENCY_SAMPLES, 0) {
+	}
+
+	/** When the coordinator started */
+	time_t started;
+	/** Number of recvmmsg() batches */
+	unsigned long num_batches;
+	/** Number of datagrams received */
+	unsigned long num_datagrams;
+	/** Requests received, by opcode */
+	unsigned long requests[NUM_COORDINATOR_REQUESTS];
+	/** Requests received in each of the last RATE_WINDOW seconds, by second modulo RATE_WINDOW */
+	unsigned long window_requests[RATE_WINDOW];
+	/** Second each slot of window_requests is counting */
+	time_t window_seconds[RATE_WINDOW];
+	/** Number of Start requests served */
+	unsigned long num_starts;
+	/** Total time spent serving them in microseconds */
+	unsigned long total_start_us;
+	/** Latency of the last START_LATENCY_SAMPLES Starts in microseconds.  Start number n is in slot n % START_LATENCY_SAMPLES. */
+	vector<unsigned int> start_latencies;
+};
+
+
+/** Set by SIGUSR1 - print the batching statistics */
+volatile sig_atomic_t g_print_stats = 0;
+
+
 /* function declarations */
-int do_start(const string&, map<string, int>&, const int);
-int do_find(const string&, const map<string, int>&);
-void do_terminate(const string&, map<string, int>&);
+void request_stats(int);
+int spawn_server(const string&, const int, const SessionOptions&, const int);
+int start_controlled_server(ControlledServer&, const int, const SessionOptions&);
+int assign_warm_server(vector<ControlledServer>&, const string&);
+int assign_hosted_session(ControlledServer&, map<string, SessionLocation>&, const string&, const int, const SessionOptions&);
+SessionLocation do_start(const string&, map<string, SessionLocation>&, vector<ControlledServer>&, ControlledServer&, const int, const SessionOptions&);
+SessionLocation do_find(const string&, const map<string, SessionLocation>&);
+void do_terminate(const string&, map<string, SessionLocation>&);
+void do_report(const char* const, const unsigned int, map<string, SessionLocation>&);
+bool do_list(const string&, const map<string, SessionLocation>&, const CoordinatorStats&, string&);
+void count_request(CoordinatorStats&, const unsigned char);
+void record_start(CoordinatorStats&, const unsigned int);
+uint64_t now_us();
 
 /**
   * Main - entry point of program
   *
+  * @param argc Number of command line arguments
+  * @param argv Command line arguments
   * @return 0 if success; any other value if error
   */
-int main() {
-	// this will be the mapping between chat session names and TCP port numbers
-	map<string, int> chat_session_map;
+int main(const int argc, char** const argv) {
+	// how each session server should run
+	SessionOptions session_options;
+
+	bool workers_given = false;
+	int option;
+	while (-1 != (option = getopt(argc, argv, "w:d:p:mn:b:a:"))) {
+		switch (option) {
+			case 'w':
+				session_options.num_workers = atoi(optarg);
+				workers_given = true;
+				break;
+			case 'd':
+				session_options.persist_dir = optarg;
+				break;
+			case 'p':
+				session_options.num_warm_servers = atoi(optarg);
+				break;
+			case 'm':
+				session_options.host_sessions = true;
+				break;
+			case 'n':
+				session_options.retain_messages = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				session_options.retain_bytes = strtoul(optarg, NULL, 10);
+				break;
+			case 'a':
+				session_options.retain_seconds = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "Usage: chat_coordinator.exe [-w session worker threads] [-d session log directory] [-p warm session servers | -m]\n"
+				                "                            [-n messages kept] [-b bytes kept] [-a seconds kept]\n");
+				exit(1);
+		}
+	}
+
+	// the hosting server runs one event loop per core unless told otherwise
+	if (session_options.host_sessions && !workers_given) {
+		session_options.num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	if (session_options.num_workers < 1) {
+		fprintf(stderr, "Session worker threads must be at least 1\n");
+		exit(1);
+	}
+
+	if (session_options.num_warm_servers < 0) {
+		fprintf(stderr, "Warm session servers must be at least 0\n");
+		exit(1);
+	}
+
+	if (session_options.host_sessions && session_options.num_warm_servers > 0) {
+		fprintf(stderr, "-p and -m can not be used together\n");
+		exit(1);
+	}
+
+	// session servers are never waited for
+	signal(SIGCHLD, SIG_IGN);
+
+	// each session keeps its log in a directory of its own under here
+	if (!session_options.persist_dir.empty() && 0 != mkdir(session_options.persist_dir.c_str(), 0755) && EEXIST != errno) {
+		fprintf(stderr, "Failed to create %s.  Error is %s\n", session_options.persist_dir.c_str(), strerror(errno));
+		exit(1);
+	}
+
+	// this will be the mapping between chat session names and where to find them
+	map<string, SessionLocation> chat_session_map;
 
 	// create the server socket
 	const int coordinator_socket = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, NULL, 0);
@@ -49,41 +273,149 @@ int main() {
 	const int server_port = util_get_port_number(coordinator_socket);
 	printf("Chat Coordinator started on UDP port %d\n", server_port);
 
+	// session servers waiting for a Start
+	vector<ControlledServer> warm_servers;
+
+	// the session server hosting every session, if there is one
+	ControlledServer host_server;
+	if (session_options.host_sessions) {
+		if (-1 == start_controlled_server(host_server, server_port, session_options)) {
+			exit(1);
+		}
+		printf("Chat Coordinator hosting sessions on TCP port %d\n", host_server.port);
+	}
+
+	// kill -USR1 prints how well the datagrams are batching.  No SA_RESTART, so
+	// the signal wakes up poll().
+	struct sigaction stats_action;
+	memset(&stats_action, 0, sizeof(stats_action));
+	stats_action.sa_handler = request_stats;
+	sigemptyset(&stats_action.sa_mask);
+	sigaction(SIGUSR1, &stats_action, NULL);
+
 	//
 	// begin main loop
 	//
-	char receive_buffer[BUFFER_SIZE];
-	struct sockaddr_in remote_addr;
-	socklen_t remote_addr_len = sizeof(remote_addr);
+	// big enough to keep off the stack
+	static DatagramBatch requests;
+	static DatagramBatch replies;
+	replies.count = 0;
+
+	// batching statistics and what List reports about us
+	CoordinatorStats stats;
+
+	// a warm server that failed to start is not tried again until then
+	uint64_t refill_after_us = 0;
 
 	for (;;) {
-		// receive the message with our command
-		if(-1 == util_recv_udp(coordinator_socket, receive_buffer, BUFFER_SIZE - 1, (struct sockaddr *)&remote_addr, remote_addr_len)) {
-			fprintf(stderr, "Error reading socket.  Error is %s\n", strerror(errno));
+		if (0 != g_print_stats) {
+			g_print_stats = 0;
+			printf("Chat Coordinator - %lu datagrams in %lu batches, average batch size %.2f\n",
+			       stats.num_datagrams, stats.num_batches, (0 == stats.num_batches) ? 0.0 : static_cast<double>(stats.num_datagrams) / stats.num_batches);
+			fflush(stdout);
 		}
-		const string command(receive_buffer);
 
-		// receive the chat seesion name
-		if(-1 == util_recv_udp(coordinator_socket, receive_buffer, BUFFER_SIZE - 1, (struct sockaddr *)&remote_addr, remote_addr_len)) {
-			fprintf(stderr, "Error reading socket.  Error is %s\n", strerror(errno));
+		// the pool is topped up one server per pass, and only while no request is waiting,
+		// so a burst of Starts is never answered behind a row of process creations
+		int poll_timeout = -1;
+		if (static_cast<int>(warm_servers.size()) < session_options.num_warm_servers) {
+			const uint64_t now = now_us();
+			poll_timeout = (now >= refill_after_us) ? 0 : static_cast<int>((refill_after_us - now + 999) / 1000);
 		}
-		const string session_name(receive_buffer);
 
-		// perform the requested operation
-		if (CMD_COORDINATOR_START == command) {
-			const int code = do_start(session_name, chat_session_map, server_port);
-			util_send_udp(coordinator_socket, code, (struct sockaddr *)&remote_addr);
+		struct pollfd request_poll;
+		request_poll.fd = coordinator_socket;
+		request_poll.events = POLLIN;
+		request_poll.revents = 0;
+		const int poll_code = poll(&request_poll, 1, poll_timeout);
+		if (poll_code < 0) {
+			if (EINTR != errno) {
+				fprintf(stderr, "poll failed.  Error is %s\n", strerror(errno));
+			}
+			continue;
+		}
+		if (0 == poll_code) {
+			if (now_us() >= refill_after_us) {
+				ControlledServer warm_server;
+				if (-1 == start_controlled_server(warm_server, server_port, session_options)) {
+					refill_after_us = now_us() + static_cast<uint64_t>(REFILL_RETRY_DELAY) * 1000;
+				}
+				else {
+					warm_servers.push_back(warm_server);
+				}
+			}
+			continue;
 		}
-		else if (CMD_COORDINATOR_FIND == command) {
-			const int code = do_find(session_name, chat_session_map);
-			util_send_udp(coordinator_socket, code, (struct sockaddr *)&remote_addr);
+
+		// drain everything that is queued with one syscall
+		if (-1 == util_recv_udp_batch(coordinator_socket, requests)) {
+			if (EINTR != errno) {
+				fprintf(stderr, "Error reading socket.  Error is %s\n", strerror(errno));
+			}
+			continue;
 		}
-		else if (CMD_COORDINATOR_TERMINATE == command) {
-			do_terminate(session_name, chat_session_map);
+		++stats.num_batches;
+		stats.num_datagrams += requests.count;
+
+		for (int i = 0; i < requests.count; ++i) {
+			// each datagram is one whole request: the command, its ID and the session name
+			FrameHeader header;
+			const char* payload;
+			if (-1 == requests.length[i] || -1 == util_decode_frame(requests.data[i], requests.length[i], header, payload) || header.length < REQUEST_ID_SIZE) {
+				fprintf(stderr, "Chat Coordinator - ignoring malformed request\n");
+				continue;
+			}
+
+			count_request(stats, header.opcode);
+
+			// a report is not a session name - it holds the server's records
+			if (OP_COORDINATOR_REPORT == header.opcode) {
+				do_report(payload + REQUEST_ID_SIZE, header.length - REQUEST_ID_SIZE, chat_session_map);
+				continue;
+			}
+
+			const string session_name(payload + REQUEST_ID_SIZE, header.length - REQUEST_ID_SIZE);
+			const struct sockaddr_in& remote_addr = requests.peer[i];
+
+			// perform the requested operation - replies go out together after the batch
+			SessionLocation location;
+			switch (header.opcode) {
+				case OP_COORDINATOR_START: {
+					const uint64_t start_begin = now_us();
+					location = do_start(session_name, chat_session_map, warm_servers, host_server, server_port, session_options);
+					record_start(stats, now_us() - start_begin);
+					break;
+				}
+				case OP_COORDINATOR_FIND:
+					location = do_find(session_name, chat_session_map);
+					break;
+				case OP_COORDINATOR_TERMINATE:
+					do_terminate(session_name, chat_session_map);
+					continue;
+				case OP_COORDINATOR_LIST: {
+					// one page per request - the name is where the last page stopped
+					string page(payload, REQUEST_ID_SIZE);
+					const unsigned short flags = do_list(session_name, chat_session_map, stats, page) ? FLAG_LIST_MORE : 0;
+					util_add_udp_frame(replies, OP_COORDINATOR_LIST_REPLY, flags, page.data(), page.length(), remote_addr);
+					continue;
+				}
+				default:
+					fprintf(stderr, "Chat Coordinator - unrecognized opcode:  ->%d<-\n", header.opcode);
+					break;
+			}
+
+			// echo the request ID so the client can match the reply
+			char reply[REQUEST_ID_SIZE + sizeof(int) + sizeof(unsigned int)];
+			const int net_port = htonl(location.port);
+			const unsigned int net_session_id = htonl(location.session_id);
+			memcpy(reply, payload, REQUEST_ID_SIZE);
+			memcpy(reply + REQUEST_ID_SIZE, &net_port, sizeof(net_port));
+			memcpy(reply + REQUEST_ID_SIZE + sizeof(net_port), &net_session_id, sizeof(net_session_id));
+			util_add_udp_frame(replies, OP_COORDINATOR_REPLY, 0, reply, sizeof(reply), remote_addr);
 		}
-		else {
-			fprintf(stderr, "Chat Coordinator - unrecognized command:  ->%s<-\n", command.c_str());
-			util_send_udp(coordinator_socket, -1, (struct sockaddr *)&remote_addr);
+
+		if (replies.count > 0) {
+			util_send_udp_batch(coordinator_socket, replies);
 		}
 	}
 
@@ -92,89 +424,331 @@ int main() {
 }
 
 /**
-  * Starts a new chat session server with the requested name.
-  * A new process is created for each session server.
+  * SIGUSR1 handler.  Asks the main loop to print the batching statistics.
+  *
+  * @param in_signal Signal number
+  */
+void request_stats(int in_signal) {
+	(void)in_signal;
+	g_print_stats = 1;
+}
+
+/**
+  * Starts a new chat session server with the requested name.  With -m the hosting
+  * server creates the session.  Otherwise a warm server from the pool is used if
+  * there is one, or a new process is created for it.
   *
   * @pre in_session_name is a non-empty string
-  * @post A new session server has been spawned
+  * @post A session server is serving in_session_name
   * @param in_session_name Name of the chat session server
-  * @param in_chat_session_map Contains a mapping of names to TCP port numbers
+  * @param in_chat_session_map Contains a mapping of names to session locations
+  * @param in_warm_servers Pool of session servers waiting for a session
+  * @param in_host_server Session server hosting every session with -m
   * @param in_server_port UDP port number of the chat coordinator
-  * @return TCP port of the session server if successul; -1 if error
+  * @param in_options Settings to pass to the session server
+  * @return Location of the new session; port is -1 if error
   */
-int do_start(const string& in_session_name,
-             map<string, int>& in_chat_session_map,
-             const int in_server_port) {
-	int return_code = 0;
+SessionLocation do_start(const string& in_session_name,
+                         map<string, SessionLocation>& in_chat_session_map,
+                         vector<ControlledServer>& in_warm_servers,
+                         ControlledServer& in_host_server,
+                         const int in_server_port,
+                         const SessionOptions& in_options) {
+	SessionLocation location;
+
 	// see if an existing chat session is available
-	if ( in_chat_session_map.end() == in_chat_session_map.find(in_session_name)) {
-		const int session_socket = util_create_server_socket(SOCK_STREAM, IPPROTO_TCP, NULL, 0);
-		const int session_port = util_get_port_number(session_socket);
+	if (in_chat_session_map.end() != in_chat_session_map.find(in_session_name)) {
+		return location;
+	}
 
-		// start the socket listening for connections
-		if (-1 == util_listen(session_socket)) {
-			fprintf(stderr, "Failed to listen on socket.  Error is %s\n", strerror(errno));
+	if (in_options.host_sessions) {
+		const int session_id = assign_hosted_session(in_host_server, in_chat_session_map, in_session_name, in_server_port, in_options);
+		if (-1 == session_id) {
+			return SessionLocation();
+		}
+		// read the port afterwards - a lost host is replaced by one on a new port
+		location.port = in_host_server.port;
+		location.session_id = session_id;
+	}
+	else {
+		// the fast way - name a server that is already running
+		location.port = assign_warm_server(in_warm_servers, in_session_name);
+		if (-1 == location.port) {
+			location.port = spawn_server(in_session_name, in_server_port, in_options, -1);
 		}
+	}
 
-		// socket file descriptor
-		char fd_str[BUFFER_SIZE];
-		memset(fd_str, 0, BUFFER_SIZE);
-		sprintf(fd_str, "%d", session_socket);
+	if (-1 != location.port) {
+		// tell the client how to connect to the session server
+		printf("Session \"%s\" started on TCP port %d\n", in_session_name.c_str(), location.port);
+		location.started = time(NULL);
+		in_chat_session_map.insert(std::make_pair<string, SessionLocation>(in_session_name, location));
+	}
 
-		// coordinator port number
-		char port_str[BUFFER_SIZE];
-		memset(port_str, 0, BUFFER_SIZE);
-		sprintf(port_str, "%d", in_server_port);
+	return location;
+}
 
-		// start session server using fork and execl
-		signal(SIGCHLD, SIG_IGN);
-		const pid_t fork_code = fork();
-		if (-1 == fork_code) {
-			fprintf(stderr, "fork called failed!  Error is %s\n", strerror(errno));
+/**
+  * Creates a listening socket and a session server process to serve it.
+  *
+  * @pre none
+  * @post A new session server has been spawned
+  * @param in_session_name Name of the chat session.  Ignored if in_control_socket is given.
+  * @param in_server_port UDP port number of the chat coordinator
+  * @param in_options Settings to pass to the session server
+  * @param in_control_socket Server's end of a control channel to receive sessions on.  -1 for none.
+  * @return TCP port of the session server if successul; -1 if error
+  */
+int spawn_server(const string& in_session_name,
+                 const int in_server_port,
+                 const SessionOptions& in_options,
+                 const int in_control_socket) {
+	// the session server binds one more socket per extra worker to the same port
+	const bool reuse_port = (in_options.num_workers > 1);
+	const int session_socket = util_create_server_socket(SOCK_STREAM, IPPROTO_TCP, NULL, 0, reuse_port);
+	if (-1 == session_socket) {
+		return -1;
+	}
+	const int session_port = util_get_port_number(session_socket);
+
+	// start the socket listening for connections
+	if (-1 == util_listen(session_socket)) {
+		fprintf(stderr, "Failed to listen on socket.  Error is %s\n", strerror(errno));
+	}
+
+	// socket file descriptor
+	char fd_str[BUFFER_SIZE];
+	memset(fd_str, 0, BUFFER_SIZE);
+	sprintf(fd_str, "%d", session_socket);
+
+	// coordinator port number
+	char port_str[BUFFER_SIZE];
+	memset(port_str, 0, BUFFER_SIZE);
+	sprintf(port_str, "%d", in_server_port);
+
+	// number of worker threads
+	char workers_str[BUFFER_SIZE];
+	memset(workers_str, 0, BUFFER_SIZE);
+	sprintf(workers_str, "%d", in_options.num_workers);
+
+	// the first three arguments are positional, the rest are options
+	vector<string> server_args;
+	server_args.push_back(fd_str);
+	server_args.push_back(port_str);
+	server_args.push_back(in_session_name);
+	server_args.push_back("-w");
+	server_args.push_back(workers_str);
+	if (!in_options.persist_dir.empty()) {
+		server_args.push_back("-d");
+		server_args.push_back(in_options.persist_dir);
+	}
+
+	// retention limits - a limit that is not set is left out
+	const char* const retain_flags[3] = { "-n", "-b", "-a" };
+	const unsigned long retain_limits[3] = { in_options.retain_messages, in_options.retain_bytes, in_options.retain_seconds };
+	for (int i = 0; i < 3; ++i) {
+		if (0 != retain_limits[i]) {
+			char limit_str[BUFFER_SIZE];
+			sprintf(limit_str, "%lu", retain_limits[i]);
+			server_args.push_back(retain_flags[i]);
+			server_args.push_back(limit_str);
 		}
-		else if (0 == fork_code) {
-			//
-			// CHILD PROCESS
-			//
+	}
+	if (-1 != in_control_socket) {
+		char control_str[BUFFER_SIZE];
+		memset(control_str, 0, BUFFER_SIZE);
+		sprintf(control_str, "%d", in_control_socket);
+		server_args.push_back("-c");
+		server_args.push_back(control_str);
+		if (in_options.host_sessions) {
+			server_args.push_back("-m");
+		}
+	}
 
-			// let's replace ourself with the chat_server program
-			// we need to inform the child process of the file descriptor for it's TCP socket
-			execl(SERVER_EXE.c_str(), fd_str, port_str, in_session_name.c_str(), NULL);
+	// start session server using fork and execv
+	const pid_t fork_code = fork();
+	if (-1 == fork_code) {
+		fprintf(stderr, "fork called failed!  Error is %s\n", strerror(errno));
+		close(session_socket);
+		return -1;
+	}
+	else if (0 == fork_code) {
+		//
+		// CHILD PROCESS
+		//
 
-			// this call never returns.  we are now in the other program - goodbye!
+		// the control channel is close-on-exec so other servers don't inherit it - except this one
+		if (-1 != in_control_socket) {
+			fcntl(in_control_socket, F_SETFD, 0);
 		}
-		else {
-			//
-			// PARENT PROCESS
-			//
 
-			// tell the client how to connect to the session server
-			printf("Session \"%s\" started on TCP port %d\n", in_session_name.c_str(), session_port);
-			in_chat_session_map.insert(std::make_pair<string, int>(in_session_name, session_port));
-			return_code = session_port;
+		// let's replace ourself with the chat_server program
+		// we need to inform the child process of the file descriptor for it's TCP socket
+		vector<char*> exec_args;
+		for (size_t i = 0; i < server_args.size(); ++i) {
+			exec_args.push_back(const_cast<char*>(server_args[i].c_str()));
 		}
+		exec_args.push_back(NULL);
+		execv(SERVER_EXE.c_str(), &exec_args[0]);
+
+		// this call never returns.  we are now in the other program - goodbye!
+		fprintf(stderr, "execv called failed!  Error is %s\n", strerror(errno));
+		_exit(1);
 	}
-	else {
-		return_code = -1;
+
+	//
+	// PARENT PROCESS
+	//
+
+	// the session server owns the socket now
+	close(session_socket);
+	return session_port;
+}
+
+/**
+  * Starts a session server with a control channel.  It listens right away but only
+  * serves the sessions it is given over the control channel.
+  *
+  * @pre none
+  * @post out_server is running if successful
+  * @param out_server The new session server
+  * @param in_server_port UDP port number of the chat coordinator
+  * @param in_options Settings to pass to the session server
+  * @return 0 if successful; -1 if error
+  */
+int start_controlled_server(ControlledServer& out_server,
+                            const int in_server_port,
+                            const SessionOptions& in_options) {
+	// SOCK_SEQPACKET keeps each control message in one piece
+	int control_sockets[2];
+	if (0 != socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control_sockets)) {
+		fprintf(stderr, "socketpair called failed!  Error is %s\n", strerror(errno));
+		return -1;
+	}
+
+	// a server that stops answering is treated like one that died, rather than stalling every request
+	struct timeval control_timeout;
+	control_timeout.tv_sec = CONTROL_TIMEOUT;
+	control_timeout.tv_usec = 0;
+	setsockopt(control_sockets[0], SOL_SOCKET, SO_RCVTIMEO, &control_timeout, sizeof(control_timeout));
+
+	out_server.control_socket = control_sockets[0];
+	out_server.port = spawn_server("", in_server_port, in_options, control_sockets[1]);
+	close(control_sockets[1]);
+
+	if (-1 == out_server.port) {
+		close(out_server.control_socket);
+		out_server.control_socket = -1;
+		return -1;
 	}
 
-	return return_code;
+	return 0;
 }
 
 /**
-  * Finds the TCP port number of an existing chat session server.
+  * Hands a session name to a server from the pool.
+  *
+  * @pre none
+  * @post The server has left the pool and serves in_session_name
+  * @param in_warm_servers Pool of session servers waiting for a session
+  * @param in_session_name Name of the chat session
+  * @return TCP port of the session server if successul; -1 if the pool is empty
+  */
+int assign_warm_server(vector<ControlledServer>& in_warm_servers,
+                       const string& in_session_name) {
+	while (!in_warm_servers.empty()) {
+		const ControlledServer server = in_warm_servers.back();
+		in_warm_servers.pop_back();
+
+		// closing our end afterwards is fine - the message is already queued
+		const int send_code = util_send_frame(server.control_socket, OP_CONTROL_ASSIGN, 0, in_session_name.data(), in_session_name.length());
+		close(server.control_socket);
+		if (0 == send_code) {
+			return server.port;
+		}
+
+		// that server has died - try the next one
+	}
+
+	return -1;
+}
+
+/**
+  * Has the hosting session server create a session and waits for its session ID.
+  * If the hosting server has died, its sessions are forgotten and a new one is started.
+  *
+  * @pre in_options.host_sessions is set
+  * @post The hosting server serves in_session_name if successful
+  * @param in_host_server Session server hosting every session
+  * @param in_chat_session_map Contains a mapping of names to session locations
+  * @param in_session_name Name of the chat session
+  * @param in_server_port UDP port number of the chat coordinator
+  * @param in_options Settings to pass to the session server
+  * @return ID of the new session if successful; -1 if error
+  */
+int assign_hosted_session(ControlledServer& in_host_server,
+                          map<string, SessionLocation>& in_chat_session_map,
+                          const string& in_session_name,
+                          const int in_server_port,
+                          const SessionOptions& in_options) {
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		if (-1 == in_host_server.control_socket) {
+			if (-1 == start_controlled_server(in_host_server, in_server_port, in_options)) {
+				return -1;
+			}
+			printf("Chat Coordinator hosting sessions on TCP port %d\n", in_host_server.port);
+		}
+
+		if (0 == util_send_frame(in_host_server.control_socket, OP_CONTROL_ASSIGN, 0, in_session_name.data(), in_session_name.length())) {
+			// the session is ready before the client hears about it, so its first connection finds it
+			char control_buffer[BUFFER_SIZE];
+			const int num_bytes = recv(in_host_server.control_socket, control_buffer, BUFFER_SIZE, 0);
+
+			FrameHeader header;
+			const char* payload;
+			if (num_bytes > 0 && 0 == util_decode_frame(control_buffer, num_bytes, header, payload)) {
+				if (OP_CONTROL_READY == header.opcode && sizeof(unsigned int) == header.length) {
+					unsigned int net_session_id;
+					memcpy(&net_session_id, payload, sizeof(net_session_id));
+					return ntohl(net_session_id);
+				}
+				return -1;
+			}
+		}
+
+		// the hosting server is gone, or hung past CONTROL_TIMEOUT, and took its sessions with it
+		fprintf(stderr, "Chat Coordinator - lost the hosting session server.  Error is %s\n", strerror(errno));
+		close(in_host_server.control_socket);
+		in_host_server.control_socket = -1;
+
+		map<string, SessionLocation>::iterator session_it = in_chat_session_map.begin();
+		while (in_chat_session_map.end() != session_it) {
+			if (session_it->second.port == in_host_server.port) {
+				in_chat_session_map.erase(session_it++);
+			}
+			else {
+				++session_it;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/**
+  * Finds an existing chat session.
   *
   * @pre in_session_name is a non-empty string
   * @post none
   * @param in_session_name Name of the chat session server
-  * @param in_chat_session_map Contains a mapping of names to TCP port numbers
-  * @return TCP port of the session server if successul; -1 if error
+  * @param in_chat_session_map Contains a mapping of names to session locations
+  * @return Location of the session; port is -1 if there is no such session
   */
-int do_find(const string& in_session_name,
-            const map<string, int>& in_chat_session_map) {
-	const map<string, int>::const_iterator find_iterator = in_chat_session_map.find(in_session_name);
+SessionLocation do_find(const string& in_session_name,
+                        const map<string, SessionLocation>& in_chat_session_map) {
+	const map<string, SessionLocation>::const_iterator find_iterator = in_chat_session_map.find(in_session_name);
 	if ( in_chat_session_map.end() == find_iterator) {
-		return -1;
+		return SessionLocation();
 	}
 
 	return find_iterator->second;
@@ -186,10 +760,191 @@ int do_find(const string& in_session_name,
   * @pre in_session_name is a non-empty string
   * @post none
   * @param in_session_name Name of the chat session server
-  * @param in_chat_session_map Contains a mapping of names to TCP port numbers
+  * @param in_chat_session_map Contains a mapping of names to session locations
   */
 void do_terminate(const string& in_session_name,
-                  map<string, int>& in_chat_session_map) {
+                  map<string, SessionLocation>& in_chat_session_map) {
 	in_chat_session_map.erase(in_session_name);
 }
 
+/**
+  * Records what a session server reported about its sessions.  Sessions we don't
+  * know about are ignored - they may have been terminated since.
+  *
+  * @pre in_records points to in_records_len bytes
+  * @post Every known session in the report is up to date
+  * @param in_records Report payload after the request ID: process ID, then one record per session
+  * @param in_records_len Length of in_records
+  * @param in_chat_session_map Contains a mapping of names to session locations
+  */
+void do_report(const char* const in_records,
+               const unsigned int in_records_len,
+               map<string, SessionLocation>& in_chat_session_map) {
+	const unsigned int record_header_len = 3 * sizeof(unsigned int);
+	if (in_records_len < sizeof(unsigned int)) {
+		fprintf(stderr, "Chat Coordinator - ignoring malformed report\n");
+		return;
+	}
+
+	unsigned int net_value;
+	memcpy(&net_value, in_records, sizeof(net_value));
+	const int pid = ntohl(net_value);
+	const time_t now = time(NULL);
+
+	unsigned int offset = sizeof(unsigned int);
+	while (in_records_len - offset >= record_header_len) {
+		memcpy(&net_value, in_records + offset, sizeof(net_value));
+		const unsigned int clients = ntohl(net_value);
+		memcpy(&net_value, in_records + offset + sizeof(net_value), sizeof(net_value));
+		const unsigned int messages = ntohl(net_value);
+		memcpy(&net_value, in_records + offset + 2 * sizeof(net_value), sizeof(net_value));
+		const unsigned int name_len = ntohl(net_value);
+		offset += record_header_len;
+
+		if (name_len > in_records_len - offset) {
+			fprintf(stderr, "Chat Coordinator - ignoring malformed report\n");
+			return;
+		}
+
+		map<string, SessionLocation>::iterator session_it = in_chat_session_map.find(string(in_records + offset, name_len));
+		if (in_chat_session_map.end() != session_it) {
+			session_it->second.pid = pid;
+			session_it->second.clients = clients;
+			session_it->second.messages = messages;
+			session_it->second.reported = now;
+		}
+		offset += name_len;
+	}
+}
+
+/**
+  * Builds one page of the List reply.  The first page starts with the coordinator's
+  * own records; every page then lists as many sessions as fit, in name order.
+  *
+  * @pre none
+  * @post out_page holds the page after whatever it held before
+  * @param in_cursor Name of the last session on the previous page.  Empty for the first page.
+  * @param in_chat_session_map Contains a mapping of names to session locations
+  * @param in_stats The coordinator's counters
+  * @param out_page Page to append to.  Holds the request ID on entry.
+  * @return true if more sessions follow this page
+  */
+bool do_list(const string& in_cursor,
+             const map<string, SessionLocation>& in_chat_session_map,
+             const CoordinatorStats& in_stats,
+             string& out_page) {
+	const time_t now = time(NULL);
+	const size_t page_start = out_page.length();
+	char line[BUFFER_SIZE];
+
+	if (in_cursor.empty()) {
+		unsigned long total_requests = 0;
+		for (int type = 0; type < NUM_COORDINATOR_REQUESTS; ++type) {
+			total_requests += in_stats.requests[type];
+		}
+
+		// only the slots for the last RATE_WINDOW whole seconds count
+		unsigned long window_requests = 0;
+		for (int slot = 0; slot < RATE_WINDOW; ++slot) {
+			if (in_stats.window_seconds[slot] < now && in_stats.window_seconds[slot] >= now - RATE_WINDOW) {
+				window_requests += in_stats.window_requests[slot];
+			}
+		}
+
+		const long uptime = now - in_stats.started;
+		sprintf(line, "coordinator uptime_s=%ld sessions=%lu requests=%lu requests_per_sec=%.2f recent_requests_per_sec=%.2f batches=%lu datagrams=%lu\n",
+		        uptime, static_cast<unsigned long>(in_chat_session_map.size()), total_requests,
+		        (0 == uptime) ? 0.0 : static_cast<double>(total_requests) / uptime,
+		        static_cast<double>(window_requests) / RATE_WINDOW, in_stats.num_batches, in_stats.num_datagrams);
+		out_page += line;
+
+		out_page += "requests";
+		for (int type = 0; type < NUM_COORDINATOR_REQUESTS; ++type) {
+			sprintf(line, " %s=%lu", COORDINATOR_REQUEST_NAMES[type], in_stats.requests[type]);
+			out_page += line;
+		}
+		out_page += "\n";
+
+		// percentiles of the Starts still in the ring
+		const size_t num_samples = (in_stats.num_starts < static_cast<unsigned long>(START_LATENCY_SAMPLES)) ? in_stats.num_starts : START_LATENCY_SAMPLES;
+		vector<unsigned int> latencies(in_stats.start_latencies.begin(), in_stats.start_latencies.begin() + num_samples);
+		std::sort(latencies.begin(), latencies.end());
+		if (latencies.empty()) {
+			latencies.push_back(0);
+		}
+		sprintf(line, "start_latency count=%lu mean_us=%lu p50_us=%u p99_us=%u max_us=%u\n",
+		        in_stats.num_starts, (0 == in_stats.num_starts) ? 0 : in_stats.total_start_us / in_stats.num_starts,
+		        latencies[latencies.size() * 50 / 100], latencies[latencies.size() * 99 / 100], latencies.back());
+		out_page += line;
+	}
+
+	map<string, SessionLocation>::const_iterator session_it = in_cursor.empty() ? in_chat_session_map.begin() : in_chat_session_map.upper_bound(in_cursor);
+	for (; in_chat_session_map.end() != session_it; ++session_it) {
+		const SessionLocation& location = session_it->second;
+		sprintf(line, "session port=%d session_id=%u pid=%d age_s=%ld clients=%u messages=%u report_age_s=%ld name=",
+		        location.port, location.session_id, location.pid, static_cast<long>(now - location.started),
+		        location.clients, location.messages, (0 == location.reported) ? -1L : static_cast<long>(now - location.reported));
+		const string record = line + session_it->first + "\n";
+
+		if (out_page.length() - page_start + record.length() > MAX_LIST_PAGE) {
+			// a name too long for any page is left out rather than stalling the listing
+			if (record.length() > MAX_LIST_PAGE) {
+				continue;
+			}
+			return true;
+		}
+		out_page += record;
+	}
+
+	return false;
+}
+
+/**
+  * Counts a request for the totals and the recent request rate.
+  *
+  * @pre none
+  * @post The request is in in_stats
+  * @param in_stats The coordinator's counters
+  * @param in_opcode Opcode of the request
+  */
+void count_request(CoordinatorStats& in_stats,
+                   const unsigned char in_opcode) {
+	++in_stats.requests[(in_opcode < NUM_COORDINATOR_REQUESTS) ? in_opcode : 0];
+
+	// a slot that still holds an old second starts over
+	const time_t now = time(NULL);
+	const int slot = now % RATE_WINDOW;
+	if (in_stats.window_seconds[slot] != now) {
+		in_stats.window_seconds[slot] = now;
+		in_stats.window_requests[slot] = 0;
+	}
+	++in_stats.window_requests[slot];
+}
+
+/**
+  * Records how long a Start took.
+  *
+  * @pre none
+  * @post The latency is in in_stats
+  * @param in_stats The coordinator's counters
+  * @param in_latency_us Time spent serving the Start in microseconds
+  */
+void record_start(CoordinatorStats& in_stats,
+                  const unsigned int in_latency_us) {
+	in_stats.start_latencies[in_stats.num_starts % START_LATENCY_SAMPLES] = in_latency_us;
+	++in_stats.num_starts;
+	in_stats.total_start_us += in_latency_us;
+}
+
+/**
+  * Reads the monotonic clock.
+  *
+  * @pre none
+  * @post none
+  * @return Current time in microseconds
+  */
+uint64_t now_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
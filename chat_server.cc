@@ -5,8 +5,10 @@
  * @brief Chat Server implementation
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -16,11 +18,20 @@
 #include <unistd.h>
 #include <vector>
 
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
+#include "compress.h"
+#include "message_log.h"
 #include "strings.h"
 #include "socket_utils.h"
+#include "trace.h"
 
 using std::map;
 using std::string;
@@ -28,153 +39,1810 @@ using std::vector;
 
 /** How long to wait for input on any client connection.  Value is in seconds. */
 const int RECEIVE_TIMEOUT = 60;
+/** How often the coordinator is sent a report on our sessions.  Value is in seconds. */
+const int REPORT_INTERVAL = 5;
+/** How often old chat history is trimmed and released when retention limits are set.  Value is in seconds. */
+const int COMPACT_INTERVAL = 1;
+/** Maximum number of readiness events handled per epoll_wait() call */
+const int MAX_EPOLL_EVENTS = 256;
+/** Upper bound on the number of worker threads serving one session */
+const int MAX_WORKERS = 64;
+/** Most sessions one client connection may select at a time.  Channel numbers must be below it. */
+const size_t MAX_CONNECTION_CHANNELS = 1024;
+/** Largest payload of a single OP_SERVER_PUSH frame */
+const unsigned int MAX_PUSH_PAYLOAD = 256 * 1024;
+/** Most bytes of chat history handed to the kernel in one write */
+const size_t MAX_OUTPUT_BATCH = 256 * 1024;
+/** Shortest run of stored messages sent with sendfile() - writev() is cheaper for a few frames */
+const size_t MIN_SENDFILE_BYTES = 16 * 1024;
+/** Most bytes a connection may have copied into its output queue */
+const size_t MAX_OUTPUT_QUEUE = 64 * 1024;
+/** Most bytes of message frames compressed into one OP_SERVER_MESSAGE_BATCH frame */
+const size_t MAX_BATCH_BLOCK = 32 * 1024;
+/** Fewest unread messages Get All sends in batches - a short catch-up is not worth compressing */
+const int MIN_BATCH_MESSAGES = 8;
+/** Most read positions a session keeps for clients that dropped their connection */
+const size_t MAX_PARKED_CURSORS = 4096;
+/** Requests are counted by opcode.  Slot 0 counts the ones we don't recognize. */
+const int NUM_REQUEST_TYPES = OP_SERVER_RESUME + 1;
+/** Name of each request type in a Stats snapshot */
+const char* const REQUEST_NAMES[NUM_REQUEST_TYPES] = { "unknown", "submit", "getnext", "getall", "leave", "subscribe", "unsubscribe", "select", "stats", "resume" };
+/** Service times are counted in power of two nanosecond buckets.  The last one also holds anything slower. */
+const int NUM_LATENCY_BUCKETS = 32;
+
+struct ServerContext;
+
+/**
+  * Read position of a client whose connection dropped, kept until it resumes.
+  */
+struct ParkedCursor {
+	ParkedCursor() :
+		next_message(0),
+		park_number(0) {
+	}
+
+	/** Index of the next unread message */
+	int next_message;
+	/** Key of the cursor in ChatSession::parked_order */
+	uint64_t park_number;
+};
+
+/**
+  * One chat session: its name and its chat history.  A session server normally serves
+  * exactly one.  In hosting mode (-m) it serves every session the coordinator starts,
+  * and connections pick theirs with OP_SERVER_SELECT_SESSION.
+  */
+struct ChatSession {
+	ChatSession() :
+		session_id(0),
+		session_name(),
+		all_messages(),
+		connections(0),
+		active_epoch(0),
+		parked_cursors(),
+		parked_order(),
+		next_park_number(0),
+		cursors_mutex() {
+		pthread_mutex_init(&cursors_mutex, NULL);
+	}
+
+	~ChatSession() {
+		pthread_mutex_destroy(&cursors_mutex);
+	}
+
+	/** ID clients select the session with.  0 if this is the server's only session. */
+	unsigned int session_id;
+	/** Name of this chat session */
+	string session_name;
+	/** Chat history shared by every worker */
+	MessageLog all_messages;
+	/** Number of open connection channels bound to the session */
+	int connections;
+	/** Last idle sweep period (see ServerContext::sweep_epoch) the session had traffic in */
+	unsigned long active_epoch;
+	/** Read positions of dropped connections, by resume token */
+	map<uint64_t, ParkedCursor> parked_cursors;
+	/** Resume tokens of parked_cursors by park number.  Oldest first, as the tokens themselves are random. */
+	map<uint64_t, uint64_t> parked_order;
+	/** Park number of the next parked cursor */
+	uint64_t next_park_number;
+	/** Guards the parked cursors.  Only taken when a connection drops or resumes. */
+	pthread_mutex_t cursors_mutex;
+
+private:
+	/* not copyable */
+	ChatSession(const ChatSession&);
+	ChatSession& operator=(const ChatSession&);
+};
+
+/**
+  * One session selected on a client connection, and the client's place in it.
+  */
+struct SessionChannel {
+	SessionChannel() :
+		session(NULL),
+		next_message(0),
+		subscribed(false),
+		resume_token(0) {
+	}
+
+	/** Session the channel belongs to */
+	ChatSession* session;
+	/** Index of the next unread message */
+	int next_message;
+	/** New messages are pushed to this channel as they arrive */
+	bool subscribed;
+	/** Token the client resumes next_message with if the connection drops.  0 until it asks for one. */
+	uint64_t resume_token;
+};
+
+/**
+  * State for one client connection.
+  *
+  * A connection carries one or more sessions, each on its own channel.  Requests
+  * name their channel in the frame flags, and the frames we build in response
+  * carry the same channel.  A single session server puts every connection on
+  * channel 0 of its session; a hosting server waits for the client to select a
+  * session for each channel it uses.
+  *
+  * Client sockets are non-blocking.  A response goes to the output queue: small
+  * frames are copied into output, and runs of stored messages are queued as the
+  * range [stream_next, stream_stop) of stream_log, which is read in place.
+  * A batched stream is compressed instead, one OP_SERVER_MESSAGE_BATCH frame at a
+  * time, each one once the one before it has been written.
+  * While anything is queued we stop reading requests from the client, so a slow
+  * reader is throttled instead of growing its queue.
+  */
+struct ClientConnection {
+	ClientConnection() :
+		channels(),
+		open_channels(0),
+		reader(),
+		output(),
+		output_sent(0),
+		stream_log(NULL),
+		stream_next(0),
+		stream_stop(0),
+		stream_batched(false),
+		stream_channel(0) {
+	}
+
+	/**
+	  * Sessions this connection has selected, indexed by channel.  A slot with no session
+	  * is free.  Clients use the lowest free channels, so this stays short and a request
+	  * finds its channel without a search.
+	  */
+	vector<SessionChannel> channels;
+	/** Number of slots in channels that have a session */
+	size_t open_channels;
+	/** Bytes received from the client that have not been executed yet */
+	ConnectionReader reader;
+	/** Encoded bytes waiting to be written.  Goes out before the stream. */
+	string output;
+	/** Number of bytes at the front of output that have already been written */
+	size_t output_sent;
+	/** Chat history the stream is read from.  NULL until something is streamed. */
+	const MessageLog* stream_log;
+	/** Index of the next stored message to write */
+	int stream_next;
+	/** Index one past the last stored message to write */
+	int stream_stop;
+	/** The stream goes out in compressed batches */
+	bool stream_batched;
+	/** Channel to tag the batches with */
+	unsigned short stream_channel;
+
+private:
+	/* not copyable */
+	ClientConnection(const ClientConnection&);
+	ClientConnection& operator=(const ClientConnection&);
+};
+
+/**
+  * Subscribed connections that one worker owns in one session.
+  */
+struct SubscriberList {
+	SubscriberList() :
+		sockets(),
+		pushed_size(0) {
+	}
+
+	/** Sockets of the subscribed connections */
+	vector<int> sockets;
+	/** Size of the session's chat history the last time we pushed to them */
+	size_t pushed_size;
+};
+
+/**
+  * Counters kept by one worker for Stats.
+  *
+  * Only the owning worker writes them, with relaxed atomic stores that compile to
+  * plain writes, so counting costs no locked instructions and no shared cache lines.
+  * Any worker may read them with relaxed loads to build a snapshot.
+  */
+struct WorkerStats {
+	WorkerStats() :
+		connections(0),
+		bytes_in(0),
+		bytes_out(0),
+		batch_original_bytes(0),
+		batch_bytes(0),
+		loop_iterations(0),
+		requests(),
+		service_ns(),
+		histogram() {
+	}
+
+	/** Connections the worker owns right now */
+	unsigned long connections;
+	/** Bytes read from clients */
+	unsigned long bytes_in;
+	/** Bytes written to clients */
+	unsigned long bytes_out;
+	/** Bytes of message frames compressed into batches */
+	unsigned long batch_original_bytes;
+	/** Bytes of compressed blocks they became */
+	unsigned long batch_bytes;
+	/** Number of times epoll_wait() returned */
+	unsigned long loop_iterations;
+	/** Requests served, by opcode */
+	unsigned long requests[NUM_REQUEST_TYPES];
+	/** Total time spent serving them, by opcode */
+	unsigned long service_ns[NUM_REQUEST_TYPES];
+	/** Service times by opcode.  Bucket b counts times below 2^b ns that did not fit in bucket b - 1. */
+	unsigned long histogram[NUM_REQUEST_TYPES][NUM_LATENCY_BUCKETS];
+} __attribute__((aligned(64)));
+
+/**
+  * State owned by one worker thread.
+  *
+  * Every worker has its own SO_REUSEPORT listening socket and epoll instance, so the
+  * kernel spreads new connections across the workers and a connection is only ever
+  * touched by the worker that accepted it.  The sessions are the only shared state.
+  *
+  * A worker that stores new messages wakes the other workers that have subscribers
+  * through their notify_fd, so each worker pushes to its own subscribers.
+  */
+struct SessionWorker {
+	SessionWorker() :
+		listen_socket(-1),
+		epoll_fd(-1),
+		notify_fd(-1),
+		clients(),
+		subscriptions(),
+		subscriber_count(0),
+		notify_pending(0),
+		appended(false),
+		stream_floors(),
+		floors_generation(0),
+		server(NULL),
+		stats() {
+	}
+
+	/** Listening socket for this worker */
+	int listen_socket;
+	/** epoll instance for this worker's connections */
+	int epoll_fd;
+	/** eventfd other workers write to when they store new messages */
+	int notify_fd;
+	/** Connections owned by this worker, indexed by socket.  NULL for sockets that are not ours. */
+	vector<ClientConnection*> clients;
+	/** Subscribed connections owned by this worker, by session */
+	map<ChatSession*, SubscriberList> subscriptions;
+	/** Number of subscribed connections owned by this worker, readable by the other workers */
+	int subscriber_count;
+	/** Set while a wakeup is waiting on notify_fd so writers don't signal twice */
+	int notify_pending;
+	/** This worker stored new messages since the last time it woke the others */
+	bool appended;
+	/** Oldest stored message each chat history is still streaming to one of our connections */
+	map<const MessageLog*, size_t> stream_floors;
+	/** compact_generation stream_floors was gathered in.  Written with release once they are ready. */
+	unsigned long floors_generation;
+	/** Session server that owns this worker */
+	ServerContext* server;
+	/** Counters for Stats.  Cache line aligned and last, so workers never write a shared line. */
+	WorkerStats stats;
+
+private:
+	/* not copyable */
+	SessionWorker(const SessionWorker&);
+	SessionWorker& operator=(const SessionWorker&);
+};
+
+/**
+  * State shared by every worker thread in the session server.
+  *
+  * Sessions go idle in periods of RECEIVE_TIMEOUT seconds.  Workers stamp a session
+  * with the current sweep_epoch when its clients do something, so a session that
+  * was busy only pays for one shared write per period.  At the end of each period
+  * worker 0 closes down the sessions whose stamp is out of date.
+  *
+  * With retention limits set, worker 0 also trims old history every COMPACT_INTERVAL
+  * seconds.  Trimmed messages are only released once every worker has reported,
+  * after the trim, the oldest message it is still streaming (see compact_sessions()).
+  */
+struct ServerContext {
+	ServerContext() :
+		coordinator_port(-1),
+		num_workers(0),
+		workers(NULL),
+		persist_dir(NULL),
+		control_socket(-1),
+		report_socket(-1),
+		single_session(NULL),
+		sessions(),
+		sessions_mutex(),
+		next_session_id(0),
+		sweep_epoch(0),
+		retain_messages(0),
+		retain_bytes(0),
+		retain_seconds(0),
+		compact_generation(1),
+		resume_count(0) {
+		resume_key[0] = 0;
+		resume_key[1] = 0;
+		pthread_mutex_init(&sessions_mutex, NULL);
+	}
+
+	~ServerContext() {
+		pthread_mutex_destroy(&sessions_mutex);
+	}
+
+	/** UDP port number of the chat coordinator */
+	int coordinator_port;
+	/** Number of workers in use */
+	int num_workers;
+	/** All workers.  Worker 0 runs on the main thread and watches for idle sessions. */
+	SessionWorker* workers;
+	/** Directory for persistent session logs.  NULL keeps history in memory only. */
+	const char* persist_dir;
+	/** Control channel from the coordinator in hosting mode.  -1 otherwise. */
+	int control_socket;
+	/** UDP socket reports to the coordinator go out on.  -1 until the first report. */
+	int report_socket;
+	/** The only session, unless we are hosting.  Every connection belongs to it. */
+	ChatSession* single_session;
+	/** Hosted sessions by session ID */
+	map<unsigned int, ChatSession*> sessions;
+	/** Guards sessions.  Only taken to bind a connection and by worker 0. */
+	pthread_mutex_t sessions_mutex;
+	/** Last session ID handed out */
+	unsigned int next_session_id;
+	/** Current idle sweep period.  Only worker 0 writes it. */
+	unsigned long sweep_epoch;
+	/** Most messages to keep per session.  0 for no limit. */
+	size_t retain_messages;
+	/** Most bytes of message text to keep per session.  0 for no limit. */
+	size_t retain_bytes;
+	/** Longest to keep a message.  Value is in seconds; 0 for no limit. */
+	time_t retain_seconds;
+	/** Bumped by worker 0 after each trim.  Workers answer by gathering their stream_floors. */
+	unsigned long compact_generation;
+	/** Number of resume tokens handed out.  Each token is this count mixed with resume_key. */
+	uint64_t resume_count;
+	/** Random key read once at startup so tokens can't be guessed from one another */
+	uint64_t resume_key[2];
+
+private:
+	/* not copyable */
+	ServerContext(const ServerContext&);
+	ServerContext& operator=(const ServerContext&);
+};
 
 /* function declarations */
-void handle_select_timeout(const int, const char* const, const int, const string&);
-int do_submit(const int, vector<string>&);
-int do_get_next(const int, map<int, int>&, const vector<string>&);
-int do_get_all(const int, map<int, int>&, const vector<string>&);
-int send_chat_messages(const int, const vector<string>&, const unsigned int, const unsigned int);
+string session_directory_name(const string&);
+int wait_for_assignment(const int, string&);
+ChatSession* create_session(const ServerContext&, const string&, const unsigned int);
+void handle_control(ServerContext&);
+int init_worker(SessionWorker&, const int);
+void* worker_thread(void*);
+void run_worker(SessionWorker&);
+void sweep_sessions(ServerContext&);
+void send_reports(ServerContext&);
+void compact_sessions(ServerContext&);
+void report_stream_floors(SessionWorker&);
+void mark_active(const ServerContext&, ChatSession&);
+void accept_clients(SessionWorker&);
+void handle_client(SessionWorker&, const int);
+int process_frames(SessionWorker&, const int, ClientConnection&);
+int select_session(SessionWorker&, const int, ClientConnection&, const unsigned short, const char* const, const unsigned int);
+int close_channel(SessionWorker&, const int, ClientConnection&, const unsigned short);
+void close_client(SessionWorker&, const int);
+ClientConnection* find_client(const SessionWorker&, const int);
+SessionChannel* find_channel(ClientConnection&, const unsigned short);
+void publish_new_messages(SessionWorker&);
+bool output_pending(const ClientConnection&);
+int queue_output(ClientConnection&, const char* const, const size_t);
+int flush_output(const int, ClientConnection&, WorkerStats&);
+size_t find_file_run(const ClientConnection&, int&, off_t&);
+void queue_batch(ClientConnection&, WorkerStats&);
+void shut_down_idle_server(const int, const char* const, const int, const string&);
+int send_terminate(const char* const, const int, const string&);
+int do_submit(const char* const, const unsigned int, MessageLog&);
+int do_get_next(ClientConnection&, SessionChannel&, const unsigned short);
+int do_get_all(ClientConnection&, SessionChannel&, const unsigned short, const bool);
+void do_subscribe(SessionWorker&, const int, SessionChannel&);
+void do_unsubscribe(SessionWorker&, const int, SessionChannel&);
+int queue_push(ClientConnection&, SessionChannel&, const unsigned short);
+int queue_gap(ClientConnection&, SessionChannel&, const unsigned short);
+int queue_no_message(ClientConnection&, const unsigned short);
+int queue_no_session(ClientConnection&, const unsigned short);
+int do_stats(SessionWorker&, ClientConnection&, const SessionChannel&, const unsigned short);
+int do_resume(ServerContext&, ClientConnection&, SessionChannel&, const unsigned short, const char* const, const unsigned int);
+int read_resume_key(ServerContext&);
+uint64_t new_resume_token(ServerContext&);
+uint64_t mix_bits(uint64_t);
+void park_cursor(const SessionChannel&);
+void add_worker_stats(WorkerStats&, const WorkerStats&);
+uint64_t record_request(WorkerStats&, const unsigned char, const uint64_t);
+void add_stat(unsigned long&, const unsigned long);
+uint64_t now_ns();
+
+/**
+  * Main - entry point of program
+  *
+  * @param argc Number of command line arguments
+  * @param argv Command line arguments
+  * @return 0 if success; any other value if error
+  */
+int main(const int argc, const char** const argv) {
+	const int server_socket = atoi(argv[0]);
+	const int coordinator_port = atoi(argv[1]);
+	string session_name = argv[2];
+
+	// options passed through from the coordinator
+	int num_workers = 1;
+	const char* persist_dir = NULL;
+	int control_socket = -1;
+	bool hosting = false;
+	size_t retain_messages = 0;
+	size_t retain_bytes = 0;
+	time_t retain_seconds = 0;
+
+	optind = 3;
+	int option;
+	while (-1 != (option = getopt(argc, const_cast<char**>(argv), "w:d:c:mn:b:a:"))) {
+		switch (option) {
+			case 'w':
+				num_workers = atoi(optarg);
+				break;
+			case 'd':
+				persist_dir = optarg;
+				break;
+			case 'c':
+				control_socket = atoi(optarg);
+				break;
+			case 'm':
+				hosting = true;
+				break;
+			case 'n':
+				retain_messages = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				retain_bytes = strtoul(optarg, NULL, 10);
+				break;
+			case 'a':
+				retain_seconds = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "Chat server \"%s\" - ignoring unknown option\n", session_name.c_str());
+				break;
+		}
+	}
+
+	if (num_workers < 1) {
+		num_workers = 1;
+	}
+	else if (num_workers > MAX_WORKERS) {
+		num_workers = MAX_WORKERS;
+	}
+
+	if (hosting && -1 == control_socket) {
+		fprintf(stderr, "Chat server - hosting mode needs a control channel\n");
+		exit(1);
+	}
+
+	// one fd per client - make sure we are only bounded by the hard limit
+	util_raise_descriptor_limit();
+
+	// sendfile() has no MSG_NOSIGNAL - a client that hung up must not kill us with SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	// started ahead of time - sit in the coordinator's pool until we get a session
+	if (-1 != control_socket && !hosting) {
+		if (-1 == wait_for_assignment(control_socket, session_name)) {
+			exit(0);
+		}
+	}
+
+	SessionWorker workers[MAX_WORKERS];
+	ServerContext server;
+	server.coordinator_port = coordinator_port;
+	server.num_workers = num_workers;
+	server.workers = workers;
+	server.persist_dir = persist_dir;
+	server.retain_messages = retain_messages;
+	server.retain_bytes = retain_bytes;
+	server.retain_seconds = retain_seconds;
+	if (-1 == read_resume_key(server)) {
+		exit(1);
+	}
+
+	// a hosting server starts empty and creates sessions as the coordinator assigns them
+	if (hosting) {
+		server.control_socket = control_socket;
+		printf("Chat server hosting sessions on TCP port %d\n", util_get_port_number(server_socket));
+	}
+	else {
+		server.single_session = create_session(server, session_name, 0);
+		if (NULL == server.single_session) {
+			exit(1);
+		}
+	}
+
+	// worker 0 uses the socket the coordinator handed us; the rest join its SO_REUSEPORT group
+	const int session_port = util_get_port_number(server_socket);
+	for (int i = 0; i < num_workers; ++i) {
+		int listen_socket = server_socket;
+		if (i > 0) {
+			listen_socket = util_create_server_socket(SOCK_STREAM, IPPROTO_TCP, NULL, session_port, true);
+			if (-1 == listen_socket || -1 == util_listen(listen_socket)) {
+				fprintf(stderr, "Failed to create listening socket for worker %d\n", i);
+				exit(1);
+			}
+		}
+
+		workers[i].server = &server;
+		if (-1 == init_worker(workers[i], listen_socket)) {
+			exit(1);
+		}
+	}
+
+	//
+	// BEGIN MAIN LOOP
+	//
+
+	for (int i = 1; i < num_workers; ++i) {
+		pthread_t thread;
+		const int thread_code = pthread_create(&thread, NULL, worker_thread, &workers[i]);
+		if (0 != thread_code) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(thread_code));
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+
+	run_worker(workers[0]);
+
+	close(server_socket);
+	return 0;
+}
+
+/**
+  * Waits on the control channel until the coordinator assigns us a session.
+  *
+  * @pre in_control_socket is the SOCK_SEQPACKET control channel from the coordinator
+  * @post in_control_socket is closed
+  * @param in_control_socket Control channel to read from
+  * @param out_session_name Name of the assigned session
+  * @return 0 if a session was assigned; -1 if the coordinator went away
+  */
+int wait_for_assignment(const int in_control_socket,
+                        string& out_session_name) {
+	int return_code = -1;
+
+	for (;;) {
+		char control_buffer[BUFFER_SIZE];
+		const int num_bytes = recv(in_control_socket, control_buffer, BUFFER_SIZE, 0);
+		if (num_bytes < 0 && EINTR == errno) {
+			continue;
+		}
+
+		// end of file - the coordinator no longer needs us
+		if (num_bytes <= 0) {
+			break;
+		}
+
+		FrameHeader header;
+		const char* payload;
+		if (-1 == util_decode_frame(control_buffer, num_bytes, header, payload) || OP_CONTROL_ASSIGN != header.opcode) {
+			fprintf(stderr, "Chat server - ignoring malformed control message\n");
+			continue;
+		}
+
+		out_session_name.assign(payload, header.length);
+		return_code = 0;
+		break;
+	}
+
+	close(in_control_socket);
+	return return_code;
+}
+
+/**
+  * Creates a session and, if sessions are persistent, restores its history.
+  *
+  * @pre none
+  * @post none
+  * @param in_server Session server the session will belong to
+  * @param in_session_name Name of the chat session
+  * @param in_session_id ID clients select the session with.  0 if it is the only session.
+  * @return The new session if successful; NULL if error
+  */
+ChatSession* create_session(const ServerContext& in_server,
+                            const string& in_session_name,
+                            const unsigned int in_session_id) {
+	ChatSession* const session = new ChatSession();
+	session->session_id = in_session_id;
+	session->session_name = in_session_name;
+	session->active_epoch = __atomic_load_n(&in_server.sweep_epoch, __ATOMIC_RELAXED);
+
+	// a persistent session picks up where the last server with this name left off
+	if (NULL != in_server.persist_dir) {
+		if (-1 == session->all_messages.open(string(in_server.persist_dir) + "/" + session_directory_name(in_session_name))) {
+			fprintf(stderr, "Chat server \"%s\" failed to open its message log\n", in_session_name.c_str());
+			delete session;
+			return NULL;
+		}
+		printf("Chat server \"%s\" restored %lu messages\n", in_session_name.c_str(), static_cast<unsigned long>(session->all_messages.size()));
+	}
+
+	return session;
+}
+
+/**
+  * Creates the sessions the coordinator has assigned us since the last call and
+  * answers each with its session ID.  Only used in hosting mode.
+  *
+  * @pre in_server.control_socket is the SOCK_SEQPACKET control channel from the coordinator
+  * @post Every assigned session is in in_server.sessions
+  * @param in_server Hosting session server
+  */
+void handle_control(ServerContext& in_server) {
+	for (;;) {
+		char control_buffer[BUFFER_SIZE];
+		const int num_bytes = recv(in_server.control_socket, control_buffer, BUFFER_SIZE, MSG_DONTWAIT);
+		if (num_bytes < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return;
+			}
+		}
+
+		// end of file - nobody can start sessions here any more
+		if (num_bytes <= 0) {
+			printf("Chat server closing - the coordinator has gone away\n");
+			exit(0);
+		}
+
+		FrameHeader header;
+		const char* payload;
+		if (-1 == util_decode_frame(control_buffer, num_bytes, header, payload) || OP_CONTROL_ASSIGN != header.opcode) {
+			fprintf(stderr, "Chat server - ignoring malformed control message\n");
+			continue;
+		}
+
+		// 0 means "the only session", so skip it when the IDs wrap
+		if (0 == ++in_server.next_session_id) {
+			++in_server.next_session_id;
+		}
+
+		ChatSession* const session = create_session(in_server, string(payload, header.length), in_server.next_session_id);
+		if (NULL == session) {
+			util_send_frame(in_server.control_socket, OP_CONTROL_ERROR, 0, NULL, 0);
+			continue;
+		}
+
+		pthread_mutex_lock(&in_server.sessions_mutex);
+		in_server.sessions[session->session_id] = session;
+		pthread_mutex_unlock(&in_server.sessions_mutex);
+
+		const unsigned int net_session_id = htonl(session->session_id);
+		if (-1 == util_send_frame(in_server.control_socket, OP_CONTROL_READY, 0, reinterpret_cast<const char*>(&net_session_id), sizeof(net_session_id))) {
+			fprintf(stderr, "Chat server - failed to answer the coordinator.  Error is %s\n", strerror(errno));
+		}
+	}
+}
+
+/**
+  * Prepares a worker's listening socket and epoll instance.
+  *
+  * @pre in_listen_socket is a listening socket
+  * @post in_worker is ready to run
+  * @param in_worker Worker to initialize
+  * @param in_listen_socket Listening socket the worker will accept on
+  * @return 0 if successful; -1 if error
+  */
+int init_worker(SessionWorker& in_worker,
+                const int in_listen_socket) {
+	in_worker.listen_socket = in_listen_socket;
+
+	// the listening socket is edge-triggered so it must never block in accept()
+	if (-1 == util_set_nonblocking(in_listen_socket)) {
+		return -1;
+	}
+
+	in_worker.epoll_fd = epoll_create1(0);
+	if (in_worker.epoll_fd < 0) {
+		fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+		return -1;
+	}
+
+	struct epoll_event listen_event;
+	memset(&listen_event, 0, sizeof(listen_event));
+	listen_event.events = EPOLLIN | EPOLLET;
+	listen_event.data.fd = in_listen_socket;
+	if (epoll_ctl(in_worker.epoll_fd, EPOLL_CTL_ADD, in_listen_socket, &listen_event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// other workers wake us here when there is something to push
+	in_worker.notify_fd = eventfd(0, EFD_NONBLOCK);
+	if (in_worker.notify_fd < 0) {
+		fprintf(stderr, "eventfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	struct epoll_event notify_event;
+	memset(&notify_event, 0, sizeof(notify_event));
+	notify_event.events = EPOLLIN | EPOLLET;
+	notify_event.data.fd = in_worker.notify_fd;
+	if (epoll_ctl(in_worker.epoll_fd, EPOLL_CTL_ADD, in_worker.notify_fd, &notify_event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// worker 0 also creates the hosted sessions
+	const ServerContext& server = *in_worker.server;
+	if (&in_worker == &server.workers[0] && -1 != server.control_socket) {
+		struct epoll_event control_event;
+		memset(&control_event, 0, sizeof(control_event));
+		control_event.events = EPOLLIN;
+		control_event.data.fd = server.control_socket;
+		if (epoll_ctl(in_worker.epoll_fd, EPOLL_CTL_ADD, server.control_socket, &control_event) < 0) {
+			fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+  * pthread entry point for the additional workers.
+  *
+  * @param in_worker Pointer to the SessionWorker to run
+  * @return never returns
+  */
+void* worker_thread(void* in_worker) {
+	run_worker(*static_cast<SessionWorker*>(in_worker));
+	return NULL;
+}
+
+/**
+  * Event loop for one worker.  Worker 0 also closes down the sessions that have
+  * been idle for RECEIVE_TIMEOUT seconds, reports on the sessions to the
+  * coordinator every REPORT_INTERVAL seconds and, if history is bounded, trims
+  * it every COMPACT_INTERVAL seconds.
+  *
+  * @pre in_worker has been initialized with init_worker()
+  * @post none - only returns on error
+  * @param in_worker Worker to run
+  */
+void run_worker(SessionWorker& in_worker) {
+	ServerContext& server = *in_worker.server;
+	const bool is_primary = (&in_worker == &server.workers[0]);
+	time_t next_sweep = time(NULL) + RECEIVE_TIMEOUT;
+	// the first report goes out right away so the coordinator learns who we are
+	time_t next_report = time(NULL);
+	const bool retention = (0 != server.retain_messages || 0 != server.retain_bytes || 0 != server.retain_seconds);
+	time_t next_compact = time(NULL) + COMPACT_INTERVAL;
+
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	for(;;) {
+		int timeout = -1;
+		if (is_primary) {
+			const time_t now = time(NULL);
+			if (now >= next_sweep) {
+				sweep_sessions(server);
+				next_sweep = now + RECEIVE_TIMEOUT;
+			}
+			if (now >= next_report) {
+				send_reports(server);
+				next_report = now + REPORT_INTERVAL;
+			}
+			if (retention && now >= next_compact) {
+				compact_sessions(server);
+				next_compact = now + COMPACT_INTERVAL;
+			}
+			const time_t next_timer = std::min(next_sweep, next_report);
+			timeout = ((retention ? std::min(next_timer, next_compact) : next_timer) - now) * 1000;
+		}
+
+		// only the descriptors that are actually ready come back
+		const int num_events = epoll_wait(in_worker.epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+		// error
+		if (num_events < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+			exit(1);
+		}
+		add_stat(in_worker.stats.loop_iterations, 1);
+
+		for (int i = 0; i < num_events; ++i) {
+			const int ready_socket = events[i].data.fd;
+			if (ready_socket == in_worker.listen_socket) {
+				accept_clients(in_worker);
+			}
+			else if (ready_socket == in_worker.notify_fd) {
+				uint64_t wakeups;
+				while (sizeof(wakeups) == read(in_worker.notify_fd, &wakeups, sizeof(wakeups))) {
+				}
+				// re-arm before looking at the history so no append can slip past us
+				__atomic_store_n(&in_worker.notify_pending, 0, __ATOMIC_SEQ_CST);
+			}
+			else if (ready_socket == server.control_socket) {
+				handle_control(server);
+			}
+			else {
+				handle_client(in_worker, ready_socket);
+			}
+		}
+
+		// one round of pushes per wakeup, however many messages arrived
+		publish_new_messages(in_worker);
+
+		// worker 0 has trimmed - tell it which trimmed messages we may still be reading
+		if (__atomic_load_n(&server.compact_generation, __ATOMIC_ACQUIRE) != in_worker.floors_generation) {
+			report_stream_floors(in_worker);
+		}
+	}
+}
+
+/**
+  * Ends an idle sweep period.  A session server with a single session exits if it
+  * saw no traffic during the period.  A hosting server closes down each hosted
+  * session that saw no traffic and has no connections left.  The coordinator is
+  * told about every session that goes away.
+  *
+  * @pre Called from worker 0
+  * @post The next sweep period has begun
+  * @param in_server Session server
+  */
+void sweep_sessions(ServerContext& in_server) {
+	const unsigned long epoch = in_server.sweep_epoch;
+
+	if (NULL != in_server.single_session) {
+		if (__atomic_load_n(&in_server.single_session->active_epoch, __ATOMIC_RELAXED) != epoch) {
+			shut_down_idle_server(in_server.workers[0].listen_socket, NULL, in_server.coordinator_port, in_server.single_session->session_name);
+		}
+	}
+	else {
+		// a session with no connections can't gain one while we hold the lock
+		vector<ChatSession*> idle_sessions;
+		pthread_mutex_lock(&in_server.sessions_mutex);
+		map<unsigned int, ChatSession*>::iterator session_it = in_server.sessions.begin();
+		while (in_server.sessions.end() != session_it) {
+			ChatSession* const session = session_it->second;
+			if (__atomic_load_n(&session->active_epoch, __ATOMIC_RELAXED) != epoch && 0 == __atomic_load_n(&session->connections, __ATOMIC_ACQUIRE)) {
+				idle_sessions.push_back(session);
+				in_server.sessions.erase(session_it++);
+			}
+			else {
+				++session_it;
+			}
+		}
+		pthread_mutex_unlock(&in_server.sessions_mutex);
+
+		for (size_t i = 0; i < idle_sessions.size(); ++i) {
+			printf("Chat server closing session \"%s\" after idle timeout\n", idle_sessions[i]->session_name.c_str());
+			send_terminate(NULL, in_server.coordinator_port, idle_sessions[i]->session_name);
+			delete idle_sessions[i];
+		}
+	}
+
+	__atomic_store_n(&in_server.sweep_epoch, epoch + 1, __ATOMIC_RELAXED);
+}
+
+/**
+  * Sends the coordinator a report on every session we serve: its client and
+  * message counts.  The records are split across as many datagrams as needed.
+  *
+  * @pre Called from worker 0
+  * @post The reports have been sent
+  * @param in_server Session server
+  */
+void send_reports(ServerContext& in_server) {
+	if (-1 == in_server.report_socket) {
+		in_server.report_socket = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, NULL, 0);
+		if (-1 == in_server.report_socket) {
+			return;
+		}
+	}
+
+	struct sockaddr_in coord_addr;
+	if (-1 == util_create_sockaddr(NULL, in_server.coordinator_port, &coord_addr)) {
+		return;
+	}
+
+	// Report is not answered, so the request ID does not matter
+	const unsigned int net_pid = htonl(getpid());
+	string report_start(REQUEST_ID_SIZE, '\0');
+	report_start.append(reinterpret_cast<const char*>(&net_pid), sizeof(net_pid));
+	const size_t max_report = BUFFER_SIZE - 1 - FRAME_HEADER_SIZE;
+
+	// the records are built under the lock so no session goes away while we read it
+	vector<const ChatSession*> sessions;
+	if (NULL != in_server.single_session) {
+		sessions.push_back(in_server.single_session);
+	}
+	else {
+		pthread_mutex_lock(&in_server.sessions_mutex);
+		for (map<unsigned int, ChatSession*>::const_iterator session_it = in_server.sessions.begin(); in_server.sessions.end() != session_it; ++session_it) {
+			sessions.push_back(session_it->second);
+		}
+	}
+
+	vector<string> reports;
+	string report = report_start;
+	for (size_t i = 0; i < sessions.size(); ++i) {
+		const unsigned int net_fields[3] = {
+			htonl(__atomic_load_n(&sessions[i]->connections, __ATOMIC_RELAXED)),
+			htonl(sessions[i]->all_messages.size()),
+			htonl(sessions[i]->session_name.length())
+		};
+		string record(reinterpret_cast<const char*>(net_fields), sizeof(net_fields));
+		record += sessions[i]->session_name;
+		if (report_start.length() + record.length() > max_report) {
+			continue;
+		}
+
+		if (report.length() + record.length() > max_report) {
+			reports.push_back(report);
+			report = report_start;
+		}
+		report += record;
+	}
+
+	if (NULL == in_server.single_session) {
+		pthread_mutex_unlock(&in_server.sessions_mutex);
+	}
+	if (report.length() > report_start.length()) {
+		reports.push_back(report);
+	}
+
+	for (size_t i = 0; i < reports.size(); ++i) {
+		util_send_udp_frame(in_server.report_socket, OP_COORDINATOR_REPORT, 0, reports[i].data(), reports[i].length(), (struct sockaddr *)&coord_addr);
+	}
+}
+
+/**
+  * Trims every session's history to the retention limits and releases what was
+  * trimmed in the previous round.
+  *
+  * Trimming only moves a history's first_index(), so readers are never cut off.
+  * Each trim is followed by a new compact_generation, and the workers answer it by
+  * gathering the oldest message they are still streaming.  Anything a worker starts
+  * streaming after that begins at or above the new first_index().  So once every
+  * worker has answered, no reader can be below the smallest of their floors and the
+  * previous trim point, and everything below that can go.
+  *
+  * @pre Called from worker 0
+  * @post A new compact_generation has begun and the other workers have been woken
+  * @param in_server Session server
+  */
+void compact_sessions(ServerContext& in_server) {
+	const unsigned long generation = in_server.compact_generation;
+	report_stream_floors(in_server.workers[0]);
+
+	bool all_reported = true;
+	for (int i = 1; i < in_server.num_workers; ++i) {
+		if (__atomic_load_n(&in_server.workers[i].floors_generation, __ATOMIC_ACQUIRE) != generation) {
+			all_reported = false;
+		}
+	}
+
+	// the lock keeps the sessions alive, as in send_reports()
+	vector<ChatSession*> sessions;
+	if (NULL != in_server.single_session) {
+		sessions.push_back(in_server.single_session);
+	}
+	else {
+		pthread_mutex_lock(&in_server.sessions_mutex);
+		for (map<unsigned int, ChatSession*>::const_iterator session_it = in_server.sessions.begin(); in_server.sessions.end() != session_it; ++session_it) {
+			sessions.push_back(session_it->second);
+		}
+	}
+
+	for (size_t i = 0; i < sessions.size(); ++i) {
+		MessageLog& log = sessions[i]->all_messages;
+
+		// first_index() is still where the previous round's trim left it - only we trim
+		if (all_reported) {
+			size_t floor = log.first_index();
+			for (int worker = 0; worker < in_server.num_workers; ++worker) {
+				const map<const MessageLog*, size_t>& floors = in_server.workers[worker].stream_floors;
+				map<const MessageLog*, size_t>::const_iterator floor_it = floors.find(&log);
+				if (floors.end() != floor_it) {
+					floor = std::min(floor, floor_it->second);
+				}
+			}
+			log.compact(floor);
+		}
+
+		log.trim(in_server.retain_messages, in_server.retain_bytes, in_server.retain_seconds);
+	}
+
+	if (NULL == in_server.single_session) {
+		pthread_mutex_unlock(&in_server.sessions_mutex);
+	}
+
+	// a worker that is waiting in epoll_wait() has to be woken to answer
+	__atomic_store_n(&in_server.compact_generation, generation + 1, __ATOMIC_RELEASE);
+	for (int i = 1; i < in_server.num_workers; ++i) {
+		SessionWorker& other = in_server.workers[i];
+		if (0 == __atomic_exchange_n(&other.notify_pending, 1, __ATOMIC_SEQ_CST)) {
+			const uint64_t one = 1;
+			if (sizeof(one) != write(other.notify_fd, &one, sizeof(one))) {
+				fprintf(stderr, "failed to wake worker %d.  Error is %s\n", i, strerror(errno));
+			}
+		}
+	}
+}
+
+/**
+  * Gathers the oldest stored message each chat history is still streaming to one of
+  * a worker's connections, and tells worker 0 they are ready.
+  *
+  * @pre Called by the worker that owns in_worker
+  * @post in_worker.stream_floors is up to date for the current compact_generation
+  * @param in_worker Worker whose connections to look at
+  */
+void report_stream_floors(SessionWorker& in_worker) {
+	const unsigned long generation = __atomic_load_n(&in_worker.server->compact_generation, __ATOMIC_ACQUIRE);
+
+	in_worker.stream_floors.clear();
+	for (size_t i = 0; i < in_worker.clients.size(); ++i) {
+		if (NULL == in_worker.clients[i] || in_worker.clients[i]->stream_next >= in_worker.clients[i]->stream_stop) {
+			continue;
+		}
+		const ClientConnection& client = *in_worker.clients[i];
+
+		const size_t stream_next = client.stream_next;
+		map<const MessageLog*, size_t>::iterator floor_it = in_worker.stream_floors.find(client.stream_log);
+		if (in_worker.stream_floors.end() == floor_it) {
+			in_worker.stream_floors[client.stream_log] = stream_next;
+		}
+		else {
+			floor_it->second = std::min(floor_it->second, stream_next);
+		}
+	}
+
+	// worker 0 reads stream_floors once it sees this
+	__atomic_store_n(&in_worker.floors_generation, generation, __ATOMIC_RELEASE);
+}
+
+/**
+  * Records that a session had traffic in the current sweep period.
+  *
+  * @pre none
+  * @post in_session will not be closed down at the end of this period
+  * @param in_server Session server
+  * @param in_session Session that had traffic
+  */
+void mark_active(const ServerContext& in_server,
+                 ChatSession& in_session) {
+	// read first - a busy session's cache line is only written once per period
+	const unsigned long epoch = __atomic_load_n(&in_server.sweep_epoch, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&in_session.active_epoch, __ATOMIC_RELAXED) != epoch) {
+		__atomic_store_n(&in_session.active_epoch, epoch, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+  * Turns a session name into something that is safe to use as a directory name.
+  *
+  * @pre none
+  * @post none
+  * @param in_session_name Name of this chat session server
+  * @return in_session_name with path separators and leading dots replaced
+  */
+string session_directory_name(const string& in_session_name) {
+	string directory_name = in_session_name;
+	for (size_t i = 0; i < directory_name.length(); ++i) {
+		if ('/' == directory_name[i] || (0 == i && '.' == directory_name[i])) {
+			directory_name[i] = '_';
+		}
+	}
+
+	if (directory_name.empty()) {
+		directory_name = "_";
+	}
+
+	return directory_name;
+}
+
+/**
+  * Accepts every pending connection on the listening socket.
+  * The listening socket is edge-triggered, so we keep going until accept() would block.
+  *
+  * With a single session, new connections belong to it on channel 0 right away.
+  * A hosting server waits for each client to select its sessions.
+  *
+  * @pre in_worker.listen_socket is a non-blocking listening socket registered with in_worker.epoll_fd
+  * @post All pending clients are registered with in_worker.epoll_fd
+  * @param in_worker Worker that will own the new connections
+  */
+void accept_clients(SessionWorker& in_worker) {
+	ChatSession* const single_session = in_worker.server->single_session;
+
+	for (;;) {
+		struct sockaddr_storage fsin;    /* the from address of a client - IPv4 or IPv6 */
+		socklen_t alen = sizeof(fsin);
+		const int client_socket = accept4(in_worker.listen_socket, (struct sockaddr *)&fsin, &alen, SOCK_NONBLOCK);
+
+		if (client_socket < 0) {
+			if (EINTR == errno || ECONNABORTED == errno) {
+				continue;
+			}
+			if (EAGAIN != errno && EWOULDBLOCK != errno) {
+				fprintf(stderr, "accept: %s\n", strerror(errno));
+			}
+			return;
+		}
+
+		struct epoll_event client_event;
+		memset(&client_event, 0, sizeof(client_event));
+		// EPOLLOUT is edge-triggered too - it only fires when a full socket buffer drains
+		client_event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		client_event.data.fd = client_socket;
+		if (epoll_ctl(in_worker.epoll_fd, EPOLL_CTL_ADD, client_socket, &client_event) < 0) {
+			fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+			close(client_socket);
+			continue;
+		}
+
+		// we have a new client, so initialize it's last read message
+		if (static_cast<size_t>(client_socket) >= in_worker.clients.size()) {
+			in_worker.clients.resize(client_socket + 1, NULL);
+		}
+		in_worker.clients[client_socket] = new ClientConnection();
+		ClientConnection& client = *in_worker.clients[client_socket];
+		add_stat(in_worker.stats.connections, 1);
+		if (NULL != single_session) {
+			client.channels.resize(1);
+			client.channels[0].session = single_session;
+			client.channels[0].next_message = single_session->all_messages.first_index();
+			client.open_channels = 1;
+			__atomic_add_fetch(&single_session->connections, 1, __ATOMIC_RELAXED);
+			mark_active(*in_worker.server, *single_session);
+		}
+	}
+}
+
+/**
+  * Moves a client connection along as far as it can go without blocking: writes
+  * its output queue, queues pushes if it is subscribed, and then services its
+  * requests.  Client sockets are edge-triggered, so we keep going until either
+  * the socket buffer is full or there is nothing left to read.
+  *
+  * @pre in_client_socket is a valid socket file descriptor
+  * @post The output queue is empty or the socket buffer is full
+  * @param in_worker Worker that owns the connection
+  * @param in_client_socket Client socket that epoll reported as ready
+  */
+void handle_client(SessionWorker& in_worker,
+                   const int in_client_socket) {
+	ClientConnection* const found = find_client(in_worker, in_client_socket);
+	if (NULL == found) {
+		fprintf(stderr, "failed to find connection state for client %d\n", in_client_socket);
+		close(in_client_socket);
+		return;
+	}
+	ClientConnection& client = *found;
+	for (size_t i = 0; i < client.channels.size(); ++i) {
+		if (NULL != client.channels[i].session) {
+			mark_active(*in_worker.server, *client.channels[i].session);
+		}
+	}
+
+	for (;;) {
+		if (-1 == flush_output(in_client_socket, client, in_worker.stats)) {
+			close_client(in_worker, in_client_socket);
+			return;
+		}
+
+		// socket buffer is full - leave the requests where they are until EPOLLOUT
+		if (output_pending(client)) {
+			return;
+		}
+
+		// one push at a time, from the first subscribed channel that is behind
+		bool pushed = false;
+		for (size_t i = 0; i < client.channels.size() && !pushed; ++i) {
+			SessionChannel& channel = client.channels[i];
+			if (channel.subscribed && static_cast<size_t>(channel.next_message) < channel.session->all_messages.size()) {
+				if (-1 == queue_push(client, channel, static_cast<unsigned short>(i))) {
+					close_client(in_worker, in_client_socket);
+					return;
+				}
+				pushed = true;
+			}
+		}
+		if (pushed) {
+			continue;
+		}
+
+		if (-1 == process_frames(in_worker, in_client_socket, client)) {
+			close_client(in_worker, in_client_socket);
+			return;
+		}
+		if (output_pending(client)) {
+			continue;
+		}
+
+		// take whatever the kernel has - it may hold several requests or part of one
+		errno = 0;
+		const int num_bytes = client.reader.fill(in_client_socket);
+		if (-1 == num_bytes) {
+			// stream drained - wait for the next edge
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return;
+			}
+			close_client(in_worker, in_client_socket);
+			return;
+		}
+		add_stat(in_worker.stats.bytes_in, num_bytes);
+	}
+}
+
+/**
+  * Decodes and executes the complete frames in a connection's read buffer, stopping
+  * after the first one that queues a response.  A trailing partial frame is left in
+  * the buffer until the rest of it arrives.
+  *
+  * @pre in_socket is a valid socket file descriptor
+  * @post Executed frames have been consumed from in_client.reader
+  * @param in_worker Worker that owns the connection
+  * @param in_socket Client socket to respond on
+  * @param in_client Connection state for in_socket
+  * @return 0 if the connection should stay open; -1 if it should be closed
+  */
+int process_frames(SessionWorker& in_worker,
+                   const int in_socket,
+                   ClientConnection& in_client) {
+	int return_code = 0;
+	// each request is timed from the end of the one before, so it costs one clock read
+	uint64_t request_start = 0;
+
+	while (0 == return_code && !output_pending(in_client)) {
+		// requests are small - don't let a client make us buffer a huge payload
+		FrameHeader header;
+		const char* payload = NULL;
+		const int status = in_client.reader.next_frame(header, payload, BUFFER_SIZE);
+		if (-1 == status) {
+			fprintf(stderr, "bad request from client %d\n", in_socket);
+			return -1;
+		}
+		if (0 == status) {
+			break;
+		}
+		UTIL_TRACE(TRACE_RECV, in_socket, header.opcode, header.length);
+		if (0 == request_start) {
+			request_start = now_ns();
+		}
+
+		// the frame flags say which of the connection's sessions the request is for
+		const unsigned short channel_id = header.flags;
+		if (OP_SERVER_SELECT_SESSION == header.opcode) {
+			return_code = select_session(in_worker, in_socket, in_client, channel_id, payload, header.length);
+			request_start = record_request(in_worker.stats, header.opcode, request_start);
+			continue;
+		}
+
+		// the client's other sessions carry on - it just hears that this one is gone
+		SessionChannel* const found_channel = find_channel(in_client, channel_id);
+		if (NULL == found_channel) {
+			return_code = queue_no_session(in_client, channel_id);
+			request_start = record_request(in_worker.stats, header.opcode, request_start);
+			continue;
+		}
+		SessionChannel& channel = *found_channel;
+		MessageLog& in_all_messages = channel.session->all_messages;
+
+		// perform the requested operation
+		switch (header.opcode) {
+			case OP_SERVER_SUBMIT:
+				if (-1 == do_submit(payload, header.length, in_all_messages)) {
+					fprintf(stderr, "do_submit failed!\n");
+				}
+				else {
+					in_worker.appended = true;
+				}
+				break;
+			case OP_SERVER_GET_NEXT:
+				if (-1 == do_get_next(in_client, channel, channel_id)) {
+					fprintf(stderr, "do_get_next failed for client %d!\n", in_socket);
+					return_code = -1;
+				}
+				break;
+			case OP_SERVER_GET_ALL:
+				if (-1 == do_get_all(in_client, channel, channel_id, header.length > 0 && 0 != (payload[0] & GET_ALL_ACCEPT_BATCH))) {
+					fprintf(stderr, "do_get_all failed for client %d!\n", in_socket);
+					return_code = -1;
+				}
+				break;
+			case OP_SERVER_SUBSCRIBE:
+				do_subscribe(in_worker, in_socket, channel);
+				break;
+			case OP_SERVER_UNSUBSCRIBE:
+				do_unsubscribe(in_worker, in_socket, channel);
+				break;
+			case OP_SERVER_STATS:
+				if (-1 == do_stats(in_worker, in_client, channel, channel_id)) {
+					fprintf(stderr, "do_stats failed for client %d!\n", in_socket);
+					return_code = -1;
+				}
+				break;
+			case OP_SERVER_RESUME:
+				if (-1 == do_resume(*in_worker.server, in_client, channel, channel_id, payload, header.length)) {
+					fprintf(stderr, "do_resume failed for client %d!\n", in_socket);
+					return_code = -1;
+				}
+				break;
+			case OP_SERVER_LEAVE:
+				// the connection goes once it has no sessions left
+				return_code = close_channel(in_worker, in_socket, in_client, channel_id);
+				break;
+			default:
+				fprintf(stderr, "Chat Server - unrecognized opcode:  ->%d<-\n", header.opcode);
+				return_code = -1;
+				break;
+		}
+		request_start = record_request(in_worker.stats, header.opcode, request_start);
+	}
+
+	return return_code;
+}
+
+/**
+  * Binds a channel of a connection to the hosted session it selected.
+  *
+  * @pre none
+  * @post The channel belongs to the selected session if successful
+  * @param in_worker Worker that owns the connection
+  * @param in_socket Client socket
+  * @param in_client Connection state for in_socket
+  * @param in_channel_id Channel to bind, from the frame flags
+  * @param in_payload Payload of the OP_SERVER_SELECT_SESSION frame
+  * @param in_payload_len Length of in_payload
+  * @return 0 if successful or the session does not exist; -1 if the connection should be closed
+  */
+int select_session(SessionWorker& in_worker,
+                   const int in_socket,
+                   ClientConnection& in_client,
+                   const unsigned short in_channel_id,
+                   const char* const in_payload,
+                   const unsigned int in_payload_len) {
+	ServerContext& server = *in_worker.server;
+
+	// a channel belongs to one session until the client leaves it
+	if (in_channel_id >= MAX_CONNECTION_CHANNELS || NULL != find_channel(in_client, in_channel_id) ||
+	    sizeof(unsigned int) != in_payload_len) {
+		fprintf(stderr, "bad session selection from client %d\n", in_socket);
+		return -1;
+	}
+
+	unsigned int net_session_id;
+	memcpy(&net_session_id, in_payload, sizeof(net_session_id));
+
+	// counting the channel under the lock keeps the session from being closed down
+	ChatSession* session = NULL;
+	pthread_mutex_lock(&server.sessions_mutex);
+	map<unsigned int, ChatSession*>::iterator session_it = server.sessions.find(ntohl(net_session_id));
+	if (server.sessions.end() != session_it) {
+		session = session_it->second;
+		__atomic_add_fetch(&session->connections, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&server.sessions_mutex);
+
+	// the session may have closed down since the client looked it up.  Selections are
+	// not answered, so the requests that follow on the channel say it is gone.
+	if (NULL == session) {
+		return 0;
+	}
+
+	// one channel per session, so a subscriber is listed once per session
+	for (size_t i = 0; i < in_client.channels.size(); ++i) {
+		if (session == in_client.channels[i].session) {
+			fprintf(stderr, "client %d selected session %u twice\n", in_socket, session->session_id);
+			__atomic_sub_fetch(&session->connections, 1, __ATOMIC_RELEASE);
+			return -1;
+		}
+	}
+
+	if (in_channel_id >= in_client.channels.size()) {
+		in_client.channels.resize(in_channel_id + 1);
+	}
+	SessionChannel& channel = in_client.channels[in_channel_id];
+	channel.session = session;
+	channel.next_message = session->all_messages.first_index();
+	++in_client.open_channels;
+	mark_active(server, *session);
+	return 0;
+}
+
+/**
+  * Takes a session off a connection and stops pushing it.
+  *
+  * @pre Nothing from the channel's session is being streamed to the client
+  * @post in_channel_id has no session
+  * @param in_worker Worker that owns the connection
+  * @param in_socket Client socket
+  * @param in_client Connection state for in_socket
+  * @param in_channel_id Channel to close
+  * @return 0 if the connection still has sessions; -1 if it has none left
+  */
+int close_channel(SessionWorker& in_worker,
+                  const int in_socket,
+                  ClientConnection& in_client,
+                  const unsigned short in_channel_id) {
+	SessionChannel* const channel = find_channel(in_client, in_channel_id);
+	if (NULL != channel) {
+		do_unsubscribe(in_worker, in_socket, *channel);
+
+		// the last thing we do with the session - it may be closed down after this
+		__atomic_sub_fetch(&channel->session->connections, 1, __ATOMIC_RELEASE);
+		*channel = SessionChannel();
+		--in_client.open_channels;
+
+		// free slots at the end are dropped so the channel loops stay short
+		while (!in_client.channels.empty() && NULL == in_client.channels.back().session) {
+			in_client.channels.pop_back();
+		}
+	}
+
+	return (0 == in_client.open_channels) ? -1 : 0;
+}
+
+/**
+  * Closes a client connection.  The read position of every channel that has a
+  * resume token is parked in its session, so the client can pick it up again.
+  * Closing the descriptor also removes it from the epoll interest list.
+  *
+  * @pre in_client_socket is a valid socket file descriptor
+  * @post in_client_socket is closed and no longer in in_worker.clients
+  * @param in_worker Worker that owns the connection
+  * @param in_client_socket Client socket to close
+  */
+void close_client(SessionWorker& in_worker,
+                  const int in_client_socket) {
+	ClientConnection* const client = find_client(in_worker, in_client_socket);
+	if (NULL != client) {
+		// the last slot always has a session, since close_channel() drops free ones at the end
+		while (!client->channels.empty()) {
+			const unsigned short channel_id = static_cast<unsigned short>(client->channels.size() - 1);
+			park_cursor(client->channels[channel_id]);
+			close_channel(in_worker, in_client_socket, *client, channel_id);
+		}
+		delete client;
+		in_worker.clients[in_client_socket] = NULL;
+		__atomic_store_n(&in_worker.stats.connections, in_worker.stats.connections - 1, __ATOMIC_RELAXED);
+	}
+	close(in_client_socket);
+}
+
+/**
+  * Looks up the state of a connection.
+  *
+  * @pre none
+  * @post none
+  * @param in_worker Worker that may own the connection
+  * @param in_client_socket Client socket
+  * @return The connection state; NULL if in_worker does not own in_client_socket
+  */
+ClientConnection* find_client(const SessionWorker& in_worker,
+                              const int in_client_socket) {
+	if (in_client_socket < 0 || static_cast<size_t>(in_client_socket) >= in_worker.clients.size()) {
+		return NULL;
+	}
+	return in_worker.clients[in_client_socket];
+}
+
+/**
+  * Looks up the session selected on a channel of a connection.
+  *
+  * @pre none
+  * @post none
+  * @param in_client Connection state
+  * @param in_channel_id Channel from the frame flags
+  * @return The channel; NULL if no session is selected on it
+  */
+SessionChannel* find_channel(ClientConnection& in_client,
+                             const unsigned short in_channel_id) {
+	if (in_channel_id >= in_client.channels.size() || NULL == in_client.channels[in_channel_id].session) {
+		return NULL;
+	}
+	return &in_client.channels[in_channel_id];
+}
+
+/**
+  * Pushes any messages stored since the last call to this worker's subscribers.
+  * If this worker stored them, the other workers with subscribers are woken first.
+  *
+  * @pre none
+  * @post Every subscriber owned by in_worker has been sent the whole history
+  * @param in_worker Worker whose event loop is calling
+  */
+void publish_new_messages(SessionWorker& in_worker) {
+	const ServerContext& server = *in_worker.server;
+
+	if (in_worker.appended) {
+		in_worker.appended = false;
+
+		// pairs with the re-arm in run_worker - either they see our append or we see them waiting
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for (int i = 0; i < server.num_workers; ++i) {
+			SessionWorker& other = server.workers[i];
+			if (&other == &in_worker || 0 == __atomic_load_n(&other.subscriber_count, __ATOMIC_RELAXED)) {
+				continue;
+			}
+
+			// only the first writer since the last wakeup pays for the syscall
+			if (0 == __atomic_exchange_n(&other.notify_pending, 1, __ATOMIC_SEQ_CST)) {
+				const uint64_t one = 1;
+				if (sizeof(one) != write(other.notify_fd, &one, sizeof(one))) {
+					fprintf(stderr, "failed to wake worker %d.  Error is %s\n", i, strerror(errno));
+				}
+			}
+		}
+	}
+
+	// collect first - a failed push closes the client and edits the lists
+	vector<int> ready_subscribers;
+	for (map<ChatSession*, SubscriberList>::iterator list_it = in_worker.subscriptions.begin(); in_worker.subscriptions.end() != list_it; ++list_it) {
+		SubscriberList& subscribers = list_it->second;
+		const size_t log_size = list_it->first->all_messages.size();
+		if (log_size != subscribers.pushed_size) {
+			subscribers.pushed_size = log_size;
+			ready_subscribers.insert(ready_subscribers.end(), subscribers.sockets.begin(), subscribers.sockets.end());
+		}
+	}
+
+	for (size_t i = 0; i < ready_subscribers.size(); ++i) {
+		const ClientConnection* const client = find_client(in_worker, ready_subscribers[i]);
+		if (NULL == client) {
+			continue;
+		}
+
+		// a subscriber that is still writing catches up when EPOLLOUT fires
+		if (!output_pending(*client)) {
+			handle_client(in_worker, ready_subscribers[i]);
+		}
+	}
+}
+
+/**
+  * Checks whether a connection has anything queued that has not been written yet.
+  *
+  * @pre none
+  * @post none
+  * @param in_client Connection state
+  * @return true if the output queue is not empty
+  */
+bool output_pending(const ClientConnection& in_client) {
+	return in_client.output_sent < in_client.output.length() || in_client.stream_next < in_client.stream_stop;
+}
+
+/**
+  * Copies encoded bytes to the end of a connection's output queue.
+  *
+  * @pre in_buf points to at least in_buf_len bytes
+  * @post in_buf has been queued if it fits in the queue budget
+  * @param in_client Connection state
+  * @param in_buf Bytes to queue
+  * @param in_buf_len Number of bytes in in_buf
+  * @return 0 if successful; -1 if the client is over its MAX_OUTPUT_QUEUE budget
+  */
+int queue_output(ClientConnection& in_client,
+                 const char* const in_buf,
+                 const size_t in_buf_len) {
+	if (in_client.output.length() - in_client.output_sent + in_buf_len > MAX_OUTPUT_QUEUE) {
+		fprintf(stderr, "output queue is over budget\n");
+		return -1;
+	}
+
+	// the stream goes out after output, so nothing may be copied in behind it
+	assert(in_client.stream_next == in_client.stream_stop);
+
+	in_client.output.append(in_buf, in_buf_len);
+	return 0;
+}
 
 /**
-  * Main - entry point of program
+  * Writes as much of a connection's output queue as the socket accepts.
+  * Stored messages are written straight from the chat history: adjacent frames are
+  * merged, and each batch of up to MAX_SEND_IOV buffers goes out with a single
+  * syscall.  Only the unsent tail of a frame that is cut short gets copied.  A
+  * long run of frames that sit together in a segment file of a persistent log is
+  * sent with sendfile(), so it never passes through user space.  A batched stream
+  * is compressed into output a block at a time instead.
   *
-  * @param argv Command line arguments
-  * @return 0 if success; any other value if error
+  * @pre in_socket is a valid non-blocking socket file descriptor
+  * @post The output queue is empty or the socket buffer is full
+  * @param in_socket Socket file descriptor of the client
+  * @param in_client Connection state for in_socket
+  * @param in_stats Counters of the worker that owns the connection
+  * @return 0 if successful; -1 if error
   */
-int main(const int, const char** const argv) {
-	const int server_socket = atoi(argv[0]);
-	const int coordinator_port = atoi(argv[1]);
-	const string session_name = argv[2];
+int flush_output(const int in_socket,
+                 ClientConnection& in_client,
+                 WorkerStats& in_stats) {
+	for (;;) {
+		// output never holds more than one block, and a partly written one is finished first
+		if (in_client.stream_batched && in_client.stream_next < in_client.stream_stop &&
+		    0 == in_client.output_sent && in_client.output.length() < MAX_BATCH_BLOCK) {
+			queue_batch(in_client, in_stats);
+		}
 
-	// let's start up our data structure
-	map<int, int> next_message_map;
-	vector<string> all_messages;
+		struct iovec iov[MAX_SEND_IOV];
+		int iov_count = 0;
 
-	//
-	// BEGIN MAIN LOOP
-	//
+		const size_t queued_bytes = in_client.output.length() - in_client.output_sent;
+		if (queued_bytes > 0) {
+			iov[iov_count].iov_base = const_cast<char*>(in_client.output.data()) + in_client.output_sent;
+			iov[iov_count].iov_len = queued_bytes;
+			++iov_count;
+		}
+		const int first_message_iov = iov_count;
 
-	struct sockaddr_in fsin;    /* the from address of a client */
-	fd_set  rfds;           /* read file descriptor set */
-	fd_set  afds;           /* active file descriptor set   */
+		int file_fd = -1;
+		off_t file_offset = 0;
+		const size_t file_bytes = in_client.stream_batched ? 0 : find_file_run(in_client, file_fd, file_offset);
 
-	int nfds = getdtablesize();
-	FD_ZERO(&afds);
-	FD_SET(server_socket, &afds);
+		size_t batch_bytes = 0;
+		for (int i = in_client.stream_next; 0 == file_bytes && !in_client.stream_batched && i < in_client.stream_stop && batch_bytes < MAX_OUTPUT_BATCH; ++i) {
+			char* const frame = const_cast<char*>(in_client.stream_log->frame(i));
+			const unsigned int frame_len = in_client.stream_log->frame_length(i);
 
-	for(;;) {
-		memcpy(&rfds, &afds, sizeof(rfds));
-		int client_socket = -1;
-
-		// select timeout
-		struct timeval select_timeout;
-		select_timeout.tv_sec = RECEIVE_TIMEOUT;
-		select_timeout.tv_usec = 0;
-		const int select_code = select(nfds, &rfds, (fd_set *)0, (fd_set *)0, &select_timeout);
-		// error
-		if (select_code < 0) {
-			fprintf(stderr, "select: %s\n", strerror(errno));
-			exit(1);
+			// frames that sit next to each other in the arena go out as one buffer
+			if (iov_count > first_message_iov && static_cast<char*>(iov[iov_count - 1].iov_base) + iov[iov_count - 1].iov_len == frame) {
+				iov[iov_count - 1].iov_len += frame_len;
+			}
+			else if (iov_count == MAX_SEND_IOV) {
+				break;
+			}
+			else {
+				iov[iov_count].iov_base = frame;
+				iov[iov_count].iov_len = frame_len;
+				++iov_count;
+			}
+			batch_bytes += frame_len;
 		}
 
-		// timeout
-		if (0 == select_code) {
-			handle_select_timeout(server_socket, NULL, coordinator_port, session_name);
+		// everything has been written - let go of the copies
+		if (0 == iov_count && 0 == file_bytes) {
+			in_client.output.clear();
+			in_client.output_sent = 0;
+			return 0;
 		}
 
-		if (FD_ISSET(server_socket, &rfds)) {
-			unsigned int alen = sizeof(fsin);
-			client_socket = accept(server_socket, (struct sockaddr *)&fsin, &alen);
-
-			if (client_socket < 0) {
-				fprintf(stderr, "accept: %s\n", strerror(errno));
+		// anything queued goes first, held back to share packets with the file data
+		int num_bytes = 0;
+		if (iov_count > 0) {
+			num_bytes = util_try_send_iov(in_socket, iov, iov_count, (file_bytes > 0) ? MSG_MORE : 0);
+			if (-1 == num_bytes) {
+				return -1;
+			}
+		}
+		if (file_bytes > 0 && static_cast<size_t>(num_bytes) == queued_bytes) {
+			const int file_sent = util_try_sendfile(in_socket, file_fd, file_offset, file_bytes);
+			if (-1 == file_sent) {
+				return -1;
 			}
+			num_bytes += file_sent;
+			batch_bytes = file_bytes;
+		}
+		add_stat(in_stats.bytes_out, num_bytes);
 
-			FD_SET(client_socket, &afds);
+		size_t sent = num_bytes;
+		if (sent < queued_bytes) {
+			in_client.output_sent += sent;
+			return 0;
+		}
+		sent -= queued_bytes;
+		in_client.output.clear();
+		in_client.output_sent = 0;
 
-			// we have a new client, so initialize it's last read message
-			next_message_map.insert(std::make_pair<int, int>(client_socket, 0));
+		// whole frames leave the stream, and the rest of a frame that was cut short is copied
+		while (sent > 0) {
+			const unsigned int frame_len = in_client.stream_log->frame_length(in_client.stream_next);
+			if (sent < frame_len) {
+				in_client.output.append(in_client.stream_log->frame(in_client.stream_next) + sent, frame_len - sent);
+				sent = 0;
+			}
+			else {
+				sent -= frame_len;
+			}
+			++in_client.stream_next;
 		}
 
-		for (int client_socket = 0; client_socket < nfds; ++client_socket) {
-			if (client_socket != server_socket && FD_ISSET(client_socket, &rfds)) {
-				// let's peek into the stream to see how we are supposed to read the command
-				const int peek_len = 6;
-				char peek_buf[peek_len];
-				if (-1 == util_recv_tcp(client_socket, peek_buf, peek_len - 1, MSG_PEEK)) {
-					fprintf(stderr, "failed to peek command stream.  Error is %s\n", strerror(errno));
-					close(client_socket);
-					FD_CLR(client_socket, &afds);
-					continue;
-				}
+		// socket buffer is full
+		if (static_cast<size_t>(num_bytes) < queued_bytes + batch_bytes) {
+			return 0;
+		}
+	}
+}
 
-				const string peek_msg(peek_buf);
-				string peek_command;
-				if (string::npos != CMD_SERVER_SUBMIT.find(peek_msg)) {
-					peek_command = CMD_SERVER_SUBMIT;
-				}
-				else if (string::npos != CMD_SERVER_GET_NEXT.find(peek_msg)) {
-					peek_command = CMD_SERVER_GET_NEXT;
-				}
-				else if (string::npos != CMD_SERVER_GET_ALL.find(peek_msg)) {
-					peek_command = CMD_SERVER_GET_ALL;
-				}
-				else if (string::npos != CMD_SERVER_LEAVE.find(peek_msg)) {
-					peek_command = CMD_SERVER_LEAVE;
-				}
-				else {
-					fprintf(stderr, "Invalid command |%s|.  Cannot continue.\n", peek_command.c_str());
-					close(client_socket);
-					FD_CLR(client_socket, &afds);
-					continue;
-				}
+/**
+  * Finds the run of stored messages at the front of a connection's stream that one
+  * sendfile() can send: frames that sit one after another in the same segment file.
+  *
+  * @pre none
+  * @post none
+  * @param in_client Connection state
+  * @param out_fd Set to the segment file the run is in
+  * @param out_offset Set to the offset of the run in the segment file
+  * @return Length of the run; 0 if the stream is not on disk or the run is under MIN_SENDFILE_BYTES
+  */
+size_t find_file_run(const ClientConnection& in_client,
+                     int& out_fd,
+                     off_t& out_offset) {
+	if (in_client.stream_next >= in_client.stream_stop) {
+		return 0;
+	}
 
-				// now read the message from the stream for real
-				char recv_buffer[BUFFER_SIZE];
-				if (util_recv_tcp(client_socket, recv_buffer, peek_command.length()) <= 0) {
-					fprintf(stderr, "error or client disconnect: %s\n", strerror(errno));
-					close(client_socket);
-					FD_CLR(client_socket, &afds);
-					continue;
-				}
+	const MessageLog& log = *in_client.stream_log;
+	out_fd = log.frame_file(in_client.stream_next, out_offset);
+	if (-1 == out_fd) {
+		return 0;
+	}
 
-				// parse message
-				string command(recv_buffer);
+	size_t run_bytes = 0;
+	for (int i = in_client.stream_next; i < in_client.stream_stop && run_bytes < MAX_OUTPUT_BATCH; ++i) {
+		off_t frame_offset;
+		if (out_fd != log.frame_file(i, frame_offset) || out_offset + static_cast<off_t>(run_bytes) != frame_offset) {
+			break;
+		}
+		run_bytes += log.frame_length(i);
+	}
 
-				// perform the requested operation
-				if (CMD_SERVER_SUBMIT == command) {
-					if (-1 == do_submit(client_socket, all_messages)) {
-						fprintf(stderr, "do_submit failed!\n");
-					}
-				}
-				else if (CMD_SERVER_GET_NEXT == command) {
-					if (-1 == do_get_next(client_socket, next_message_map, all_messages)) {
-						fprintf(stderr, "do_get_next failed!\n");
-					}
-				}
-				else if (CMD_SERVER_GET_ALL == command) {
-					if (-1 == do_get_all(client_socket, next_message_map, all_messages)) {
-						fprintf(stderr, "do_get_all failed!\n");
-					}
-				}
-				else if (CMD_SERVER_LEAVE == command) {
-					close(client_socket);
-					FD_CLR(client_socket, &afds);
-				}
-				else {
-					fprintf(stderr, "Chat Server - unrecognized command:  ->%s<-\n", command.c_str());
-				}
-			}
+	return (run_bytes >= MIN_SENDFILE_BYTES) ? run_bytes : 0;
+}
+
+/**
+  * Compresses the next run of a batched stream into an OP_SERVER_MESSAGE_BATCH frame
+  * at the end of the output queue.
+  *
+  * @pre in_client.stream_batched and the stream is not empty
+  * @post The frames in the batch have left the stream
+  * @param in_client Connection state
+  * @param in_stats Counters of the worker that owns the connection
+  */
+void queue_batch(ClientConnection& in_client,
+                 WorkerStats& in_stats) {
+	const MessageLog& log = *in_client.stream_log;
+
+	// as many whole message frames as fit in one block
+	string original;
+	while (in_client.stream_next < in_client.stream_stop) {
+		const unsigned int frame_len = log.frame_length(in_client.stream_next);
+		if (!original.empty() && original.length() + frame_len > MAX_BATCH_BLOCK) {
+			break;
 		}
+		original.append(log.frame(in_client.stream_next), frame_len);
+		++in_client.stream_next;
 	}
 
-	close(server_socket);
-	return 0;
+	// compress straight into the output queue, then trim it to what was used
+	const size_t frame_start = in_client.output.length();
+	const size_t block_start = frame_start + FRAME_HEADER_SIZE + sizeof(uint32_t);
+	in_client.output.resize(block_start + compress_bound(original.length()));
+	size_t block_len = compress_block(original.data(), original.length(), &in_client.output[block_start]);
+	if (block_len >= original.length()) {
+		// it did not shrink - send it as is
+		memcpy(&in_client.output[block_start], original.data(), original.length());
+		block_len = original.length();
+	}
+	in_client.output.resize(block_start + block_len);
+
+	const uint32_t net_original_len = htonl(original.length());
+	util_encode_frame_header(OP_SERVER_MESSAGE_BATCH, in_client.stream_channel, sizeof(net_original_len) + block_len, &in_client.output[frame_start]);
+	memcpy(&in_client.output[frame_start + FRAME_HEADER_SIZE], &net_original_len, sizeof(net_original_len));
+
+	add_stat(in_stats.batch_original_bytes, original.length());
+	add_stat(in_stats.batch_bytes, block_len);
 }
 
 /**
-  * Cleanly shuts down this chat session server when select() times out.
+  * Cleanly shuts down this chat session server when the idle sweep finds that its
+  * session had no traffic for a whole sweep period.
   *
   * @pre in_server_socket is a valid socket file descriptor
   * @post none
@@ -183,207 +1851,650 @@ int main(const int, const char** const argv) {
   * @param in_coord_port UDP port number of the chat coordinator
   * @param in_session_name Name of this chat session server
   */
-void handle_select_timeout(const int in_server_socket,
+void shut_down_idle_server(const int in_server_socket,
                            const char* const in_coord_host,
                            const int in_coord_port,
                            const string& in_session_name) {
-	printf("Chat server \"%s\" closing after select timeout!\n", in_session_name.c_str());
+	printf("Chat server \"%s\" closing after idle timeout!\n", in_session_name.c_str());
 
 	// tell the coordinator that we are exiting
+	if (-1 == send_terminate(in_coord_host, in_coord_port, in_session_name)) {
+		exit(-1);
+	}
+
+	// clean up and exit
+	close(in_server_socket);
+	exit(0);
+}
+
+/**
+  * Tells the chat coordinator that a session has gone away.
+  *
+  * @pre none
+  * @post The Terminate request has been sent
+  * @param in_coord_host Hostname / IP address of the chat coordinator
+  * @param in_coord_port UDP port number of the chat coordinator
+  * @param in_session_name Name of the chat session
+  * @return 0 if successful; -1 if error
+  */
+int send_terminate(const char* const in_coord_host,
+                   const int in_coord_port,
+                   const string& in_session_name) {
 	// create new UDP socket
 	const int udp_socket = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, NULL, 0); 
+	if (-1 == udp_socket) {
+		return -1;
+	}
 
 	// communicate over UDP
 	struct sockaddr_in coord_addr;
 	if (-1 == util_create_sockaddr(in_coord_host, in_coord_port, &coord_addr)) {
-		fprintf(stderr, "Failed to create coordinator sockaddr.  Error is %s\n", strerror(errno));
-		exit(-1);
-	}
-
-	if (-1 == util_send_udp(udp_socket, CMD_COORDINATOR_TERMINATE.c_str(), CMD_COORDINATOR_TERMINATE.length(), (struct sockaddr *)&coord_addr)) {
-		fprintf(stderr, "sendto called failed!  Error is %s\n", strerror(errno));
-		exit(-1);
+		fprintf(stderr, "Failed to create coordinator sockaddr\n");
+		close(udp_socket);
+		return -1;
 	}
 
-	if (-1 == util_send_udp(udp_socket, in_session_name.c_str(), in_session_name.length(), (struct sockaddr *)&coord_addr)) {
+	// Terminate is not answered, so the request ID does not matter
+	string request(REQUEST_ID_SIZE, '\0');
+	request += in_session_name;
+	const int send_code = util_send_udp_frame(udp_socket, OP_COORDINATOR_TERMINATE, 0, request.data(), request.length(), (struct sockaddr *)&coord_addr);
+	if (-1 == send_code) {
 		fprintf(stderr, "sendto called failed!  Error is %s\n", strerror(errno));
-		exit(-1);
 	}
 
-	// clean up and exit
 	close(udp_socket);
-	close(in_server_socket);
-	exit(0);
+	return send_code;
 }
 
 /**
   * Stores a message in the chat history.
   *
-  * @pre in_socket is a valid socket file descriptor
+  * @pre in_message points to in_message_len bytes
   * @post received message has been stored in the chat history
-  * @param in_socket Socket file descriptor to receive data on
+  * @param in_message Message text from the Submit frame
+  * @param in_message_len Length of the message text
   * @param in_all_messages Data structure that holds the chat history
+  * @return 0 if successful; -1 if error
   */
-int do_submit(const int in_socket,
-              vector<string>& in_all_messages) {
-	int msg_len;
-	if (-1 == util_recv_tcp(in_socket, msg_len)) {
-		fprintf(stderr, "Failed to receive message length.  Error is %s\n", strerror(errno));
+int do_submit(const char* const in_message,
+              const unsigned int in_message_len,
+              MessageLog& in_all_messages) {
+	// store the message in the chat history
+	if (-1 == in_all_messages.append(in_message, in_message_len)) {
+		fprintf(stderr, "Chat history is full!\n");
 		return -1;
 	}
 
-	char msg_buf[BUFFER_SIZE + 1];
-	if (-1 == util_recv_tcp(in_socket, msg_buf, BUFFER_SIZE)) {
-		fprintf(stderr, "Failed to receive message.  Error is %s\n", strerror(errno));
+	return 0;
+}
+
+/**
+  * Gets the next unread message in the chat history for the specified client.
+  *
+  * @pre in_client has nothing queued
+  * @post The response has been queued and in_channel.next_message has been updated
+  * @param in_client Connection state of the client
+  * @param in_channel Channel the request came in on
+  * @param in_channel_id Channel number to tag the response with
+  * @return 0 if successful; -1 if error
+  */
+int do_get_next(ClientConnection& in_client,
+                SessionChannel& in_channel,
+                const unsigned short in_channel_id) {
+	const MessageLog& in_all_messages = in_channel.session->all_messages;
+	if (-1 == queue_gap(in_client, in_channel, in_channel_id)) {
 		return -1;
 	}
 
-	// store the message in the chat history
-	string message_text(msg_buf);
-	in_all_messages.push_back(message_text);
+	// no new messages
+	if (static_cast<size_t>(in_channel.next_message) >= in_all_messages.size()) {
+		return queue_no_message(in_client, in_channel_id);
+	}
+
+	// queue the message
+	in_client.stream_log = &in_all_messages;
+	in_client.stream_next = in_channel.next_message;
+	in_client.stream_stop = in_channel.next_message + 1;
+	in_client.stream_batched = false;
+	in_channel.next_message = in_client.stream_stop;
 
 	return 0;
 }
 
 /**
-  * Gets the next unread message in the chat history for the specified client.
+  * Gets all unread messages in the chat history for the specified client.  If the
+  * client accepts batches and is far enough behind, the messages are compressed.
   *
-  * @pre in_socket is a valid socket file descriptor
-  * @post in_next_message has been updated with the last read message
-  * @param in_socket Socket file descriptor to receive data on
-  * @param in_next_message Data structure that holds the index of the last read message
-  * @param in_all_messages Data structure that holds the chat history
+  * @pre in_client has nothing queued
+  * @post The response has been queued and in_channel.next_message has been updated
+  * @param in_client Connection state of the client
+  * @param in_channel Channel the request came in on
+  * @param in_channel_id Channel number to tag the response with
+  * @param in_accept_batch The client accepts OP_SERVER_MESSAGE_BATCH frames
   * @return 0 if successful; -1 if error
   */
-int do_get_next(const int in_socket,
-                map<int, int>& in_next_message,
-                const vector<string>& in_all_messages) {
-	// let's make sure that the next message exists
-	map<int, int>::const_iterator next_it = in_next_message.find(in_socket);
-	if (in_next_message.end() == next_it) {
-		fprintf(stderr, "failed to find last message index for client %d\n", in_socket);
-		util_send_tcp(in_socket, -1);
+int do_get_all(ClientConnection& in_client,
+               SessionChannel& in_channel,
+               const unsigned short in_channel_id,
+               const bool in_accept_batch) {
+	const MessageLog& in_all_messages = in_channel.session->all_messages;
+	if (-1 == queue_gap(in_client, in_channel, in_channel_id)) {
 		return -1;
 	}
+	const int start_index = in_channel.next_message;
+	const int stop_index = in_all_messages.size();
 
-	const int start_index = next_it->second;
-	const int stop_index = start_index + 1;
+	// we need to send the number of messages that will be sent first
+	const int num_msgs = stop_index - start_index;
 
 	// no new messages
-	if (static_cast<size_t>(stop_index) > in_all_messages.size()) {
-		if (-1 == util_send_tcp(in_socket, -1)) {
-			fprintf(stderr, "Failed to send number of messages.  Error is %s\n", strerror(errno));
-			return -1;
-		}
+	if (0 == num_msgs) {
+		return queue_no_message(in_client, in_channel_id);
+	}
+
+	// have n messages - the count frame goes out in the same write as the first messages
+	char count_frame[FRAME_HEADER_SIZE + sizeof(unsigned int)];
+	const unsigned int net_num_msgs = htonl(num_msgs);
+	util_encode_frame_header(OP_SERVER_MESSAGE_COUNT, in_channel_id, sizeof(net_num_msgs), count_frame);
+	memcpy(count_frame + FRAME_HEADER_SIZE, &net_num_msgs, sizeof(net_num_msgs));
+	if (-1 == queue_output(in_client, count_frame, sizeof(count_frame))) {
+		return -1;
+	}
+
+	// then the messages, straight from the chat history
+	in_client.stream_log = &in_all_messages;
+	in_client.stream_next = start_index;
+	in_client.stream_stop = stop_index;
+	in_client.stream_batched = in_accept_batch && num_msgs >= MIN_BATCH_MESSAGES;
+	in_client.stream_channel = in_channel_id;
+	in_channel.next_message = stop_index;
+
+	return 0;
+}
+
+/**
+  * Subscribes a client to new messages.  Everything it has not read yet is pushed
+  * right away, and from then on every new message is pushed as it is stored.
+  *
+  * @pre none
+  * @post in_channel is subscribed
+  * @param in_worker Worker that owns the connection
+  * @param in_socket Socket file descriptor of the client
+  * @param in_channel Channel of the connection to subscribe
+  */
+void do_subscribe(SessionWorker& in_worker,
+                  const int in_socket,
+                  SessionChannel& in_channel) {
+	if (in_channel.subscribed) {
+		return;
+	}
+	in_channel.subscribed = true;
+	in_worker.subscriptions[in_channel.session].sockets.push_back(in_socket);
+
+	// pairs with the fence in publish_new_messages - either the writer sees a
+	// subscriber here or handle_client sees its append when it queues our pushes
+	__atomic_store_n(&in_worker.subscriber_count, in_worker.subscriber_count + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+  * Stops pushing new messages to a client.
+  *
+  * @pre none
+  * @post in_channel is not subscribed
+  * @param in_worker Worker that owns the connection
+  * @param in_socket Socket file descriptor of the client
+  * @param in_channel Channel of the connection to unsubscribe
+  */
+void do_unsubscribe(SessionWorker& in_worker,
+                    const int in_socket,
+                    SessionChannel& in_channel) {
+	if (!in_channel.subscribed) {
+		return;
+	}
+	in_channel.subscribed = false;
+
+	map<ChatSession*, SubscriberList>::iterator list_it = in_worker.subscriptions.find(in_channel.session);
+	if (in_worker.subscriptions.end() == list_it) {
+		return;
+	}
 
-		// nothing more to do
+	vector<int>& sockets = list_it->second.sockets;
+	vector<int>::iterator found = std::find(sockets.begin(), sockets.end(), in_socket);
+	if (sockets.end() != found) {
+		*found = sockets.back();
+		sockets.pop_back();
+		__atomic_store_n(&in_worker.subscriber_count, in_worker.subscriber_count - 1, __ATOMIC_RELAXED);
+	}
+
+	// forget the session once nobody here listens to it - it may be closed down
+	if (sockets.empty()) {
+		in_worker.subscriptions.erase(list_it);
+	}
+}
+
+/**
+  * Queues one OP_SERVER_PUSH frame holding as many messages past the client's read
+  * position as fit in MAX_PUSH_PAYLOAD.  The push header is copied into the output
+  * queue and the messages it wraps are streamed from the chat history.
+  *
+  * @pre in_client has nothing queued and in_channel is behind its session's chat history
+  * @post The push has been queued and in_channel.next_message has been updated
+  * @param in_client Connection state of the client
+  * @param in_channel Channel to push to
+  * @param in_channel_id Channel number to tag the push with
+  * @return 0 if successful; -1 if error
+  */
+int queue_push(ClientConnection& in_client,
+               SessionChannel& in_channel,
+               const unsigned short in_channel_id) {
+	const MessageLog& in_all_messages = in_channel.session->all_messages;
+	const size_t stop_index = in_all_messages.size();
+	if (-1 == queue_gap(in_client, in_channel, in_channel_id)) {
+		return -1;
+	}
+	if (static_cast<size_t>(in_channel.next_message) >= stop_index) {
 		return 0;
 	}
 
-	// send the message
-	if (0 == send_chat_messages(in_socket, in_all_messages, start_index, stop_index)) {
-		// update the index if successful
-		in_next_message[in_socket] = stop_index;
+	// as many whole message frames as fit in one push frame
+	size_t batch_end = in_channel.next_message;
+	unsigned int batch_bytes = 0;
+	while (batch_end < stop_index && (batch_end == static_cast<size_t>(in_channel.next_message) || batch_bytes + in_all_messages.frame_length(batch_end) <= MAX_PUSH_PAYLOAD)) {
+		batch_bytes += in_all_messages.frame_length(batch_end);
+		++batch_end;
 	}
-	else {
-		util_send_tcp(in_socket, -1);
+
+	char push_header[FRAME_HEADER_SIZE];
+	util_encode_frame_header(OP_SERVER_PUSH, in_channel_id, batch_bytes, push_header);
+	if (-1 == queue_output(in_client, push_header, sizeof(push_header))) {
+		return -1;
 	}
 
+	in_client.stream_log = &in_all_messages;
+	in_client.stream_next = in_channel.next_message;
+	in_client.stream_stop = batch_end;
+	in_client.stream_batched = false;
+	in_channel.next_message = batch_end;
+
 	return 0;
 }
 
 /**
-  * Gets all unread messages in the chat history for the specified client.
+  * Queues an OP_SERVER_GAP notice if messages the client has not read yet were
+  * trimmed, and moves its read position up to the oldest message still kept.
   *
-  * @pre in_socket is a valid socket file descriptor
-  * @post in_next_message has been updated with the last read message
-  * @param in_socket Socket file descriptor to receive data on
-  * @param in_next_message Data structure that holds the index of the last read message
-  * @param in_all_messages Data structure that holds the chat history
+  * @pre in_client has nothing queued but what this request has queued so far
+  * @post in_channel.next_message is at or above the history's first_index()
+  * @param in_client Connection state of the client
+  * @param in_channel Channel about to read from the history
+  * @param in_channel_id Channel number to tag the notice with
   * @return 0 if successful; -1 if error
   */
-int do_get_all(const int in_socket,
-               map<int, int>& in_next_message,
-               const vector<string>& in_all_messages) {
-	// let's make sure that the next message exists
-	map<int, int>::const_iterator next_it = in_next_message.find(in_socket);
-	if (in_next_message.end() == next_it) {
-		fprintf(stderr, "failed to find last message index for client %d\n", in_socket);
-		util_send_tcp(in_socket, -1);
-		return -1;
+int queue_gap(ClientConnection& in_client,
+              SessionChannel& in_channel,
+              const unsigned short in_channel_id) {
+	const size_t first_index = in_channel.session->all_messages.first_index();
+	if (static_cast<size_t>(in_channel.next_message) >= first_index) {
+		return 0;
 	}
 
-	const int start_index = next_it->second;
-	const int stop_index = in_all_messages.size();
+	char gap_frame[FRAME_HEADER_SIZE + sizeof(unsigned int)];
+	const unsigned int net_num_skipped = htonl(first_index - in_channel.next_message);
+	util_encode_frame_header(OP_SERVER_GAP, in_channel_id, sizeof(net_num_skipped), gap_frame);
+	memcpy(gap_frame + FRAME_HEADER_SIZE, &net_num_skipped, sizeof(net_num_skipped));
+	in_channel.next_message = first_index;
+	return queue_output(in_client, gap_frame, sizeof(gap_frame));
+}
 
-	// we need to send the number of messages that will be sent first
-	const int num_msgs = stop_index - start_index;
+/**
+  * Queues an OP_SERVER_NO_MESSAGE response.
+  *
+  * @pre in_client has nothing queued
+  * @post The response has been queued
+  * @param in_client Connection state of the client
+  * @param in_channel_id Channel number to tag the response with
+  * @return 0 if successful; -1 if error
+  */
+int queue_no_message(ClientConnection& in_client,
+                     const unsigned short in_channel_id) {
+	char no_message_frame[FRAME_HEADER_SIZE];
+	util_encode_frame_header(OP_SERVER_NO_MESSAGE, in_channel_id, 0, no_message_frame);
+	return queue_output(in_client, no_message_frame, sizeof(no_message_frame));
+}
 
-	// no new messages
-	if (0 == num_msgs) {
-		if (-1 == util_send_tcp(in_socket, -1)) {
-			fprintf(stderr, "Failed to send number of messages.  Error is %s\n", strerror(errno));
-			return -1;
+/**
+  * Queues an OP_SERVER_NO_SESSION response.
+  *
+  * @pre in_client has nothing queued
+  * @post The response has been queued
+  * @param in_client Connection state of the client
+  * @param in_channel_id Channel that has no session
+  * @return 0 if successful; -1 if error
+  */
+int queue_no_session(ClientConnection& in_client,
+                     const unsigned short in_channel_id) {
+	char no_session_frame[FRAME_HEADER_SIZE];
+	util_encode_frame_header(OP_SERVER_NO_SESSION, in_channel_id, 0, no_session_frame);
+	return queue_output(in_client, no_session_frame, sizeof(no_session_frame));
+}
+
+/**
+  * Queues an OP_SERVER_STATS_REPLY with a snapshot of the whole server: one "server"
+  * record, one "session" record for the channel's session and one "request" record
+  * per request type.  Counters are read without stopping the other workers, so
+  * they may be a few requests apart from each other.
+  *
+  * @pre in_client has nothing queued
+  * @post The response has been queued
+  * @param in_worker Worker that owns the connection
+  * @param in_client Connection state of the client
+  * @param in_channel Channel the request came in on
+  * @param in_channel_id Channel number to tag the response with
+  * @return 0 if successful; -1 if error
+  */
+int do_stats(SessionWorker& in_worker,
+             ClientConnection& in_client,
+             const SessionChannel& in_channel,
+             const unsigned short in_channel_id) {
+	ServerContext& server = *in_worker.server;
+
+	WorkerStats totals;
+	for (int i = 0; i < server.num_workers; ++i) {
+		add_worker_stats(totals, server.workers[i].stats);
+	}
+
+	unsigned long num_sessions = 0;
+	unsigned long messages_stored = 0;
+	unsigned long bytes_stored = 0;
+	if (NULL != server.single_session) {
+		num_sessions = 1;
+		messages_stored = server.single_session->all_messages.size();
+		bytes_stored = server.single_session->all_messages.bytes_stored();
+	}
+	else {
+		// sessions are only deleted after they leave the map, so the lock keeps them alive
+		pthread_mutex_lock(&server.sessions_mutex);
+		for (map<unsigned int, ChatSession*>::const_iterator session_it = server.sessions.begin(); server.sessions.end() != session_it; ++session_it) {
+			++num_sessions;
+			messages_stored += session_it->second->all_messages.size();
+			bytes_stored += session_it->second->all_messages.bytes_stored();
 		}
+		pthread_mutex_unlock(&server.sessions_mutex);
+	}
 
-		// nothing more to do
-		return 0;
+	char line[512];
+	string snapshot;
+	sprintf(line, "server mode=%s workers=%d sessions=%lu clients=%lu messages_stored=%lu bytes_stored=%lu bytes_in=%lu bytes_out=%lu batch_original_bytes=%lu batch_bytes=%lu event_loop_iterations=%lu\n",
+	        (NULL != server.single_session) ? "single" : "hosting", server.num_workers, num_sessions, totals.connections,
+	        messages_stored, bytes_stored, totals.bytes_in, totals.bytes_out, totals.batch_original_bytes, totals.batch_bytes, totals.loop_iterations);
+	snapshot += line;
+
+	const ChatSession& session = *in_channel.session;
+	sprintf(line, "session id=%u clients=%d messages_stored=%lu first_message=%lu bytes_stored=%lu\n",
+	        session.session_id, __atomic_load_n(&session.connections, __ATOMIC_RELAXED),
+	        static_cast<unsigned long>(session.all_messages.size()), static_cast<unsigned long>(session.all_messages.first_index()),
+	        static_cast<unsigned long>(session.all_messages.bytes_stored()));
+	snapshot += line;
+
+	// histogram_ns lists upper bound:count for every bucket in use
+	for (int type = 0; type < NUM_REQUEST_TYPES; ++type) {
+		sprintf(line, "request command=%s count=%lu total_ns=%lu histogram_ns=", REQUEST_NAMES[type], totals.requests[type], totals.service_ns[type]);
+		snapshot += line;
+
+		bool first = true;
+		for (int bucket = 0; bucket < NUM_LATENCY_BUCKETS; ++bucket) {
+			if (0 == totals.histogram[type][bucket]) {
+				continue;
+			}
+			if (NUM_LATENCY_BUCKETS - 1 == bucket) {
+				sprintf(line, "%sinf:%lu", first ? "" : ",", totals.histogram[type][bucket]);
+			}
+			else {
+				sprintf(line, "%s%lu:%lu", first ? "" : ",", 1UL << bucket, totals.histogram[type][bucket]);
+			}
+			snapshot += line;
+			first = false;
+		}
+		snapshot += "\n";
+	}
+
+	char header[FRAME_HEADER_SIZE];
+	util_encode_frame_header(OP_SERVER_STATS_REPLY, in_channel_id, snapshot.length(), header);
+	if (-1 == queue_output(in_client, header, sizeof(header))) {
+		return -1;
 	}
+	return queue_output(in_client, snapshot.data(), snapshot.length());
+}
 
-	// have n messages
-	if (-1 == util_send_tcp(in_socket, num_msgs)) {
-		fprintf(stderr, "Failed to send number of messages.  Error is %s\n", strerror(errno));
+/**
+  * Resumes a channel from the read position a dropped connection left behind, and
+  * answers with the token to resume this channel with in turn.
+  *
+  * An unknown token (never issued, already used, or from before a restart) leaves
+  * the read position where it is.  A channel keeps its token once it has one.
+  *
+  * @pre in_client has nothing queued
+  * @post The response has been queued
+  * @param in_server Session server
+  * @param in_client Connection state of the client
+  * @param in_channel Channel the request came in on
+  * @param in_channel_id Channel number to tag the response with
+  * @param in_payload Payload of the OP_SERVER_RESUME frame
+  * @param in_payload_len Length of in_payload
+  * @return 0 if successful; -1 if error
+  */
+int do_resume(ServerContext& in_server,
+              ClientConnection& in_client,
+              SessionChannel& in_channel,
+              const unsigned short in_channel_id,
+              const char* const in_payload,
+              const unsigned int in_payload_len) {
+	if (0 != in_payload_len && RESUME_TOKEN_SIZE != in_payload_len) {
 		return -1;
 	}
 
-	// then send the messages
-	if (0 == send_chat_messages(in_socket, in_all_messages, start_index, stop_index)) {
-		// update the index if successful
-		in_next_message[in_socket] = stop_index;
+	if (RESUME_TOKEN_SIZE == in_payload_len) {
+		// the token is opaque to the client, so it travels in our byte order
+		uint64_t token;
+		memcpy(&token, in_payload, sizeof(token));
+
+		ChatSession& session = *in_channel.session;
+		pthread_mutex_lock(&session.cursors_mutex);
+		map<uint64_t, ParkedCursor>::iterator cursor_it = session.parked_cursors.find(token);
+		if (session.parked_cursors.end() != cursor_it) {
+			in_channel.next_message = cursor_it->second.next_message;
+			in_channel.resume_token = token;
+			session.parked_order.erase(cursor_it->second.park_number);
+			session.parked_cursors.erase(cursor_it);
+		}
+		pthread_mutex_unlock(&session.cursors_mutex);
 	}
-	else {
-		util_send_tcp(in_socket, -1);
+
+	if (0 == in_channel.resume_token) {
+		in_channel.resume_token = new_resume_token(in_server);
 	}
 
-	return 0;
+	// the session name lets a client notice it reached a different session than it asked for
+	const string& session_name = in_channel.session->session_name;
+	char token_header[FRAME_HEADER_SIZE];
+	util_encode_frame_header(OP_SERVER_RESUME_TOKEN, in_channel_id, RESUME_TOKEN_SIZE + session_name.length(), token_header);
+	string token_frame(token_header, sizeof(token_header));
+	token_frame.append(reinterpret_cast<const char*>(&in_channel.resume_token), sizeof(in_channel.resume_token));
+	token_frame += session_name;
+	return queue_output(in_client, token_frame.data(), token_frame.length());
 }
 
 /**
-  * Implementation of GetNext and GetAll commands.
+  * Keeps the read position of a channel whose connection dropped, so the client
+  * can resume it.  The oldest parked position goes once the session has too many.
   *
-  * @pre in_socket is a valid socket file descriptor
-  * @post none
-  * @param in_socket Socket file descriptor to receive data on
-  * @param in_all_messages Data structure that holds the chat history
-  * @param start_index Index of the next unread message
-  * @param stop_index Index of the last message to retrieve
+  * @pre in_channel is about to be closed
+  * @post The read position is parked if the channel has a resume token
+  * @param in_channel Channel of the dropped connection
+  */
+void park_cursor(const SessionChannel& in_channel) {
+	if (0 == in_channel.resume_token) {
+		return;
+	}
+
+	ChatSession& session = *in_channel.session;
+	pthread_mutex_lock(&session.cursors_mutex);
+	if (session.parked_cursors.size() >= MAX_PARKED_CURSORS) {
+		map<uint64_t, uint64_t>::iterator oldest = session.parked_order.begin();
+		session.parked_cursors.erase(oldest->second);
+		session.parked_order.erase(oldest);
+	}
+
+	ParkedCursor& cursor = session.parked_cursors[in_channel.resume_token];
+	cursor.next_message = in_channel.next_message;
+	cursor.park_number = session.next_park_number++;
+	session.parked_order[cursor.park_number] = in_channel.resume_token;
+	pthread_mutex_unlock(&session.cursors_mutex);
+}
+
+/**
+  * Reads the key resume tokens are made with from the kernel's random source.
+  *
+  * @pre none
+  * @post in_server.resume_key is set if successful
+  * @param in_server Server to set the key of
   * @return 0 if successful; -1 if error
   */
-int send_chat_messages(const int in_socket,
-                       const vector<string>& in_all_messages,
-                       const unsigned int start_index,
-                       const unsigned int stop_index) {
-	if (start_index > stop_index) {
-		fprintf(stderr, "start index > stop index for client %d\n", in_socket);
+int read_resume_key(ServerContext& in_server) {
+	const int random_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (-1 == random_fd) {
+		fprintf(stderr, "Unable to open /dev/urandom.  Error is %s\n", strerror(errno));
 		return -1;
 	}
 
-	if (start_index >= in_all_messages.size() || stop_index > in_all_messages.size()) {
-		fprintf(stderr, "message index out of range for client %d\n", in_socket);
+	const ssize_t num_bytes = read(random_fd, in_server.resume_key, sizeof(in_server.resume_key));
+	close(random_fd);
+	if (static_cast<ssize_t>(sizeof(in_server.resume_key)) != num_bytes) {
+		fprintf(stderr, "Unable to read /dev/urandom.  Error is %s\n", strerror(errno));
 		return -1;
 	}
 
-	// write the message to the socket
-	for (unsigned int i = start_index; i < stop_index; i++) {
-		const string message = in_all_messages.at(i);
+	return 0;
+}
+
+/**
+  * Makes a resume token no client can work out from the ones it was given.  Mixing
+  * is one-to-one, so no two tokens from this server are the same.
+  *
+  * @pre in_server.resume_key is set
+  * @post in_server.resume_count is one higher
+  * @param in_server Server handing out the token
+  * @return A new token.  Never 0.
+  */
+uint64_t new_resume_token(ServerContext& in_server) {
+	for (;;) {
+		const uint64_t count = __atomic_add_fetch(&in_server.resume_count, 1, __ATOMIC_RELAXED);
+		const uint64_t token = mix_bits(mix_bits(count ^ in_server.resume_key[0]) ^ in_server.resume_key[1]);
+		// 0 means no token, so the one count that mixes to it is skipped
+		if (0 != token) {
+			return token;
+		}
+	}
+}
+
+/**
+  * Scrambles a 64 bit value with the splitmix64 finalizer.  Every input maps to a
+  * different output.
+  *
+  * @pre none
+  * @post none
+  * @param in_value Value to scramble
+  * @return The scrambled value
+  */
+uint64_t mix_bits(uint64_t in_value) {
+	// spelled in halves - 64 bit literals are not C++98
+	const uint64_t multiplier1 = (static_cast<uint64_t>(0xbf58476dU) << 32) | 0x1ce4e5b9U;
+	const uint64_t multiplier2 = (static_cast<uint64_t>(0x94d049bbU) << 32) | 0x133111ebU;
+
+	in_value = (in_value ^ (in_value >> 30)) * multiplier1;
+	in_value = (in_value ^ (in_value >> 27)) * multiplier2;
+	return in_value ^ (in_value >> 31);
+}
 
-		// send the length
-		util_send_tcp(in_socket, message.length());
+/**
+  * Adds one worker's counters to a running total.
+  *
+  * @pre none
+  * @post in_totals includes in_stats
+  * @param in_totals Totals to add to.  Only used by the calling thread.
+  * @param in_stats Counters of a worker.  Its owner may be updating them.
+  */
+void add_worker_stats(WorkerStats& in_totals,
+                      const WorkerStats& in_stats) {
+	in_totals.connections += __atomic_load_n(&in_stats.connections, __ATOMIC_RELAXED);
+	in_totals.bytes_in += __atomic_load_n(&in_stats.bytes_in, __ATOMIC_RELAXED);
+	in_totals.bytes_out += __atomic_load_n(&in_stats.bytes_out, __ATOMIC_RELAXED);
+	in_totals.batch_original_bytes += __atomic_load_n(&in_stats.batch_original_bytes, __ATOMIC_RELAXED);
+	in_totals.batch_bytes += __atomic_load_n(&in_stats.batch_bytes, __ATOMIC_RELAXED);
+	in_totals.loop_iterations += __atomic_load_n(&in_stats.loop_iterations, __ATOMIC_RELAXED);
 
-		// then the message itself
-		util_send_tcp(in_socket, message.c_str(), message.length());
+	for (int type = 0; type < NUM_REQUEST_TYPES; ++type) {
+		in_totals.requests[type] += __atomic_load_n(&in_stats.requests[type], __ATOMIC_RELAXED);
+		in_totals.service_ns[type] += __atomic_load_n(&in_stats.service_ns[type], __ATOMIC_RELAXED);
+		for (int bucket = 0; bucket < NUM_LATENCY_BUCKETS; ++bucket) {
+			in_totals.histogram[type][bucket] += __atomic_load_n(&in_stats.histogram[type][bucket], __ATOMIC_RELAXED);
+		}
 	}
+}
 
-	return 0;
+/**
+  * Counts a request that has just been served and its service time.
+  *
+  * @pre Called by the worker that owns in_stats
+  * @post The request is in in_stats
+  * @param in_stats Counters of the worker that served the request
+  * @param in_opcode Opcode of the request
+  * @param in_started When the worker started on the request, from now_ns()
+  * @return The time the request finished, which is when the next one starts
+  */
+uint64_t record_request(WorkerStats& in_stats,
+                        const unsigned char in_opcode,
+                        const uint64_t in_started) {
+	const uint64_t finished = now_ns();
+	const unsigned long elapsed = finished - in_started;
+	const int type = (in_opcode < NUM_REQUEST_TYPES) ? in_opcode : 0;
+
+	// bucket b holds times of b significant bits
+	int bucket = (0 == elapsed) ? 0 : static_cast<int>(sizeof(elapsed) * CHAR_BIT) - __builtin_clzl(elapsed);
+	if (bucket >= NUM_LATENCY_BUCKETS) {
+		bucket = NUM_LATENCY_BUCKETS - 1;
+	}
+
+	add_stat(in_stats.requests[type], 1);
+	add_stat(in_stats.service_ns[type], elapsed);
+	add_stat(in_stats.histogram[type][bucket], 1);
+
+	return finished;
+}
+
+/**
+  * Adds to a counter that only the calling worker writes.
+  *
+  * @pre Called by the worker that owns in_counter
+  * @post in_counter has grown by in_amount
+  * @param in_counter Counter to add to
+  * @param in_amount Amount to add
+  */
+void add_stat(unsigned long& in_counter,
+              const unsigned long in_amount) {
+	// not a read-modify-write - nobody else writes the counter
+	__atomic_store_n(&in_counter, in_counter + in_amount, __ATOMIC_RELAXED);
 }
 
+/**
+  * Reads the monotonic clock.
+  *
+  * @pre none
+  * @post none
+  * @return Current time in nanoseconds
+  */
+uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
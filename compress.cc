@@ -0,0 +1,222 @@
+/**
+ * @file compress.cc
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief LZ77 block codec implementation
+ */
+
+#include "compress.h"
+
+#include <cstring>
+
+#include <stdint.h>
+
+
+/** log2 of the number of slots in the match finder's hash table */
+static const unsigned int HASH_BITS = 12;
+/** Farthest back a match may start */
+static const size_t MAX_OFFSET = 65535;
+/** A match may not cover the last bytes of a block, so the last sequence always has literals */
+static const size_t END_LITERALS = 5;
+/** Largest value a length field holds in the token itself */
+static const unsigned int TOKEN_FIELD_MAX = 15;
+
+/**
+  * Reads 4 bytes without caring about alignment.
+  *
+  * @pre in_ptr points to at least 4 bytes
+  * @post none
+  * @param in_ptr Bytes to read
+  * @return The bytes as a host order integer
+  */
+static uint32_t read32(const char* const in_ptr) {
+	uint32_t value;
+	memcpy(&value, in_ptr, sizeof(value));
+	return value;
+}
+
+/**
+  * Hashes the 4 bytes at a position for the match finder.
+  *
+  * @pre in_ptr points to at least 4 bytes
+  * @post none
+  * @param in_ptr Bytes to hash
+  * @return Hash table slot
+  */
+static unsigned int hash4(const char* const in_ptr) {
+	return (read32(in_ptr) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/**
+  * Writes the part of a length that did not fit in its token field.
+  *
+  * @pre out_ptr has room for in_len / 255 + 1 bytes
+  * @post The continuation bytes have been written
+  * @param out_ptr Where to write.  Advanced past what was written.
+  * @param in_len Length minus TOKEN_FIELD_MAX
+  */
+static void write_length(char*& out_ptr,
+                         size_t in_len) {
+	while (in_len >= 255) {
+		*out_ptr++ = static_cast<char>(255);
+		in_len -= 255;
+	}
+	*out_ptr++ = static_cast<char>(in_len);
+}
+
+/**
+  * Reads the continuation bytes of a length field that was TOKEN_FIELD_MAX.
+  *
+  * @pre none
+  * @post in_ptr is past the continuation bytes if successful
+  * @param in_ptr Where to read.  Advanced past what was read.
+  * @param in_end End of the compressed block
+  * @param io_len Length to add to
+  * @return 0 if successful; -1 if the block ends first
+  */
+static int read_length(const unsigned char*& in_ptr,
+                       const unsigned char* const in_end,
+                       size_t& io_len) {
+	for (;;) {
+		if (in_ptr >= in_end) {
+			return -1;
+		}
+		const unsigned char byte = *in_ptr++;
+		io_len += byte;
+		if (byte < 255) {
+			return 0;
+		}
+	}
+}
+
+/**
+  * Writes one sequence.
+  *
+  * @pre out_ptr has room for the sequence
+  * @post The sequence has been written
+  * @param out_ptr Where to write.  Advanced past what was written.
+  * @param in_literals Literal bytes
+  * @param in_num_literals Number of literal bytes
+  * @param in_offset Distance back to the match.  Ignored for the last sequence.
+  * @param in_match_len Length of the match.  0 for the last sequence.
+  */
+static void write_sequence(char*& out_ptr,
+                           const char* const in_literals,
+                           const size_t in_num_literals,
+                           const size_t in_offset,
+                           const size_t in_match_len) {
+	const size_t match_field = (0 == in_match_len) ? 0 : in_match_len - COMPRESS_MIN_MATCH;
+	char* const token = out_ptr++;
+	*token = static_cast<char>(((in_num_literals < TOKEN_FIELD_MAX ? in_num_literals : TOKEN_FIELD_MAX) << 4) |
+	                           (match_field < TOKEN_FIELD_MAX ? match_field : TOKEN_FIELD_MAX));
+
+	if (in_num_literals >= TOKEN_FIELD_MAX) {
+		write_length(out_ptr, in_num_literals - TOKEN_FIELD_MAX);
+	}
+	memcpy(out_ptr, in_literals, in_num_literals);
+	out_ptr += in_num_literals;
+
+	if (0 == in_match_len) {
+		return;
+	}
+	*out_ptr++ = static_cast<char>(in_offset & 0xFF);
+	*out_ptr++ = static_cast<char>(in_offset >> 8);
+	if (match_field >= TOKEN_FIELD_MAX) {
+		write_length(out_ptr, match_field - TOKEN_FIELD_MAX);
+	}
+}
+
+size_t compress_bound(const size_t in_len) {
+	return in_len + in_len / 255 + 16;
+}
+
+size_t compress_block(const char* const in_buf,
+                      const size_t in_len,
+                      char* const out_buf) {
+	char* out_ptr = out_buf;
+	size_t literal_start = 0;
+
+	if (in_len > END_LITERALS + COMPRESS_MIN_MATCH) {
+		// most recent position seen with each hash
+		size_t table[1 << HASH_BITS];
+		memset(table, 0, sizeof(table));
+
+		const size_t match_limit = in_len - END_LITERALS;
+		size_t pos = 0;
+		while (pos + COMPRESS_MIN_MATCH <= match_limit) {
+			const unsigned int slot = hash4(in_buf + pos);
+			const size_t candidate = table[slot];
+			table[slot] = pos;
+
+			if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(in_buf + candidate) != read32(in_buf + pos)) {
+				++pos;
+				continue;
+			}
+
+			size_t match_len = COMPRESS_MIN_MATCH;
+			while (pos + match_len < match_limit && in_buf[candidate + match_len] == in_buf[pos + match_len]) {
+				++match_len;
+			}
+
+			write_sequence(out_ptr, in_buf + literal_start, pos - literal_start, pos - candidate, match_len);
+			pos += match_len;
+			literal_start = pos;
+		}
+	}
+
+	write_sequence(out_ptr, in_buf + literal_start, in_len - literal_start, 0, 0);
+	return out_ptr - out_buf;
+}
+
+int decompress_block(const char* const in_buf,
+                     const size_t in_len,
+                     char* const out_buf,
+                     const size_t out_len) {
+	const unsigned char* in_ptr = reinterpret_cast<const unsigned char*>(in_buf);
+	const unsigned char* const in_end = in_ptr + in_len;
+	size_t out_pos = 0;
+
+	for (;;) {
+		if (in_ptr >= in_end) {
+			return -1;
+		}
+		const unsigned char token = *in_ptr++;
+
+		size_t num_literals = token >> 4;
+		if (TOKEN_FIELD_MAX == num_literals && -1 == read_length(in_ptr, in_end, num_literals)) {
+			return -1;
+		}
+		if (num_literals > static_cast<size_t>(in_end - in_ptr) || num_literals > out_len - out_pos) {
+			return -1;
+		}
+		memcpy(out_buf + out_pos, in_ptr, num_literals);
+		in_ptr += num_literals;
+		out_pos += num_literals;
+
+		// the last sequence has no match
+		if (in_ptr == in_end) {
+			return (out_len == out_pos) ? 0 : -1;
+		}
+
+		if (in_end - in_ptr < 2) {
+			return -1;
+		}
+		const size_t offset = in_ptr[0] | (in_ptr[1] << 8);
+		in_ptr += 2;
+		size_t match_len = token & TOKEN_FIELD_MAX;
+		if (TOKEN_FIELD_MAX == match_len && -1 == read_length(in_ptr, in_end, match_len)) {
+			return -1;
+		}
+		match_len += COMPRESS_MIN_MATCH;
+		if (0 == offset || offset > out_pos || match_len > out_len - out_pos) {
+			return -1;
+		}
+
+		// the match may overlap what it is copying, so go a byte at a time
+		const char* match = out_buf + out_pos - offset;
+		for (size_t i = 0; i < match_len; ++i) {
+			out_buf[out_pos + i] = match[i];
+		}
+		out_pos += match_len;
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef __CSCI_5273_COMPRESS_H
+#define __CSCI_5273_COMPRESS_H
+
+/**
+ * @file compress.h
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief Small, fast LZ77 block codec for batches of chat messages
+ *
+ * A compressed block is a series of sequences.  Each sequence is a token byte,
+ * then literals copied as is, then a match that repeats earlier output:
+ *
+ *   token         high 4 bits literal count, low 4 bits match length - COMPRESS_MIN_MATCH.
+ *                 A field of 15 continues in the bytes that follow: each one is added
+ *                 to it, and a byte below 255 is the last.
+ *   literals      literal count bytes
+ *   offset        2 bytes, little endian - how far back the match starts (1 to 65535)
+ *   match length  continuation bytes, as above
+ *
+ * The last sequence stops after its literals and has no match.  Blocks are
+ * self-contained: nothing is carried from one block to the next.
+ */
+
+#include <cstddef>
+
+
+/** Shortest match the encoder emits */
+const size_t COMPRESS_MIN_MATCH = 4;
+
+/**
+  * Largest size a block can compress to.
+  *
+  * @pre none
+  * @post none
+  * @param in_len Number of bytes to compress
+  * @return Size of the output buffer compress_block() needs
+  */
+size_t compress_bound(const size_t in_len);
+
+/**
+  * Compresses a block.
+  *
+  * @pre out_buf has room for compress_bound(in_len) bytes
+  * @post out_buf holds the compressed block
+  * @param in_buf Bytes to compress
+  * @param in_len Number of bytes in in_buf
+  * @param out_buf Buffer for the compressed block
+  * @return Size of the compressed block
+  */
+size_t compress_block(const char* const in_buf,
+                      const size_t in_len,
+                      char* const out_buf);
+
+/**
+  * Decompresses a block.  Corrupt input is caught, never read or written past.
+  *
+  * @pre out_buf has room for out_len bytes
+  * @post out_buf holds the original bytes if successful
+  * @param in_buf Compressed block
+  * @param in_len Number of bytes in in_buf
+  * @param out_buf Buffer for the original bytes
+  * @param out_len Size of the original block
+  * @return 0 if successful; -1 if the block is corrupt or does not decompress to out_len bytes
+  */
+int decompress_block(const char* const in_buf,
+                     const size_t in_len,
+                     char* const out_buf,
+                     const size_t out_len);
+
+#endif /* __CSCI_5273_COMPRESS_H */
@@ -0,0 +1,615 @@
+/**
+ * @file message_log.cc
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief Append-only chat history implementation
+ */
+
+#include "message_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "socket_utils.h"
+#include "strings.h"
+
+/** Identifies a persistent index file and its layout version */
+static const char INDEX_FILE_MAGIC[8] = { 'C', 'H', 'A', 'T', 'L', 'O', 'G', '1' };
+/** Name of the index file inside a persistent log directory */
+static const char* const INDEX_FILE_NAME = "index";
+
+MessageLog::MessageLog() :
+	m_append_mutex(),
+	m_size(0),
+	m_first(0),
+	m_bytes_stored(0),
+	m_memory_usage(0),
+	m_chunks(NULL),
+	m_chunks_capacity(0),
+	m_num_chunks(0),
+	m_chunk_capacity(0),
+	m_chunk_used(0),
+	m_next_chunk_size(MIN_CHUNK_SIZE),
+	m_chunk_sizes(),
+	m_chunk_first_message(),
+	m_chunk_sealed(),
+	m_first_chunk(0),
+	m_released_chunks(0),
+	m_released_index_blocks(0),
+	m_index_blocks(NULL),
+	m_index_capacity(0),
+	m_num_index_blocks(0),
+	m_retired_directories(),
+	m_directory(),
+	m_index_fd(-1),
+	m_index_map(NULL),
+	m_index_file_size(0),
+	m_index_header(NULL),
+	m_segment_fds(NULL),
+	m_segment_fds_capacity(0) {
+	pthread_mutex_init(&m_append_mutex, NULL);
+}
+
+MessageLog::~MessageLog() {
+	if (-1 == m_index_fd) {
+		for (size_t i = 0; i < m_num_chunks; ++i) {
+			free(m_chunks[i]);
+		}
+		for (size_t i = 0; i < m_num_index_blocks; ++i) {
+			free(m_index_blocks[i]);
+		}
+	}
+	else {
+		// segments and index blocks are mappings - the data stays on disk
+		for (size_t i = m_released_chunks; i < m_num_chunks; ++i) {
+			munmap(m_chunks[i], m_chunk_sizes[i]);
+			close(static_cast<int>(reinterpret_cast<intptr_t>(m_segment_fds[i])));
+		}
+		munmap(m_index_map, sizeof(IndexFileHeader) + MAX_PERSISTENT_INDEX_BLOCKS * INDEX_BLOCK_SIZE * sizeof(IndexEntry));
+		close(m_index_fd);
+	}
+	for (size_t i = 0; i < m_retired_directories.size(); ++i) {
+		free(m_retired_directories[i]);
+	}
+	free(m_chunks);
+	free(m_segment_fds);
+	free(m_index_blocks);
+	pthread_mutex_destroy(&m_append_mutex);
+}
+
+int MessageLog::open(const std::string& in_directory) {
+	if (0 != mkdir(in_directory.c_str(), 0755) && EEXIST != errno) {
+		fprintf(stderr, "Failed to create log directory %s.  Error is %s\n", in_directory.c_str(), strerror(errno));
+		return -1;
+	}
+	m_directory = in_directory;
+
+	const std::string index_path = m_directory + "/" + INDEX_FILE_NAME;
+	m_index_fd = ::open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_index_fd < 0) {
+		fprintf(stderr, "Failed to open %s.  Error is %s\n", index_path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	// two servers appending to the same files would corrupt them
+	if (0 != flock(m_index_fd, LOCK_EX | LOCK_NB)) {
+		fprintf(stderr, "%s is in use by another session server\n", index_path.c_str());
+		return -1;
+	}
+
+	struct stat index_stat;
+	if (0 != fstat(m_index_fd, &index_stat)) {
+		fprintf(stderr, "Failed to stat %s.  Error is %s\n", index_path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	const bool is_new = (static_cast<size_t>(index_stat.st_size) < sizeof(IndexFileHeader));
+	m_index_file_size = is_new ? sizeof(IndexFileHeader) : index_stat.st_size;
+	if (is_new && 0 != ftruncate(m_index_fd, m_index_file_size)) {
+		fprintf(stderr, "Failed to size %s.  Error is %s\n", index_path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	// reserve the address space for the largest index up front so the mapping never moves
+	const size_t block_bytes = INDEX_BLOCK_SIZE * sizeof(IndexEntry);
+	const size_t map_len = sizeof(IndexFileHeader) + MAX_PERSISTENT_INDEX_BLOCKS * block_bytes;
+	void* const index_map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, m_index_fd, 0);
+	if (MAP_FAILED == index_map) {
+		fprintf(stderr, "Failed to map %s.  Error is %s\n", index_path.c_str(), strerror(errno));
+		return -1;
+	}
+	m_index_map = static_cast<char*>(index_map);
+	m_index_header = reinterpret_cast<IndexFileHeader*>(m_index_map);
+
+	if (is_new) {
+		memcpy(m_index_header->magic, INDEX_FILE_MAGIC, sizeof(INDEX_FILE_MAGIC));
+	}
+	else if (0 != memcmp(m_index_header->magic, INDEX_FILE_MAGIC, sizeof(INDEX_FILE_MAGIC))) {
+		fprintf(stderr, "%s is not a chat log index\n", index_path.c_str());
+		return -1;
+	}
+
+	// persistent segments are always full size
+	m_next_chunk_size = MAX_CHUNK_SIZE;
+	__atomic_store_n(&m_memory_usage, m_memory_usage + sizeof(IndexFileHeader), __ATOMIC_RELAXED);
+
+	// segments below the first kept one are gone, or were trimmed just before a crash
+	const size_t first_chunk = m_index_header->first_chunk;
+	for (size_t segment = first_chunk; segment > 0; --segment) {
+		if (0 != unlink(segment_path(segment - 1).c_str())) {
+			break;
+		}
+	}
+
+	// map every remaining segment, keeping the chunk numbers the index refers to
+	m_num_chunks = m_first_chunk = m_released_chunks = first_chunk;
+	m_chunk_sizes.resize(first_chunk, 0);
+	m_chunk_first_message.resize(first_chunk, 0);
+	m_chunk_sealed.resize(first_chunk, 0);
+	time_t previous_mtime = 0;
+	for (size_t segment = first_chunk; ; ++segment) {
+		struct stat segment_stat;
+		if (0 != stat(segment_path(segment).c_str(), &segment_stat)) {
+			break;
+		}
+		if (-1 == map_segment(segment, 0)) {
+			return -1;
+		}
+		// the segment before this one took its last message when it was last written
+		if (segment > first_chunk) {
+			m_chunk_sealed[segment - 1] = previous_mtime;
+		}
+		previous_mtime = segment_stat.st_mtime;
+	}
+
+	// point the index directory at the blocks that are already in the file
+	size_t num_messages = m_index_header->size;
+	const size_t blocks_in_file = (m_index_file_size - sizeof(IndexFileHeader)) / block_bytes;
+	if (num_messages > blocks_in_file * INDEX_BLOCK_SIZE) {
+		num_messages = blocks_in_file * INDEX_BLOCK_SIZE;
+	}
+	size_t first = m_index_header->first;
+	if (first > num_messages) {
+		first = num_messages;
+	}
+	for (size_t block = 0; block < blocks_in_file; ++block) {
+		if (-1 == reserve_directory(m_index_blocks, m_index_capacity, block)) {
+			return -1;
+		}
+		m_index_blocks[block] = m_index_map + sizeof(IndexFileHeader) + block * block_bytes;
+		++m_num_index_blocks;
+		__atomic_store_n(&m_memory_usage, m_memory_usage + block_bytes, __ATOMIC_RELAXED);
+	}
+
+	// a crash can leave the tail half written - drop anything that does not check out
+	while (num_messages > first && !entry_is_valid(num_messages - 1)) {
+		--num_messages;
+	}
+
+	// find where each segment's messages start - entries are in segment order
+	for (size_t chunk = first_chunk; chunk < m_num_chunks; ++chunk) {
+		size_t low = first;
+		size_t high = num_messages;
+		while (low < high) {
+			const size_t middle = low + (high - low) / 2;
+			if (entry(middle).chunk < chunk) {
+				low = middle + 1;
+			}
+			else {
+				high = middle;
+			}
+		}
+		m_chunk_first_message[chunk] = low;
+	}
+
+	// appends continue right after the last good frame
+	if (num_messages > 0) {
+		const IndexEntry& last = entry(num_messages - 1);
+		if (last.chunk + 1 == m_num_chunks) {
+			m_chunk_used = last.offset + FRAME_HEADER_SIZE + last.length;
+		}
+	}
+
+	// the recorded byte count may include entries dropped above, or an append whose
+	// size never made it to the header, so count what is actually kept
+	size_t bytes_stored = 0;
+	for (size_t index = first; index < num_messages; ++index) {
+		bytes_stored += entry(index).length;
+	}
+
+	m_index_header->size = num_messages;
+	m_index_header->bytes_stored = bytes_stored;
+	m_bytes_stored = bytes_stored;
+	__atomic_store_n(&m_first, first, __ATOMIC_RELEASE);
+	__atomic_store_n(&m_size, num_messages, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int MessageLog::append(const char* const in_buf, const size_t in_buf_len) {
+	const size_t frame_len = FRAME_HEADER_SIZE + in_buf_len;
+	if (in_buf_len > MAX_FRAME_PAYLOAD) {
+		fprintf(stderr, "message of %lu bytes is too large to store\n", static_cast<unsigned long>(in_buf_len));
+		return -1;
+	}
+
+	pthread_mutex_lock(&m_append_mutex);
+
+	// only writers change m_size, and we hold the writer lock
+	const size_t index = m_size;
+	if (index >= static_cast<size_t>(INT_MAX)) {
+		pthread_mutex_unlock(&m_append_mutex);
+		return -1;
+	}
+
+	if ((0 == m_num_chunks || m_chunk_used + frame_len > m_chunk_capacity) && -1 == add_chunk(frame_len)) {
+		pthread_mutex_unlock(&m_append_mutex);
+		return -1;
+	}
+
+	if (-1 == add_index_block(index)) {
+		pthread_mutex_unlock(&m_append_mutex);
+		return -1;
+	}
+
+	// the frame is copied exactly once - from the connection's read buffer into the arena
+	char* const frame_start = static_cast<char*>(m_chunks[m_num_chunks - 1]) + m_chunk_used;
+	util_encode_frame_header(OP_SERVER_MESSAGE, 0, in_buf_len, frame_start);
+	memcpy(frame_start + FRAME_HEADER_SIZE, in_buf, in_buf_len);
+
+	IndexEntry& new_entry = static_cast<IndexEntry*>(m_index_blocks[index >> INDEX_SHIFT])[index & (INDEX_BLOCK_SIZE - 1)];
+	new_entry.chunk = m_num_chunks - 1;
+	new_entry.offset = m_chunk_used;
+	new_entry.length = in_buf_len;
+
+	m_chunk_used += frame_len;
+	__atomic_store_n(&m_bytes_stored, m_bytes_stored + in_buf_len, __ATOMIC_RELAXED);
+
+	// a persistent log records the new size only after the frame and entry are in place
+	if (NULL != m_index_header) {
+		m_index_header->bytes_stored = m_bytes_stored;
+		__atomic_store_n(&m_index_header->size, index + 1, __ATOMIC_RELEASE);
+	}
+
+	// publish - everything written above is visible to a reader that sees the new size
+	__atomic_store_n(&m_size, index + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&m_append_mutex);
+	return static_cast<int>(index);
+}
+
+size_t MessageLog::size() const {
+	return __atomic_load_n(&m_size, __ATOMIC_ACQUIRE);
+}
+
+size_t MessageLog::first_index() const {
+	return __atomic_load_n(&m_first, __ATOMIC_ACQUIRE);
+}
+
+size_t MessageLog::trim(const size_t in_max_messages, const size_t in_max_bytes, const time_t in_max_age) {
+	pthread_mutex_lock(&m_append_mutex);
+
+	const time_t now = time(NULL);
+	size_t kept_bytes = 0;
+	for (size_t chunk = m_first_chunk; chunk < m_num_chunks; ++chunk) {
+		kept_bytes += m_chunk_sizes[chunk];
+	}
+
+	// only whole chunks go, oldest first, and never the one being appended to
+	size_t first_chunk = m_first_chunk;
+	while (first_chunk + 1 < m_num_chunks) {
+		const size_t messages_after = m_size - m_chunk_first_message[first_chunk + 1];
+		const bool over_messages = (0 != in_max_messages && messages_after >= in_max_messages);
+		const bool over_bytes = (0 != in_max_bytes && kept_bytes > in_max_bytes);
+		const bool over_age = (0 != in_max_age && m_chunk_sealed[first_chunk] + in_max_age <= now);
+		if (!over_messages && !over_bytes && !over_age) {
+			break;
+		}
+		kept_bytes -= m_chunk_sizes[first_chunk];
+		++first_chunk;
+	}
+
+	if (first_chunk == m_first_chunk) {
+		pthread_mutex_unlock(&m_append_mutex);
+		return 0;
+	}
+	m_first_chunk = first_chunk;
+
+	// the trimmed messages still exist until compact(), so their lengths can be read
+	const size_t old_first = m_first;
+	const size_t first = std::max(old_first, m_chunk_first_message[first_chunk]);
+	size_t trimmed_bytes = 0;
+	for (size_t index = old_first; index < first; ++index) {
+		trimmed_bytes += entry(index).length;
+	}
+	__atomic_store_n(&m_bytes_stored, m_bytes_stored - trimmed_bytes, __ATOMIC_RELAXED);
+
+	// a persistent log records the new start before anything is deleted
+	if (NULL != m_index_header) {
+		m_index_header->bytes_stored = m_bytes_stored;
+		m_index_header->first_chunk = first_chunk;
+		__atomic_store_n(&m_index_header->first, first, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&m_first, first, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&m_append_mutex);
+	return first - old_first;
+}
+
+void MessageLog::compact(const size_t in_floor) {
+	pthread_mutex_lock(&m_append_mutex);
+
+	// a chunk can go once the next one starts at or below the floor
+	while (m_released_chunks < m_first_chunk && m_chunk_first_message[m_released_chunks + 1] <= in_floor) {
+		release_chunk(m_released_chunks);
+		++m_released_chunks;
+	}
+
+	// index blocks live in the index file of a persistent log, which only grows
+	if (-1 == m_index_fd) {
+		while (m_released_index_blocks + 1 < m_num_index_blocks && (m_released_index_blocks + 1) * INDEX_BLOCK_SIZE <= in_floor) {
+			free(m_index_blocks[m_released_index_blocks]);
+			m_index_blocks[m_released_index_blocks] = NULL;
+			++m_released_index_blocks;
+			__atomic_store_n(&m_memory_usage, m_memory_usage - INDEX_BLOCK_SIZE * sizeof(IndexEntry), __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_unlock(&m_append_mutex);
+}
+
+const char* MessageLog::frame(const size_t in_index) const {
+	const IndexEntry& found = entry(in_index);
+	void** const chunks = __atomic_load_n(&m_chunks, __ATOMIC_ACQUIRE);
+	return static_cast<const char*>(chunks[found.chunk]) + found.offset;
+}
+
+unsigned int MessageLog::frame_length(const size_t in_index) const {
+	return FRAME_HEADER_SIZE + entry(in_index).length;
+}
+
+int MessageLog::frame_file(const size_t in_index, off_t& out_offset) const {
+	// set before the log is shared, never changed after
+	if (-1 == m_index_fd) {
+		return -1;
+	}
+
+	const IndexEntry& found = entry(in_index);
+	void** const segment_fds = __atomic_load_n(&m_segment_fds, __ATOMIC_ACQUIRE);
+	out_offset = found.offset;
+	return static_cast<int>(reinterpret_cast<intptr_t>(segment_fds[found.chunk]));
+}
+
+const char* MessageLog::message(const size_t in_index) const {
+	return frame(in_index) + FRAME_HEADER_SIZE;
+}
+
+unsigned int MessageLog::message_length(const size_t in_index) const {
+	return entry(in_index).length;
+}
+
+size_t MessageLog::bytes_stored() const {
+	return __atomic_load_n(&m_bytes_stored, __ATOMIC_RELAXED);
+}
+
+size_t MessageLog::memory_usage() const {
+	return __atomic_load_n(&m_memory_usage, __ATOMIC_RELAXED);
+}
+
+int MessageLog::add_chunk(const size_t in_min_size) {
+	// an oversized message gets a chunk of its own
+	size_t capacity = m_next_chunk_size;
+	if (capacity < in_min_size) {
+		capacity = in_min_size;
+	}
+
+	if (0 != m_num_chunks) {
+		m_chunk_sealed.back() = time(NULL);
+	}
+
+	if (-1 != m_index_fd) {
+		return map_segment(m_num_chunks, capacity);
+	}
+
+	if (-1 == reserve_directory(m_chunks, m_chunks_capacity, m_num_chunks)) {
+		return -1;
+	}
+
+	char* const new_chunk = static_cast<char*>(malloc(capacity));
+	if (NULL == new_chunk) {
+		fprintf(stderr, "Failed to allocate %lu byte message chunk\n", static_cast<unsigned long>(capacity));
+		return -1;
+	}
+
+	m_chunks[m_num_chunks] = new_chunk;
+	m_chunk_sizes.push_back(capacity);
+	m_chunk_first_message.push_back(m_size);
+	m_chunk_sealed.push_back(0);
+	++m_num_chunks;
+	m_chunk_capacity = capacity;
+	m_chunk_used = 0;
+	__atomic_store_n(&m_memory_usage, m_memory_usage + capacity, __ATOMIC_RELAXED);
+
+	if (m_next_chunk_size < MAX_CHUNK_SIZE) {
+		m_next_chunk_size *= 2;
+	}
+
+	return 0;
+}
+
+int MessageLog::add_index_block(const size_t in_index) {
+	const size_t block = in_index >> INDEX_SHIFT;
+	if (block < m_num_index_blocks) {
+		return 0;
+	}
+
+	if (-1 == reserve_directory(m_index_blocks, m_index_capacity, block)) {
+		return -1;
+	}
+
+	const size_t block_bytes = INDEX_BLOCK_SIZE * sizeof(IndexEntry);
+	void* new_block = NULL;
+	if (-1 == m_index_fd) {
+		new_block = malloc(block_bytes);
+		if (NULL == new_block) {
+			fprintf(stderr, "Failed to allocate message index block\n");
+			return -1;
+		}
+	}
+	else {
+		// persistent blocks live in the reserved index mapping - just grow the file under it
+		if (block >= MAX_PERSISTENT_INDEX_BLOCKS) {
+			fprintf(stderr, "Persistent message index is full\n");
+			return -1;
+		}
+
+		const size_t block_end = sizeof(IndexFileHeader) + (block + 1) * block_bytes;
+		if (block_end > m_index_file_size) {
+			if (0 != ftruncate(m_index_fd, block_end)) {
+				fprintf(stderr, "Failed to grow message index.  Error is %s\n", strerror(errno));
+				return -1;
+			}
+			m_index_file_size = block_end;
+		}
+		new_block = m_index_map + sizeof(IndexFileHeader) + block * block_bytes;
+	}
+
+	m_index_blocks[block] = new_block;
+	++m_num_index_blocks;
+	__atomic_store_n(&m_memory_usage, m_memory_usage + block_bytes, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int MessageLog::reserve_directory(void**& in_directory, size_t& in_capacity, const size_t in_slot) {
+	if (in_slot < in_capacity) {
+		return 0;
+	}
+
+	// a reopened log may start part way into its chunk directory
+	size_t new_capacity = (0 == in_capacity) ? MIN_DIRECTORY_SIZE : in_capacity * 2;
+	while (new_capacity <= in_slot) {
+		new_capacity *= 2;
+	}
+	void** const new_directory = static_cast<void**>(calloc(new_capacity, sizeof(void*)));
+	if (NULL == new_directory) {
+		fprintf(stderr, "Failed to grow message log directory\n");
+		return -1;
+	}
+
+	if (NULL != in_directory) {
+		memcpy(new_directory, in_directory, in_capacity * sizeof(void*));
+		// a reader may still be looking at the old one
+		m_retired_directories.push_back(in_directory);
+	}
+
+	__atomic_store_n(&in_directory, new_directory, __ATOMIC_RELEASE);
+	in_capacity = new_capacity;
+	__atomic_store_n(&m_memory_usage, m_memory_usage + new_capacity * sizeof(void*), __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int MessageLog::map_segment(const size_t in_segment, const size_t in_size) {
+	const std::string path = segment_path(in_segment);
+	const int segment_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (segment_fd < 0) {
+		fprintf(stderr, "Failed to open %s.  Error is %s\n", path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	size_t size = in_size;
+	if (0 == size) {
+		struct stat segment_stat;
+		if (0 != fstat(segment_fd, &segment_stat)) {
+			fprintf(stderr, "Failed to stat %s.  Error is %s\n", path.c_str(), strerror(errno));
+			close(segment_fd);
+			return -1;
+		}
+		size = segment_stat.st_size;
+	}
+	else if (0 != ftruncate(segment_fd, size)) {
+		fprintf(stderr, "Failed to size %s.  Error is %s\n", path.c_str(), strerror(errno));
+		close(segment_fd);
+		return -1;
+	}
+
+	if (0 == size || -1 == reserve_directory(m_chunks, m_chunks_capacity, m_num_chunks) ||
+	    -1 == reserve_directory(m_segment_fds, m_segment_fds_capacity, m_num_chunks)) {
+		close(segment_fd);
+		return -1;
+	}
+
+	// the descriptor stays open too, for readers that send frames with sendfile()
+	void* const segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+	if (MAP_FAILED == segment) {
+		fprintf(stderr, "Failed to map %s.  Error is %s\n", path.c_str(), strerror(errno));
+		close(segment_fd);
+		return -1;
+	}
+
+	m_chunks[m_num_chunks] = segment;
+	m_segment_fds[m_num_chunks] = reinterpret_cast<void*>(static_cast<intptr_t>(segment_fd));
+	m_chunk_sizes.push_back(size);
+	m_chunk_first_message.push_back(m_size);
+	m_chunk_sealed.push_back(0);
+	++m_num_chunks;
+	m_chunk_capacity = size;
+	m_chunk_used = 0;
+	__atomic_store_n(&m_memory_usage, m_memory_usage + size, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void MessageLog::release_chunk(const size_t in_chunk) {
+	if (-1 == m_index_fd) {
+		free(m_chunks[in_chunk]);
+	}
+	else {
+		munmap(m_chunks[in_chunk], m_chunk_sizes[in_chunk]);
+		close(static_cast<int>(reinterpret_cast<intptr_t>(m_segment_fds[in_chunk])));
+		unlink(segment_path(in_chunk).c_str());
+	}
+
+	m_chunks[in_chunk] = NULL;
+	__atomic_store_n(&m_memory_usage, m_memory_usage - m_chunk_sizes[in_chunk], __ATOMIC_RELAXED);
+}
+
+std::string MessageLog::segment_path(const size_t in_segment) const {
+	char name[32];
+	sprintf(name, "/segment.%06lu", static_cast<unsigned long>(in_segment));
+	return m_directory + name;
+}
+
+bool MessageLog::entry_is_valid(const size_t in_index) const {
+	if (in_index >> INDEX_SHIFT >= m_num_index_blocks) {
+		return false;
+	}
+
+	const IndexEntry& found = entry(in_index);
+	if (found.chunk < m_released_chunks || found.chunk >= m_num_chunks || static_cast<size_t>(found.offset) + FRAME_HEADER_SIZE + found.length > m_chunk_sizes[found.chunk]) {
+		return false;
+	}
+
+	FrameHeader header;
+	if (-1 == util_decode_frame_header(static_cast<const char*>(m_chunks[found.chunk]) + found.offset, header)) {
+		return false;
+	}
+
+	return OP_SERVER_MESSAGE == header.opcode && found.length == header.length;
+}
+
+const MessageLog::IndexEntry& MessageLog::entry(const size_t in_index) const {
+	void** const blocks = __atomic_load_n(&m_index_blocks, __ATOMIC_ACQUIRE);
+	return static_cast<const IndexEntry*>(blocks[in_index >> INDEX_SHIFT])[in_index & (INDEX_BLOCK_SIZE - 1)];
+}
@@ -0,0 +1,396 @@
+#ifndef __CSCI_5273_MESSAGE_LOG_H
+#define __CSCI_5273_MESSAGE_LOG_H
+
+/**
+ * @file message_log.h
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief Append-only chat history shared by the session server threads
+ */
+
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+
+/**
+  * Append-only chat history with bounded retention.
+  *
+  * Each message is stored as a ready to send OP_SERVER_MESSAGE frame in large arena
+  * chunks, so consecutive messages are usually adjacent in memory and can go out in
+  * one write.  A compact index records where each frame lives.
+  *
+  * Chunks and index blocks never move once allocated, so any number of threads can
+  * read while one thread at a time appends.  Readers never lock: they load the
+  * published size and only touch entries below it.
+  *
+  * By default the log lives on the heap.  After open() it is persistent instead:
+  * every chunk is a memory-mapped segment file and the index is a memory-mapped
+  * index file, so reopening the same directory makes the whole history available
+  * again without reading it.  Segment files stay open so stored frames can also be
+  * sent straight from the file with sendfile().
+  *
+  * Old history is dropped a whole chunk at a time, in two steps.  trim() moves
+  * first_index() past the chunks that fall outside the retention limits; message
+  * indices never change, so every position at or above it stays valid.  compact()
+  * later frees the trimmed chunks (and deletes their segment files) once the caller
+  * knows no reader is still looking at them.
+  */
+class MessageLog {
+public:
+	/**
+	  * Creates an empty message log.
+	  *
+	  * @pre none
+	  * @post The log is empty
+	  */
+	MessageLog();
+
+	/**
+	  * Frees every chunk in the log.
+	  *
+	  * @pre No other thread is using the log
+	  * @post All memory has been released
+	  */
+	~MessageLog();
+
+	/**
+	  * Makes the log persistent, reopening any history already in in_directory.
+	  * Only the last index entry is checked, so this takes the same time no matter
+	  * how much history there is.
+	  *
+	  * @pre The log is empty and no other thread is using it
+	  * @post The log holds the history stored in in_directory and appends go there
+	  * @param in_directory Directory holding this log's segment and index files.  Created if missing.
+	  * @return 0 if successful; -1 if error.
+	  */
+	int open(const std::string& in_directory);
+
+	/**
+	  * Appends a message to the end of the log.  Safe to call from any thread.
+	  *
+	  * @pre in_buf points to at least in_buf_len bytes
+	  * @post The message is visible to readers
+	  * @param in_buf Message body
+	  * @param in_buf_len Length of the message body
+	  * @return Index of the new message if successful; -1 if error.
+	  */
+	int append(const char* const in_buf,
+	           const size_t in_buf_len);
+
+	/**
+	  * Number of messages that readers may access.  Safe to call from any thread.
+	  *
+	  * @pre none
+	  * @post none
+	  * @return Number of published messages
+	  */
+	size_t size() const;
+
+	/**
+	  * Index of the oldest message still kept.  Messages below it have been trimmed
+	  * and must not be read.  Safe to call from any thread.
+	  *
+	  * @pre none
+	  * @post none
+	  * @return Index of the oldest kept message; size() if the log is empty or everything was trimmed
+	  */
+	size_t first_index() const;
+
+	/**
+	  * Trims the oldest chunks that hold nothing the retention limits keep.  The
+	  * chunk being appended to is always kept.  Memory is only released by compact().
+	  *
+	  * @pre Only one thread trims and compacts
+	  * @post first_index() is past every trimmed message
+	  * @param in_max_messages Trim a chunk once all its messages are older than the newest in_max_messages.  0 for no limit.
+	  * @param in_max_bytes Trim the oldest chunks while the chunks kept take more than in_max_bytes.  0 for no limit.
+	  * @param in_max_age Trim a chunk once its last message is more than in_max_age seconds old.  0 for no limit.
+	  * @return Number of messages trimmed
+	  */
+	size_t trim(const size_t in_max_messages,
+	            const size_t in_max_bytes,
+	            const time_t in_max_age);
+
+	/**
+	  * Releases the trimmed chunks and index blocks that hold no message at or above
+	  * in_floor.  A persistent log deletes their segment files.
+	  *
+	  * @pre in_floor <= first_index() and no reader will touch a message below in_floor
+	  * @post Their memory has been released
+	  * @param in_floor Lowest message index any reader may still use
+	  */
+	void compact(const size_t in_floor);
+
+	/**
+	  * Retrieves the encoded frame for a published message.  Safe to call from any thread.
+	  *
+	  * @pre in_index < size()
+	  * @post none
+	  * @param in_index Index of the message to retrieve
+	  * @return Pointer to frame_length(in_index) bytes
+	  */
+	const char* frame(const size_t in_index) const;
+
+	/**
+	  * Size of the encoded frame for a published message, header included.
+	  *
+	  * @pre in_index < size()
+	  * @post none
+	  * @param in_index Index of the message
+	  * @return Frame length in bytes
+	  */
+	unsigned int frame_length(const size_t in_index) const;
+
+	/**
+	  * Locates the encoded frame for a published message in its segment file.  Frames
+	  * stored one after another in the same segment are adjacent in the file.  Safe to
+	  * call from any thread.
+	  *
+	  * @pre in_index < size()
+	  * @post none
+	  * @param in_index Index of the message
+	  * @param out_offset Set to the offset of the frame in the segment file
+	  * @return Descriptor of the segment file, owned by the log; -1 for a heap-only log
+	  */
+	int frame_file(const size_t in_index,
+	               off_t& out_offset) const;
+
+	/**
+	  * Retrieves the text of a published message.  Safe to call from any thread.
+	  *
+	  * @pre in_index < size()
+	  * @post none
+	  * @param in_index Index of the message to retrieve
+	  * @return Pointer to message_length(in_index) bytes
+	  */
+	const char* message(const size_t in_index) const;
+
+	/**
+	  * Length of the text of a published message.
+	  *
+	  * @pre in_index < size()
+	  * @post none
+	  * @param in_index Index of the message
+	  * @return Message length in bytes
+	  */
+	unsigned int message_length(const size_t in_index) const;
+
+	/**
+	  * Total length of the message text stored in the log.
+	  *
+	  * @pre none
+	  * @post none
+	  * @return Number of bytes of message text
+	  */
+	size_t bytes_stored() const;
+
+	/**
+	  * Exact number of bytes the log has allocated or mapped: chunks, index blocks
+	  * and directories.
+	  *
+	  * @pre none
+	  * @post none
+	  * @return Number of bytes allocated or mapped
+	  */
+	size_t memory_usage() const;
+
+private:
+	/** Size of the first arena chunk.  Each new chunk doubles until MAX_CHUNK_SIZE. */
+	static const size_t MIN_CHUNK_SIZE = 4 * 1024;
+	/** Largest arena chunk we allocate for ordinary messages */
+	static const size_t MAX_CHUNK_SIZE = 1024 * 1024;
+	/** log2 of the number of entries per index block */
+	static const size_t INDEX_SHIFT = 10;
+	/** Number of entries per index block */
+	static const size_t INDEX_BLOCK_SIZE = 1 << INDEX_SHIFT;
+	/** Initial number of slots in the chunk and index directories */
+	static const size_t MIN_DIRECTORY_SIZE = 16;
+	/** Most index blocks a persistent log can hold - the index file mapping is reserved up front */
+	static const size_t MAX_PERSISTENT_INDEX_BLOCKS = 1 << 16;
+
+	/** Start of the index file.  Entries follow immediately. */
+	struct IndexFileHeader {
+		/** INDEX_FILE_MAGIC */
+		char magic[8];
+		/** Number of published messages.  Written after the entry it covers. */
+		uint64_t size;
+		/** Bytes of message text stored */
+		uint64_t bytes_stored;
+		/** Index of the oldest kept message.  0 in files written before trimming existed. */
+		uint64_t first;
+		/** Oldest segment still kept - the ones below it have been or are about to be deleted */
+		uint64_t first_chunk;
+		/** Unused - keeps the entries 8 byte aligned in their own cache line */
+		char reserved[24];
+	};
+
+	/** Location of one stored frame */
+	struct IndexEntry {
+		/** Chunk holding the frame */
+		unsigned int chunk;
+		/** Offset of the frame header within the chunk */
+		unsigned int offset;
+		/** Length of the message text */
+		unsigned int length;
+	};
+
+	/* not copyable */
+	MessageLog(const MessageLog&);
+	MessageLog& operator=(const MessageLog&);
+
+	/**
+	  * Starts a new arena chunk big enough for in_min_size bytes.
+	  *
+	  * @pre m_append_mutex is held
+	  * @post The new chunk is the current chunk
+	  * @param in_min_size Size of the frame that did not fit in the current chunk
+	  * @return 0 if successful; -1 if out of memory
+	  */
+	int add_chunk(const size_t in_min_size);
+
+	/**
+	  * Maps one segment file and adds it to the chunk directory.
+	  *
+	  * @pre m_append_mutex is held or the log is not shared yet
+	  * @post The segment is the current chunk
+	  * @param in_segment Segment number
+	  * @param in_size Size to make the segment file.  0 to map an existing file as is.
+	  * @return 0 if successful; -1 if error
+	  */
+	int map_segment(const size_t in_segment,
+	                const size_t in_size);
+
+	/**
+	  * Name of a segment file.
+	  *
+	  * @pre open() has been called
+	  * @post none
+	  * @param in_segment Segment number
+	  * @return Path to the segment file
+	  */
+	std::string segment_path(const size_t in_segment) const;
+
+	/**
+	  * Checks that an index entry recovered from disk points at a valid frame.
+	  *
+	  * @pre in_index is below the size recorded in the index file
+	  * @post none
+	  * @param in_index Index of the message
+	  * @return true if the entry and its frame are intact
+	  */
+	bool entry_is_valid(const size_t in_index) const;
+
+	/**
+	  * Allocates the index block for in_index if it does not exist yet.
+	  *
+	  * @pre m_append_mutex is held
+	  * @post The index block for in_index exists
+	  * @param in_index Index of the message being appended
+	  * @return 0 if successful; -1 if out of memory
+	  */
+	int add_index_block(const size_t in_index);
+
+	/**
+	  * Releases one chunk: frees it, or unmaps, closes and deletes its segment file.
+	  *
+	  * @pre m_append_mutex is held and no reader uses the chunk
+	  * @post The chunk's slot is empty
+	  * @param in_chunk Chunk to release
+	  */
+	void release_chunk(const size_t in_chunk);
+
+	/**
+	  * Makes sure a directory has a slot for in_slot, doubling it if needed.
+	  * The old directory stays allocated so readers holding it remain valid.
+	  *
+	  * @pre m_append_mutex is held
+	  * @post in_directory has at least in_slot + 1 slots
+	  * @param in_directory Directory to grow.  Published with a release store.
+	  * @param in_capacity Number of slots in in_directory
+	  * @param in_slot Slot the caller is about to fill
+	  * @return 0 if successful; -1 if out of memory
+	  */
+	int reserve_directory(void**& in_directory,
+	                      size_t& in_capacity,
+	                      const size_t in_slot);
+
+	/**
+	  * Looks up the index entry for a published message.
+	  *
+	  * @pre in_index < size()
+	  * @post none
+	  * @param in_index Index of the message
+	  * @return The index entry
+	  */
+	const IndexEntry& entry(const size_t in_index) const;
+
+	/** Serializes writers; readers never take it */
+	pthread_mutex_t m_append_mutex;
+	/** Number of published messages.  Written with release, read with acquire. */
+	size_t m_size;
+	/** Index of the oldest kept message.  Written with release, read with acquire. */
+	size_t m_first;
+	/** Bytes of message text stored */
+	size_t m_bytes_stored;
+	/** Bytes allocated for chunks, index blocks and directories */
+	size_t m_memory_usage;
+
+	/** Chunk directory (char* per slot).  Slots below m_num_chunks never change. */
+	void** m_chunks;
+	/** Number of slots in m_chunks */
+	size_t m_chunks_capacity;
+	/** Number of chunks allocated */
+	size_t m_num_chunks;
+	/** Capacity of the current chunk */
+	size_t m_chunk_capacity;
+	/** Bytes used in the current chunk */
+	size_t m_chunk_used;
+	/** Capacity to use for the next chunk */
+	size_t m_next_chunk_size;
+	/** Size of every chunk, by chunk number */
+	std::vector<size_t> m_chunk_sizes;
+	/** Index of the first message stored in each chunk */
+	std::vector<size_t> m_chunk_first_message;
+	/** When each chunk stopped taking messages.  0 for the current chunk. */
+	std::vector<time_t> m_chunk_sealed;
+	/** Oldest chunk not trimmed */
+	size_t m_first_chunk;
+	/** Chunks below this one have been released */
+	size_t m_released_chunks;
+	/** Index blocks below this one have been released */
+	size_t m_released_index_blocks;
+
+	/** Index block directory (IndexEntry* per slot).  Existing blocks never move. */
+	void** m_index_blocks;
+	/** Number of slots in m_index_blocks */
+	size_t m_index_capacity;
+	/** Number of index blocks allocated */
+	size_t m_num_index_blocks;
+
+	/** Directories that have been replaced.  Freed with the log. */
+	std::vector<void**> m_retired_directories;
+
+	/** Directory holding the segment and index files.  Empty for a heap-only log. */
+	std::string m_directory;
+	/** Open (and locked) index file.  -1 for a heap-only log. */
+	int m_index_fd;
+	/** Mapping of the whole index file reservation */
+	char* m_index_map;
+	/** Current size of the index file */
+	size_t m_index_file_size;
+	/** Header at the start of m_index_map */
+	IndexFileHeader* m_index_header;
+	/** Segment file descriptor directory (an int cast to void* per slot), parallel to m_chunks */
+	void** m_segment_fds;
+	/** Number of slots in m_segment_fds */
+	size_t m_segment_fds_capacity;
+};
+
+#endif /* __CSCI_5273_MESSAGE_LOG_H */
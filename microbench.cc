@@ -0,0 +1,573 @@
+/**
+ * @file microbench.cc
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief Microbenchmarks for the socket utility primitives
+ *
+ * Every primitive is timed over loopback and over a socketpair for a range of payload
+ * sizes.  Besides ns/op, each result reports the socket calls and heap allocations it
+ * made per op:
+ *
+ * - socket calls are counted by linking with ld's --wrap for send(), recv(), sendto(),
+ *   recvfrom(), sendmsg() and recvmsg(), so only calls made from socket_utils.o (and
+ *   this file) are seen - the file and DNS I/O getaddrinfo() does inside libc on a
+ *   resolver cache miss is not.
+ * - allocations are counted by replacing malloc(), calloc() and realloc() with versions
+ *   that forward to glibc's own allocator, so every allocation in the process is seen.
+ *
+ * Results are printed one per line as key=value pairs.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "socket_utils.h"
+
+using std::string;
+using std::vector;
+
+/** Time spent on each benchmark unless -t is given.  Value is in milliseconds. */
+const int DEFAULT_CASE_TIME = 200;
+/** Payload sizes every send / receive primitive is run with */
+const int PAYLOAD_SIZES[] = { 16, 256, 4096, 32768 };
+/** Number of entries in PAYLOAD_SIZES */
+const int NUM_PAYLOAD_SIZES = sizeof(PAYLOAD_SIZES) / sizeof(PAYLOAD_SIZES[0]);
+/** Payload size that stands for the int overloads */
+const int INT_PAYLOAD = 0;
+/** Most bytes queued in a socket before the other end drains them */
+const int MAX_QUEUED_BYTES = 64 * 1024;
+/** Most messages queued in a socket before the other end drains them */
+const int MAX_QUEUED_MESSAGES = 64;
+
+/** Socket calls made since the program started */
+static unsigned long g_syscalls = 0;
+/** Heap allocations made since the program started */
+static unsigned long g_allocations = 0;
+
+extern "C" {
+
+ssize_t __real_send(int, const void*, size_t, int);
+ssize_t __real_recv(int, void*, size_t, int);
+ssize_t __real_sendto(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
+ssize_t __real_recvfrom(int, void*, size_t, int, struct sockaddr*, socklen_t*);
+ssize_t __real_sendmsg(int, const struct msghdr*, int);
+ssize_t __real_recvmsg(int, struct msghdr*, int);
+
+ssize_t __wrap_send(int in_socket, const void* in_buf, size_t in_len, int in_flags) {
+	++g_syscalls;
+	return __real_send(in_socket, in_buf, in_len, in_flags);
+}
+
+ssize_t __wrap_recv(int in_socket, void* in_buf, size_t in_len, int in_flags) {
+	++g_syscalls;
+	return __real_recv(in_socket, in_buf, in_len, in_flags);
+}
+
+ssize_t __wrap_sendto(int in_socket, const void* in_buf, size_t in_len, int in_flags, const struct sockaddr* in_to, socklen_t in_to_len) {
+	++g_syscalls;
+	return __real_sendto(in_socket, in_buf, in_len, in_flags, in_to, in_to_len);
+}
+
+ssize_t __wrap_recvfrom(int in_socket, void* in_buf, size_t in_len, int in_flags, struct sockaddr* in_from, socklen_t* in_from_len) {
+	++g_syscalls;
+	return __real_recvfrom(in_socket, in_buf, in_len, in_flags, in_from, in_from_len);
+}
+
+ssize_t __wrap_sendmsg(int in_socket, const struct msghdr* in_msg, int in_flags) {
+	++g_syscalls;
+	return __real_sendmsg(in_socket, in_msg, in_flags);
+}
+
+ssize_t __wrap_recvmsg(int in_socket, struct msghdr* in_msg, int in_flags) {
+	++g_syscalls;
+	return __real_recvmsg(in_socket, in_msg, in_flags);
+}
+
+// glibc's allocator under its own names - the replacements below forward to it
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void __libc_free(void*);
+
+void* malloc(size_t in_size) throw() {
+	++g_allocations;
+	return __libc_malloc(in_size);
+}
+
+void* calloc(size_t in_count, size_t in_size) throw() {
+	++g_allocations;
+	return __libc_calloc(in_count, in_size);
+}
+
+void* realloc(void* in_ptr, size_t in_size) throw() {
+	++g_allocations;
+	return __libc_realloc(in_ptr, in_size);
+}
+
+void free(void* in_ptr) throw() {
+	__libc_free(in_ptr);
+}
+
+}
+
+/**
+  * Totals for one primitive.
+  */
+struct Measurement {
+	Measurement() :
+		ops(0),
+		ns(0),
+		syscalls(0),
+		allocations(0) {
+	}
+
+	/** Number of calls timed */
+	unsigned long ops;
+	/** Time spent in them */
+	uint64_t ns;
+	/** Socket calls they made */
+	unsigned long syscalls;
+	/** Heap allocations they made */
+	unsigned long allocations;
+};
+
+/**
+  * Counters at the start of a timed batch.
+  */
+struct Sample {
+	Sample() :
+		ns(0),
+		syscalls(0),
+		allocations(0) {
+	}
+
+	/** Monotonic clock */
+	uint64_t ns;
+	/** g_syscalls */
+	unsigned long syscalls;
+	/** g_allocations */
+	unsigned long allocations;
+};
+
+
+/* function declarations */
+void bench_stream(const char* const, const int, const int, const int, const int);
+void bench_datagram(const char* const, const int, const int, const struct sockaddr*, const int, const int);
+void bench_sockaddr(const char* const, const bool, const int);
+int connect_loopback_tcp(int&, int&);
+int receive_stream(const int, char* const, const int);
+void start_sample(Sample&);
+void end_sample(const Sample&, const unsigned long, Measurement&);
+void print_measurement(const char* const, const char* const, const int, const Measurement&);
+uint64_t now_ns();
+
+/**
+  * Main - entry point of program
+  *
+  * @param argc Number of command line arguments
+  * @param argv Command line arguments
+  * @return 0 if success; any other value if error
+  */
+int main(const int argc, char** const argv) {
+	int case_time = DEFAULT_CASE_TIME;
+
+	int option;
+	while (-1 != (option = getopt(argc, argv, "t:"))) {
+		switch (option) {
+			case 't':
+				case_time = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: microbench.exe [-t milliseconds per benchmark]\n");
+				exit(1);
+		}
+	}
+
+	if (case_time < 1) {
+		fprintf(stderr, "milliseconds per benchmark must be at least 1\n");
+		exit(1);
+	}
+
+	// TCP
+	int stream_pair[2];
+	if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, stream_pair)) {
+		fprintf(stderr, "Failed to create stream socketpair.  Error is %s\n", strerror(errno));
+		exit(1);
+	}
+
+	int tcp_client;
+	int tcp_server;
+	if (-1 == connect_loopback_tcp(tcp_client, tcp_server)) {
+		exit(1);
+	}
+
+	bench_stream("socketpair", stream_pair[0], stream_pair[1], INT_PAYLOAD, case_time);
+	bench_stream("loopback", tcp_client, tcp_server, INT_PAYLOAD, case_time);
+	for (int i = 0; i < NUM_PAYLOAD_SIZES; ++i) {
+		bench_stream("socketpair", stream_pair[0], stream_pair[1], PAYLOAD_SIZES[i], case_time);
+		bench_stream("loopback", tcp_client, tcp_server, PAYLOAD_SIZES[i], case_time);
+	}
+
+	close(stream_pair[0]);
+	close(stream_pair[1]);
+	close(tcp_client);
+	close(tcp_server);
+
+	// UDP
+	int datagram_pair[2];
+	if (0 != socketpair(AF_UNIX, SOCK_DGRAM, 0, datagram_pair)) {
+		fprintf(stderr, "Failed to create datagram socketpair.  Error is %s\n", strerror(errno));
+		exit(1);
+	}
+
+	const int udp_sender = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, "127.0.0.1", 0);
+	const int udp_receiver = util_create_server_socket(SOCK_DGRAM, IPPROTO_UDP, "127.0.0.1", 0);
+	struct sockaddr_in receiver_addr;
+	if (-1 == udp_sender || -1 == udp_receiver ||
+	    -1 == util_create_sockaddr("127.0.0.1", util_get_port_number(udp_receiver), &receiver_addr)) {
+		exit(1);
+	}
+
+	// the socketpair is connected - no destination address
+	bench_datagram("socketpair", datagram_pair[0], datagram_pair[1], NULL, INT_PAYLOAD, case_time);
+	bench_datagram("loopback", udp_sender, udp_receiver, (const struct sockaddr*)&receiver_addr, INT_PAYLOAD, case_time);
+	for (int i = 0; i < NUM_PAYLOAD_SIZES; ++i) {
+		bench_datagram("socketpair", datagram_pair[0], datagram_pair[1], NULL, PAYLOAD_SIZES[i], case_time);
+		bench_datagram("loopback", udp_sender, udp_receiver, (const struct sockaddr*)&receiver_addr, PAYLOAD_SIZES[i], case_time);
+	}
+
+	close(datagram_pair[0]);
+	close(datagram_pair[1]);
+	close(udp_sender);
+	close(udp_receiver);
+
+	// name resolution
+	bench_sockaddr(NULL, true, case_time);
+	bench_sockaddr("127.0.0.1", true, case_time);
+	bench_sockaddr("localhost", true, case_time);
+	bench_sockaddr("localhost", false, case_time);
+
+	return 0;
+}
+
+/**
+  * Times util_send_tcp() and util_recv_tcp() on a connected stream.  Each batch
+  * queues as many messages as the socket holds, then drains them.
+  *
+  * @pre in_sender and in_receiver are the two ends of one stream connection
+  * @post Everything sent has been received
+  * @param in_transport Name of the transport for the report
+  * @param in_sender Socket to send on
+  * @param in_receiver Socket to receive on
+  * @param in_size Payload size.  INT_PAYLOAD for the int overloads.
+  * @param in_case_time Milliseconds to spend
+  */
+void bench_stream(const char* const in_transport,
+                  const int in_sender,
+                  const int in_receiver,
+                  const int in_size,
+                  const int in_case_time) {
+	const int message_size = (INT_PAYLOAD == in_size) ? static_cast<int>(sizeof(int)) : in_size;
+	int batch = MAX_QUEUED_BYTES / message_size;
+	if (batch > MAX_QUEUED_MESSAGES) {
+		batch = MAX_QUEUED_MESSAGES;
+	}
+
+	const vector<char> payload(message_size, 'x');
+	vector<char> received(message_size + 1);
+
+	Measurement sent;
+	Measurement recvd;
+	const uint64_t deadline = now_ns() + static_cast<uint64_t>(in_case_time) * 1000000;
+	// the first round only warms up
+	for (bool warm = false; now_ns() < deadline; warm = true) {
+		Sample sample;
+		start_sample(sample);
+		for (int i = 0; i < batch; ++i) {
+			const int status = (INT_PAYLOAD == in_size) ? util_send_tcp(in_sender, i) : util_send_tcp(in_sender, &payload[0], in_size);
+			if (-1 == status) {
+				exit(1);
+			}
+		}
+		if (warm) {
+			end_sample(sample, batch, sent);
+		}
+
+		start_sample(sample);
+		for (int i = 0; i < batch; ++i) {
+			int value;
+			const int status = (INT_PAYLOAD == in_size) ? util_recv_tcp(in_receiver, value) : receive_stream(in_receiver, &received[0], in_size);
+			if (-1 == status) {
+				exit(1);
+			}
+		}
+		if (warm) {
+			end_sample(sample, batch, recvd);
+		}
+	}
+
+	print_measurement("util_send_tcp", in_transport, in_size, sent);
+	print_measurement("util_recv_tcp", in_transport, in_size, recvd);
+}
+
+/**
+  * Times util_send_udp() and util_recv_udp().  Each batch queues as many datagrams
+  * as the receiver holds, then drains them.
+  *
+  * @pre Datagrams sent on in_sender to in_to arrive at in_receiver
+  * @post Everything sent has been received
+  * @param in_transport Name of the transport for the report
+  * @param in_sender Socket to send on
+  * @param in_receiver Socket to receive on
+  * @param in_to Address of in_receiver.  NULL if in_sender is connected.
+  * @param in_size Payload size.  INT_PAYLOAD for the int overloads.
+  * @param in_case_time Milliseconds to spend
+  */
+void bench_datagram(const char* const in_transport,
+                    const int in_sender,
+                    const int in_receiver,
+                    const struct sockaddr* in_to,
+                    const int in_size,
+                    const int in_case_time) {
+	const int message_size = (INT_PAYLOAD == in_size) ? static_cast<int>(sizeof(int)) : in_size;
+	// the receive buffer is charged for each datagram's bookkeeping as well as its bytes
+	int batch = MAX_QUEUED_BYTES / (message_size + 512);
+	if (batch < 1) {
+		batch = 1;
+	}
+	else if (batch > MAX_QUEUED_MESSAGES) {
+		batch = MAX_QUEUED_MESSAGES;
+	}
+
+	const vector<char> payload(message_size, 'x');
+	vector<char> received(message_size + 1);
+
+	Measurement sent;
+	Measurement recvd;
+	const uint64_t deadline = now_ns() + static_cast<uint64_t>(in_case_time) * 1000000;
+	for (bool warm = false; now_ns() < deadline; warm = true) {
+		Sample sample;
+		start_sample(sample);
+		for (int i = 0; i < batch; ++i) {
+			const int status = (INT_PAYLOAD == in_size) ? util_send_udp(in_sender, i, in_to) : util_send_udp(in_sender, &payload[0], in_size, in_to);
+			if (-1 == status) {
+				exit(1);
+			}
+		}
+		if (warm) {
+			end_sample(sample, batch, sent);
+		}
+
+		start_sample(sample);
+		for (int i = 0; i < batch; ++i) {
+			struct sockaddr_in from;
+			int value;
+			const int status = (INT_PAYLOAD == in_size) ?
+				util_recv_udp(in_receiver, value, (struct sockaddr*)&from, sizeof(from)) :
+				util_recv_udp(in_receiver, &received[0], received.size(), (struct sockaddr*)&from, sizeof(from));
+			if (-1 == status) {
+				exit(1);
+			}
+		}
+		if (warm) {
+			end_sample(sample, batch, recvd);
+		}
+	}
+
+	print_measurement("util_send_udp", in_transport, in_size, sent);
+	print_measurement("util_recv_udp", in_transport, in_size, recvd);
+}
+
+/**
+  * Times util_create_sockaddr().
+  *
+  * @pre none
+  * @post The resolver TTLs are back to their defaults
+  * @param in_host Host to resolve.  NULL for any address.
+  * @param in_cached Whether lookups may be answered from the resolver cache
+  * @param in_case_time Milliseconds to spend
+  */
+void bench_sockaddr(const char* const in_host,
+                    const bool in_cached,
+                    const int in_case_time) {
+	const int batch = 64;
+
+	// a zero TTL makes every call a full getaddrinfo() lookup
+	if (!in_cached) {
+		util_resolver_set_ttl(0, 0);
+	}
+
+	Measurement resolved;
+	const uint64_t deadline = now_ns() + static_cast<uint64_t>(in_case_time) * 1000000;
+	for (bool warm = false; now_ns() < deadline; warm = true) {
+		Sample sample;
+		start_sample(sample);
+		for (int i = 0; i < batch; ++i) {
+			struct sockaddr_in sin;
+			if (-1 == util_create_sockaddr(in_host, 0, &sin)) {
+				exit(1);
+			}
+		}
+		if (warm) {
+			end_sample(sample, batch, resolved);
+		}
+	}
+
+	util_resolver_set_ttl(DEFAULT_RESOLVER_TTL, DEFAULT_RESOLVER_NEGATIVE_TTL);
+
+	string host = (NULL == in_host) ? "any" : in_host;
+	if (NULL != in_host) {
+		host += in_cached ? " cache=hit" : " cache=miss";
+	}
+	print_measurement("util_create_sockaddr", host.c_str(), -1, resolved);
+}
+
+/**
+  * Creates a TCP connection to ourselves over loopback.
+  *
+  * @pre none
+  * @post Both ends are connected with Nagle's algorithm off if successful
+  * @param out_client Connecting end
+  * @param out_server Accepted end
+  * @return 0 if successful; -1 if error
+  */
+int connect_loopback_tcp(int& out_client,
+                         int& out_server) {
+	const int listen_socket = util_create_server_socket(SOCK_STREAM, IPPROTO_TCP, "127.0.0.1", 0);
+	if (-1 == listen_socket || -1 == util_listen(listen_socket)) {
+		return -1;
+	}
+
+	out_client = util_create_client_socket(SOCK_STREAM, IPPROTO_TCP, "127.0.0.1", util_get_port_number(listen_socket));
+	if (-1 == out_client) {
+		close(listen_socket);
+		return -1;
+	}
+
+	out_server = accept(listen_socket, NULL, NULL);
+	close(listen_socket);
+	if (out_server < 0) {
+		fprintf(stderr, "Failed to accept loopback connection.  Error is %s\n", strerror(errno));
+		return -1;
+	}
+
+	// a batch of small sends must not sit waiting for an ACK
+	const int enable = 1;
+	setsockopt(out_client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	setsockopt(out_server, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+	return 0;
+}
+
+/**
+  * Receives exactly one message from a stream with util_recv_tcp().  A large message
+  * may take more than one call.
+  *
+  * @pre in_buf has room for in_size + 1 bytes
+  * @post in_buf holds the message
+  * @param in_socket Socket to receive on
+  * @param in_buf Buffer for the message
+  * @param in_size Size of the message
+  * @return 0 if successful; -1 if error
+  */
+int receive_stream(const int in_socket,
+                   char* const in_buf,
+                   const int in_size) {
+	int received = 0;
+	while (received < in_size) {
+		const int num_bytes = util_recv_tcp(in_socket, in_buf + received, in_size - received + 1);
+		if (num_bytes <= 0) {
+			return -1;
+		}
+		received += num_bytes;
+	}
+
+	return 0;
+}
+
+/**
+  * Records the counters at the start of a timed batch.
+  *
+  * @pre none
+  * @post out_sample holds the current counters
+  * @param out_sample Where to record them
+  */
+void start_sample(Sample& out_sample) {
+	out_sample.syscalls = g_syscalls;
+	out_sample.allocations = g_allocations;
+	out_sample.ns = now_ns();
+}
+
+/**
+  * Adds a finished batch to a primitive's totals.
+  *
+  * @pre in_sample was recorded with start_sample() before the batch ran
+  * @post in_measurement includes the batch
+  * @param in_sample Counters at the start of the batch
+  * @param in_ops Number of calls in the batch
+  * @param in_measurement Totals to add to
+  */
+void end_sample(const Sample& in_sample,
+                const unsigned long in_ops,
+                Measurement& in_measurement) {
+	const uint64_t end = now_ns();
+	in_measurement.ops += in_ops;
+	in_measurement.ns += end - in_sample.ns;
+	in_measurement.syscalls += g_syscalls - in_sample.syscalls;
+	in_measurement.allocations += g_allocations - in_sample.allocations;
+}
+
+/**
+  * Prints one result as a line of key=value pairs.
+  *
+  * @pre none
+  * @post none
+  * @param in_primitive Function that was timed
+  * @param in_target Transport, or host for util_create_sockaddr()
+  * @param in_size Payload size.  INT_PAYLOAD for the int overloads; -1 if there is no payload.
+  * @param in_measurement Totals for the primitive
+  */
+void print_measurement(const char* const in_primitive,
+                       const char* const in_target,
+                       const int in_size,
+                       const Measurement& in_measurement) {
+	const double ops = (0 == in_measurement.ops) ? 1 : static_cast<double>(in_measurement.ops);
+
+	if (-1 == in_size) {
+		printf("primitive=%s host=%s", in_primitive, in_target);
+	}
+	else if (INT_PAYLOAD == in_size) {
+		printf("primitive=%s transport=%s payload=int", in_primitive, in_target);
+	}
+	else {
+		printf("primitive=%s transport=%s payload=%d", in_primitive, in_target, in_size);
+	}
+
+	printf(" ops=%lu ns_per_op=%.1f syscalls_per_op=%.2f allocs_per_op=%.2f\n",
+	       in_measurement.ops, in_measurement.ns / ops, in_measurement.syscalls / ops, in_measurement.allocations / ops);
+	fflush(stdout);
+}
+
+/**
+  * Reads the monotonic clock.
+  *
+  * @pre none
+  * @post none
+  * @return Current time in nanoseconds
+  */
+uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
@@ -10,30 +10,207 @@
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
 
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-int util_create_server_socket(const int in_socket_type, const int in_protocol, const char* const in_host, const int in_port)
+#include "trace.h"
+
+/**
+  * An address a host name resolved to, or a remembered failure.
+  */
+struct ResolvedAddress {
+	ResolvedAddress() :
+		addr(),
+		addr_len(0),
+		error(0),
+		expires(0) {
+	}
+
+	/** The address with port 0.  Unused for a failure. */
+	struct sockaddr_storage addr;
+	/** Length of addr.  0 for a failure. */
+	socklen_t addr_len;
+	/** getaddrinfo() error code of a failure, so a cached one is reported the same way */
+	int error;
+	/** CLOCK_MONOTONIC second the entry stops being used.  0 for hosts file entries. */
+	time_t expires;
+};
+
+/** Guards everything below */
+static pthread_mutex_t g_resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Cached lookups by address family and host name.  Holds at most RESOLVER_CACHE_SIZE entries. */
+static std::map<std::pair<int, std::string>, ResolvedAddress> g_resolver_cache;
+/** Hosts file entries and util_resolver_add_host() overrides by host name */
+static std::map<std::string, ResolvedAddress> g_resolver_hosts;
+/** Seconds a resolved name is cached */
+static int g_resolver_ttl = DEFAULT_RESOLVER_TTL;
+/** Seconds a failed lookup is cached */
+static int g_resolver_negative_ttl = DEFAULT_RESOLVER_NEGATIVE_TTL;
+/** Loads the CHAT_HOSTS_FILE hosts file on the first lookup */
+static pthread_once_t g_resolver_hosts_once = PTHREAD_ONCE_INIT;
+
+/**
+  * Reads the monotonic clock.  Cache entries must not expire when the wall clock moves.
+  *
+  * @pre none
+  * @post none
+  * @return Current time in seconds
+  */
+static time_t resolver_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/**
+  * Loads the hosts file named by CHAT_HOSTS_FILE, if it is set.
+  *
+  * @pre Called once through g_resolver_hosts_once
+  * @post Its entries are in g_resolver_hosts
+  */
+static void load_env_hosts() {
+	const char* const path = getenv(RESOLVER_HOSTS_ENV);
+	if (NULL != path && '\0' != path[0]) {
+		util_resolver_load_hosts(path);
+	}
+}
+
+/**
+  * Makes room in the resolver cache.  Expired answers and failures go first; if
+  * none have expired, an arbitrary entry does.
+  *
+  * @pre g_resolver_mutex is held
+  * @post g_resolver_cache has fewer than RESOLVER_CACHE_SIZE entries
+  * @param in_now Current time from resolver_now()
+  */
+static void evict_resolved(const time_t in_now) {
+	std::map<std::pair<int, std::string>, ResolvedAddress>::iterator cache_it = g_resolver_cache.begin();
+	while (g_resolver_cache.end() != cache_it) {
+		if (in_now >= cache_it->second.expires) {
+			g_resolver_cache.erase(cache_it++);
+		}
+		else {
+			++cache_it;
+		}
+	}
+
+	if (g_resolver_cache.size() >= RESOLVER_CACHE_SIZE) {
+		g_resolver_cache.erase(g_resolver_cache.begin());
+	}
+}
+
+/**
+  * Sets the port of a resolved IPv4 or IPv6 address.
+  *
+  * @pre in_addr is an AF_INET or AF_INET6 address
+  * @post in_addr has in_port
+  * @param in_addr Address to modify
+  * @param in_port Port number in host byte order
+  */
+static void set_address_port(struct sockaddr_storage& in_addr, const int in_port) {
+	if (AF_INET6 == in_addr.ss_family) {
+		reinterpret_cast<struct sockaddr_in6*>(&in_addr)->sin6_port = htons(in_port);
+	}
+	else {
+		reinterpret_cast<struct sockaddr_in*>(&in_addr)->sin_port = htons(in_port);
+	}
+}
+
+/**
+  * Creates a stream socket bound to the IPv6 wildcard that takes IPv4 connections
+  * as well.
+  *
+  * @pre none
+  * @post A new socket is created if the host has IPv6
+  * @param in_socket_type The type of socket to create e.g. SOCK_STREAM
+  * @param in_protocol The socket protocol e.g. IPPROTO_TCP
+  * @param out_addr The IPv6 wildcard address with port 0
+  * @param out_addr_len Length of out_addr
+  * @return Socket file descriptor if successful; -1 if the host has no IPv6
+  */
+static int create_dual_stack_socket(const int in_socket_type,
+                                    const int in_protocol,
+                                    struct sockaddr_storage& out_addr,
+                                    socklen_t& out_addr_len) {
+	const int new_socket = socket(AF_INET6, in_socket_type, in_protocol);
+	if (new_socket < 0) {
+		return -1;
+	}
+
+	const int disable = 0;
+	if (setsockopt(new_socket, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable)) < 0) {
+		close(new_socket);
+		return -1;
+	}
+
+	struct sockaddr_in6* const sin6 = reinterpret_cast<struct sockaddr_in6*>(&out_addr);
+	memset(&out_addr, 0, sizeof(out_addr));
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_addr = in6addr_any;
+	out_addr_len = sizeof(*sin6);
+	return new_socket;
+}
+
+int util_create_server_socket(const int in_socket_type, const int in_protocol, const char* const in_host, const int in_port, const bool in_reuse_port)
 {
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(struct sockaddr_in);
+	int new_socket = -1;
+	if (NULL == in_host) {
+		// listeners take IPv4 and IPv6 clients; datagram sockets keep the IPv4
+		// wildcard, since every coordinator peer address we hand around is a sockaddr_in
+		if (SOCK_STREAM == in_socket_type) {
+			new_socket = create_dual_stack_socket(in_socket_type, in_protocol, addr, addr_len);
+		}
+		if (-1 == new_socket && -1 == util_create_sockaddr(NULL, in_port, reinterpret_cast<struct sockaddr_in*>(&addr))) {
+			return -1;
+		}
+	}
+	else if (-1 == util_resolve(in_host, in_port, AF_UNSPEC, addr, addr_len)) {
+		return -1;
+	}
+	set_address_port(addr, in_port);
+
 	// allocate a socket
-	const int new_socket = socket(PF_INET, in_socket_type, in_protocol);
+	if (-1 == new_socket) {
+		new_socket = socket(addr.ss_family, in_socket_type, in_protocol);
+	}
 	if (new_socket < 0) {
 		fprintf(stderr, "Unable to create socket.  Error is %s\n", strerror(errno));
 		return -1;
 	}
 
-	struct sockaddr_in sin;
-	if(-1 == util_create_sockaddr(in_host, in_port, &sin)) {
-		fprintf(stderr, "Failed to create sockaddr_in.  Error is %s\n", strerror(errno));
-		return -1;
+	// must be set before bind() on every socket that will share the port
+	if (in_reuse_port) {
+		const int enable = 1;
+		if (setsockopt(new_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+			fprintf(stderr, "Unable to set SO_REUSEPORT.  Error is %s\n", strerror(errno));
+			close(new_socket);
+			return -1;
+		}
 	}
 
 	// bind the socket
-	if (bind(new_socket, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+	if (bind(new_socket, (struct sockaddr *)&addr, addr_len) < 0) {
 		fprintf(stderr, "Unable to bind to port.  Error is %s\n", strerror(errno));
+		close(new_socket);
 		return -1;
 	}
 
@@ -42,22 +219,33 @@ int util_create_server_socket(const int in_socket_type, const int in_protocol, c
 
 int util_create_client_socket(const int in_socket_type, const int in_protocol, const char* const in_host, const int in_port)
 {
-	// allocate a socket
-	const int new_socket = socket(PF_INET, in_socket_type, in_protocol);
-	if (new_socket < 0) {
-		fprintf(stderr, "Unable to create socket.  Error is %s\n", strerror(errno));
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	if (-1 == util_resolve(in_host, in_port, AF_UNSPEC, addr, addr_len)) {
 		return -1;
 	}
 
-	struct sockaddr_in sin;
-	if(-1 == util_create_sockaddr(in_host, in_port, &sin)) {
-		fprintf(stderr, "Failed to create sockaddr_in.  Error is %s\n", strerror(errno));
+	return util_create_client_socket(in_socket_type, in_protocol, (const struct sockaddr *)&addr, addr_len);
+}
+
+int util_create_client_socket(const int in_socket_type, const int in_protocol, const struct sockaddr_in& in_sin)
+{
+	return util_create_client_socket(in_socket_type, in_protocol, (const struct sockaddr *)&in_sin, sizeof(in_sin));
+}
+
+int util_create_client_socket(const int in_socket_type, const int in_protocol, const struct sockaddr* const in_addr, const socklen_t in_addr_len)
+{
+	// allocate a socket
+	const int new_socket = socket(in_addr->sa_family, in_socket_type, in_protocol);
+	if (new_socket < 0) {
+		fprintf(stderr, "Unable to create socket.  Error is %s\n", strerror(errno));
 		return -1;
 	}
 
 	// connect to our endpoint
-	if (connect(new_socket, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+	if (connect(new_socket, in_addr, in_addr_len) < 0) {
 		fprintf(stderr, "failed to connect socket %s\n", strerror(errno));
+		close(new_socket);
 		return -1; 
 	}  
 
@@ -74,6 +262,16 @@ int util_listen(const int in_socket) {
 	return 0;
 }
 
+int util_set_nonblocking(const int in_socket) {
+	const int flags = fcntl(in_socket, F_GETFL, 0);
+	if (flags < 0 || fcntl(in_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+		fprintf(stderr, "Failed to make socket non-blocking.  Error is %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 int util_create_sockaddr(const char* const in_host, const int in_port, struct sockaddr_in* in_sin) {
 	// an Internet endpoint address
 	memset(in_sin, 0, sizeof(*in_sin));
@@ -85,28 +283,188 @@ int util_create_sockaddr(const char* const in_host, const int in_port, struct so
 	}
 	else {
 		// we were passed a hostname rather than IP address
-		struct hostent *hostp = gethostbyname(in_host);
-		if (NULL == hostp) {
-			fprintf(stderr, "Unable to resolve hostname!");
+		struct sockaddr_storage addr;
+		socklen_t addr_len;
+		if (-1 == util_resolve(in_host, in_port, AF_INET, addr, addr_len)) {
 			return -1;
 		}
-		memcpy(&in_sin->sin_addr, hostp->h_addr, sizeof(in_sin->sin_addr));
+		memcpy(in_sin, &addr, sizeof(*in_sin));
+	}
+
+	return 0;
+}
+
+int util_resolve(const char* const in_host, const int in_port, const int in_family, struct sockaddr_storage& out_addr, socklen_t& out_addr_len) {
+	pthread_once(&g_resolver_hosts_once, load_env_hosts);
+
+	const std::string host(in_host);
+	const std::pair<int, std::string> key(in_family, host);
+	const time_t now = resolver_now();
+	bool found = false;
+	ResolvedAddress resolved;
+
+	pthread_mutex_lock(&g_resolver_mutex);
+	std::map<std::string, ResolvedAddress>::const_iterator hosts_it = g_resolver_hosts.find(host);
+	if (g_resolver_hosts.end() != hosts_it) {
+		found = true;
+		resolved = hosts_it->second;
+		// an override of the wrong family is an answer too - there is no such address
+		if (AF_UNSPEC != in_family && in_family != resolved.addr.ss_family) {
+			resolved.addr_len = 0;
+			resolved.error = EAI_NONAME;
+		}
+	}
+	else {
+		std::map<std::pair<int, std::string>, ResolvedAddress>::const_iterator cache_it = g_resolver_cache.find(key);
+		if (g_resolver_cache.end() != cache_it && now < cache_it->second.expires) {
+			found = true;
+			resolved = cache_it->second;
+		}
+	}
+	const int ttl = g_resolver_ttl;
+	const int negative_ttl = g_resolver_negative_ttl;
+	pthread_mutex_unlock(&g_resolver_mutex);
+
+	// look it up without the lock so a slow DNS server only stalls this thread
+	if (!found) {
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = in_family;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* results = NULL;
+		const int gai_error = getaddrinfo(in_host, NULL, &hints, &results);
+		if (0 == gai_error) {
+			// prefer IPv4 - the coordinator protocol and datagram batches carry sockaddr_in
+			const struct addrinfo* chosen = results;
+			for (const struct addrinfo* result = results; NULL != result; result = result->ai_next) {
+				if (AF_INET == result->ai_family) {
+					chosen = result;
+					break;
+				}
+			}
+			memcpy(&resolved.addr, chosen->ai_addr, chosen->ai_addrlen);
+			resolved.addr_len = chosen->ai_addrlen;
+			freeaddrinfo(results);
+		}
+		else {
+			resolved.error = gai_error;
+		}
+
+		resolved.expires = now + ((0 == resolved.addr_len) ? negative_ttl : ttl);
+		pthread_mutex_lock(&g_resolver_mutex);
+		if (resolved.expires > now) {
+			if (g_resolver_cache.size() >= RESOLVER_CACHE_SIZE && g_resolver_cache.end() == g_resolver_cache.find(key)) {
+				evict_resolved(now);
+			}
+			g_resolver_cache[key] = resolved;
+		}
+		else {
+			// caching is off - don't leave an expired answer behind
+			g_resolver_cache.erase(key);
+		}
+		pthread_mutex_unlock(&g_resolver_mutex);
+	}
+
+	// a remembered failure is reported just like a fresh one
+	if (0 == resolved.addr_len) {
+		fprintf(stderr, "Unable to resolve hostname %s!  Error is %s\n", in_host, gai_strerror(resolved.error));
+		return -1;
+	}
+
+	out_addr = resolved.addr;
+	out_addr_len = resolved.addr_len;
+	set_address_port(out_addr, in_port);
+	return 0;
+}
+
+void util_resolver_set_ttl(const int in_ttl, const int in_negative_ttl) {
+	pthread_mutex_lock(&g_resolver_mutex);
+	g_resolver_ttl = in_ttl;
+	g_resolver_negative_ttl = in_negative_ttl;
+	g_resolver_cache.clear();
+	pthread_mutex_unlock(&g_resolver_mutex);
+}
+
+int util_resolver_add_host(const char* const in_host, const char* const in_address) {
+	ResolvedAddress resolved;
+	struct sockaddr_in* const sin = reinterpret_cast<struct sockaddr_in*>(&resolved.addr);
+	struct sockaddr_in6* const sin6 = reinterpret_cast<struct sockaddr_in6*>(&resolved.addr);
+
+	if (1 == inet_pton(AF_INET, in_address, &sin->sin_addr)) {
+		sin->sin_family = AF_INET;
+		resolved.addr_len = sizeof(*sin);
+	}
+	else if (1 == inet_pton(AF_INET6, in_address, &sin6->sin6_addr)) {
+		sin6->sin6_family = AF_INET6;
+		resolved.addr_len = sizeof(*sin6);
+	}
+	else {
+		fprintf(stderr, "Ignoring host %s - %s is not an IP address\n", in_host, in_address);
+		return -1;
+	}
+
+	pthread_mutex_lock(&g_resolver_mutex);
+	g_resolver_hosts[in_host] = resolved;
+	pthread_mutex_unlock(&g_resolver_mutex);
+	return 0;
+}
+
+int util_resolver_load_hosts(const char* const in_path) {
+	std::ifstream hosts_file(in_path);
+	if (!hosts_file) {
+		fprintf(stderr, "Unable to read hosts file %s\n", in_path);
+		return -1;
+	}
+
+	std::string line;
+	while (std::getline(hosts_file, line)) {
+		const std::string::size_type comment = line.find('#');
+		if (std::string::npos != comment) {
+			line.erase(comment);
+		}
+
+		std::istringstream fields(line);
+		std::string address;
+		std::string name;
+		fields >> address;
+		while (fields >> name) {
+			util_resolver_add_host(name.c_str(), address.c_str());
+		}
 	}
 
 	return 0;
 }
 
 int util_get_port_number(const int in_socket) {
-    struct sockaddr_in sin;
-    socklen_t socklen = sizeof(sin);
-    memset(&sin, 0, sizeof(sin));
+    struct sockaddr_storage addr;
+    socklen_t socklen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
 
-    if (getsockname(in_socket, (struct sockaddr *)&sin, &socklen) < 0) {
+    if (getsockname(in_socket, (struct sockaddr *)&addr, &socklen) < 0) {
         fprintf(stderr, "getsockname called failed!  Error is %s\n", strerror(errno));
         return -1;
     }   
 
-    return ntohs(sin.sin_port);
+    if (AF_INET6 == addr.ss_family) {
+        return ntohs(reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<struct sockaddr_in*>(&addr)->sin_port);
+}
+
+void util_raise_descriptor_limit() {
+	struct rlimit fd_limit;
+	if (0 != getrlimit(RLIMIT_NOFILE, &fd_limit)) {
+		fprintf(stderr, "getrlimit: %s\n", strerror(errno));
+		return;
+	}
+
+	if (fd_limit.rlim_cur < fd_limit.rlim_max) {
+		fd_limit.rlim_cur = fd_limit.rlim_max;
+		if (0 != setrlimit(RLIMIT_NOFILE, &fd_limit)) {
+			fprintf(stderr, "setrlimit: %s\n", strerror(errno));
+		}
+	}
 }
 
 
@@ -117,13 +475,114 @@ int util_get_port_number(const int in_socket) {
 
 
 int util_send_tcp(const int in_socket, const int in_int) {
-	// same as UDP but with no sender!
-	return util_send_udp(in_socket, in_int, NULL);
+	UTIL_TRACE(TRACE_SEND, in_socket, TRACE_NO_OPCODE, sizeof(in_int));
+
+	const int net_int = htonl(in_int);
+	return util_send_all(in_socket, reinterpret_cast<const char*>(&net_int), sizeof(net_int));
 }
 
 int util_send_tcp(const int in_socket, const char* const in_buf, const int in_buf_len) {
-	// same as UDP but with no sender!
-	return util_send_udp(in_socket, in_buf, in_buf_len, NULL);
+	UTIL_TRACE(TRACE_SEND, in_socket, TRACE_NO_OPCODE, in_buf_len);
+
+	return util_send_all(in_socket, in_buf, in_buf_len);
+}
+
+int util_send_all(const int in_socket, const char* const in_buf, const size_t in_buf_len) {
+	size_t total_sent = 0;
+
+	while (total_sent < in_buf_len) {
+		const ssize_t num_bytes = send(in_socket, in_buf + total_sent, in_buf_len - total_sent, MSG_NOSIGNAL);
+		if (num_bytes < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			fprintf(stderr, "util (all) send called failed!  Error is %s\n", strerror(errno));
+			return -1;
+		}
+		total_sent += num_bytes;
+	}
+
+	return 0;
+}
+
+int util_send_iov(const int in_socket, struct iovec* in_iov, int in_iov_count) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+
+	while (in_iov_count > 0) {
+		msg.msg_iov = in_iov;
+		msg.msg_iovlen = in_iov_count;
+
+		// MSG_NOSIGNAL - a client that hung up must not kill the server with SIGPIPE
+		const ssize_t num_bytes = sendmsg(in_socket, &msg, MSG_NOSIGNAL);
+		if (num_bytes < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			fprintf(stderr, "util (iov) send called failed!  Error is %s\n", strerror(errno));
+			return -1;
+		}
+
+		// skip past everything that went out and resume in the middle of a partial buffer
+		size_t remaining = num_bytes;
+		while (in_iov_count > 0 && remaining >= in_iov->iov_len) {
+			remaining -= in_iov->iov_len;
+			++in_iov;
+			--in_iov_count;
+		}
+		if (in_iov_count > 0) {
+			in_iov->iov_base = static_cast<char*>(in_iov->iov_base) + remaining;
+			in_iov->iov_len -= remaining;
+		}
+	}
+
+	return 0;
+}
+
+int util_try_send_iov(const int in_socket, const struct iovec* const in_iov, const int in_iov_count, const int in_flags) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = const_cast<struct iovec*>(in_iov);
+	msg.msg_iovlen = in_iov_count;
+
+	for (;;) {
+		// MSG_DONTWAIT - the caller queues whatever does not fit and waits for EPOLLOUT
+		const ssize_t num_bytes = sendmsg(in_socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | in_flags);
+		if (num_bytes >= 0) {
+			UTIL_TRACE(TRACE_SEND, in_socket, TRACE_NO_OPCODE, num_bytes);
+			return num_bytes;
+		}
+
+		if (EINTR == errno) {
+			continue;
+		}
+		if (EAGAIN == errno || EWOULDBLOCK == errno) {
+			return 0;
+		}
+		fprintf(stderr, "util (iov) send called failed!  Error is %s\n", strerror(errno));
+		return -1;
+	}
+}
+
+int util_try_sendfile(const int in_socket, const int in_file_fd, const off_t in_offset, const size_t in_len) {
+	for (;;) {
+		// sendfile() has no MSG_DONTWAIT - the socket itself must be non-blocking
+		off_t offset = in_offset;
+		const ssize_t num_bytes = sendfile(in_socket, in_file_fd, &offset, in_len);
+		if (num_bytes >= 0) {
+			UTIL_TRACE(TRACE_SEND, in_socket, TRACE_NO_OPCODE, num_bytes);
+			return num_bytes;
+		}
+
+		if (EINTR == errno) {
+			continue;
+		}
+		if (EAGAIN == errno || EWOULDBLOCK == errno) {
+			return 0;
+		}
+		fprintf(stderr, "util sendfile failed!  Error is %s\n", strerror(errno));
+		return -1;
+	}
 }
 
 
@@ -132,14 +591,60 @@ int util_send_tcp(const int in_socket, const char* const in_buf, const int in_bu
 //
 
 
+int util_recv_all(const int in_socket, char* in_buf, const size_t in_buf_len) {
+	size_t total_received = 0;
+
+	while (total_received < in_buf_len) {
+		const ssize_t num_bytes = recv(in_socket, in_buf + total_received, in_buf_len - total_received, 0);
+		if (num_bytes <= 0) {
+			if (num_bytes < 0 && EINTR == errno) {
+				continue;
+			}
+			fprintf(stderr, "util (all) - recv error or client disconnect: %s\n", strerror(errno));
+			return -1;
+		}
+		total_received += num_bytes;
+	}
+
+	return 0;
+}
+
 int util_recv_tcp(const int in_socket, int& in_ret_int, const int in_flags) {
-	// same as UDP but with no sender!
-	return util_recv_udp(in_socket, in_ret_int, NULL, 0, in_flags);
+	int recv_int;
+
+	// MSG_WAITALL - a stream may split the integer, so wait for all of it
+	const int num_bytes = recv(in_socket, &recv_int, sizeof(recv_int), in_flags | MSG_WAITALL);
+	if (static_cast<int>(sizeof(recv_int)) != num_bytes) {
+		if (num_bytes < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			return -1;
+		}
+		fprintf(stderr, "util (int) - recv error or client disconnect: %s\n", strerror(errno));
+		return -1;
+	}
+
+	in_ret_int = ntohl(recv_int);
+
+	UTIL_TRACE(TRACE_RECV, in_socket, TRACE_NO_OPCODE, num_bytes);
+
+	return sizeof(recv_int);
 }
 
 int util_recv_tcp(const int in_socket, char* in_ret_buf, const int in_ret_buf_len, const int in_flags) {
-	// same as UDP but with no sender!
-	return util_recv_udp(in_socket, in_ret_buf, in_ret_buf_len, NULL, 0, in_flags);
+	// leave room for the NULL byte
+	const int num_bytes = recv(in_socket, in_ret_buf, in_ret_buf_len - 1, in_flags);
+	if (num_bytes <= 0) {
+		// nothing to read yet on a MSG_DONTWAIT / non-blocking socket is not an error
+		if (num_bytes < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			return -1;
+		}
+		fprintf(stderr, "util (str) - recv error or client disconnect: %s\n", strerror(errno));
+		return -1;
+	}
+	in_ret_buf[num_bytes] = 0;
+
+	UTIL_TRACE(TRACE_RECV, in_socket, TRACE_NO_OPCODE, num_bytes);
+
+	return num_bytes;
 }
 
 
@@ -149,9 +654,7 @@ int util_recv_tcp(const int in_socket, char* in_ret_buf, const int in_ret_buf_le
 
 
 int util_send_udp(const int in_socket, const int in_int, const struct sockaddr* in_to) {
-    #ifdef DEBUG
-    printf("DEBUG:  util (int) - sending |%d|\n", in_int);
-    #endif
+	UTIL_TRACE(TRACE_SEND_UDP, in_socket, TRACE_NO_OPCODE, sizeof(in_int));
 
 	const int net_int = htonl(in_int);
 	const socklen_t in_to_len = sizeof(*in_to);
@@ -166,9 +669,7 @@ int util_send_udp(const int in_socket, const int in_int, const struct sockaddr*
 }
 
 int util_send_udp(const int in_socket, const char* const in_buf, const int in_buf_len, const struct sockaddr* in_to) {
-    #ifdef DEBUG
-    printf("DEBUG:  util (str) - sending |%s|\n", in_buf);
-    #endif
+	UTIL_TRACE(TRACE_SEND_UDP, in_socket, TRACE_NO_OPCODE, in_buf_len);
 
 	const socklen_t in_to_len = sizeof(*in_to);
 
@@ -188,47 +689,381 @@ int util_send_udp(const int in_socket, const char* const in_buf, const int in_bu
 
 
 int util_recv_udp(const int in_socket, int& in_ret_int, struct sockaddr *in_from, socklen_t in_from_len, const int in_flags) {
-	memset(in_from, 0, in_from_len);
 	int recv_int;
 
-	const int num_bytes = recvfrom(in_socket, &recv_int, sizeof(recv_int), in_flags, in_from, &in_from_len);
+	// MSG_TRUNC - report the real datagram length so an oversized one is caught
+	const int num_bytes = recvfrom(in_socket, &recv_int, sizeof(recv_int), in_flags | MSG_TRUNC, in_from, &in_from_len);
 	if (num_bytes <= 0) {
+		if (num_bytes < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			return -1;
+		}
 		fprintf(stderr, "util (int) - recvfrom error or client disconnect: %s\n", strerror(errno));
 		return -1;
 	}
 
+	if (static_cast<int>(sizeof(recv_int)) != num_bytes) {
+		fprintf(stderr, "util (int) - expected a %d byte datagram but got %d bytes\n", static_cast<int>(sizeof(recv_int)), num_bytes);
+		return -1;
+	}
+
 	in_ret_int = ntohl(recv_int);
 
-	#ifdef DEBUG
-	printf("DEBUG:  util (int) - received |%d|\n", ret_int);
-	#endif
+	UTIL_TRACE(TRACE_RECV_UDP, in_socket, TRACE_NO_OPCODE, num_bytes);
 
 	return num_bytes;
 }
 
 int util_recv_udp(const int in_socket, char* in_ret_buf, const int in_ret_buf_len, struct sockaddr *in_from, socklen_t in_from_len, const int in_flags) {
-	// make sure our buffer is clean
-	memset(in_ret_buf, 0, in_ret_buf_len);
-	memset(in_from, 0, in_from_len);
-
-	const int num_bytes = recvfrom(in_socket, in_ret_buf, in_ret_buf_len, in_flags, in_from, &in_from_len);
+	// leave room for the NULL byte.  MSG_TRUNC - report the real datagram length.
+	const int num_bytes = recvfrom(in_socket, in_ret_buf, in_ret_buf_len - 1, in_flags | MSG_TRUNC, in_from, &in_from_len);
 	if (num_bytes <= 0) {
+		// nothing to read yet on a MSG_DONTWAIT / non-blocking socket is not an error
+		if (num_bytes < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			return -1;
+		}
 		fprintf(stderr, "util (str) - recvfrom error or client disconnect: %s\n", strerror(errno));
 		return -1;
 	}
 
-	// prevent buffer overflow
-	assert(num_bytes <= in_ret_buf_len);
-
-	// THIS IS DANGEROUS
-	// there must be a pre condition that the argument buffer has space for the received
-	// string PLUS one more character for the NULL byte!
-    in_ret_buf[num_bytes] = 0;
+	// the rest of the datagram is gone - don't hand back half a message
+	if (num_bytes > in_ret_buf_len - 1) {
+		fprintf(stderr, "util (str) - datagram of %d bytes does not fit in %d\n", num_bytes, in_ret_buf_len - 1);
+		return -1;
+	}
+	in_ret_buf[num_bytes] = 0;
 
-	#ifdef DEBUG
-	printf("DEBUG:  util (str) - received |%s|\n", in_ret_buf);
-	#endif
+	UTIL_TRACE(TRACE_RECV_UDP, in_socket, TRACE_NO_OPCODE, num_bytes);
 
     return num_bytes;
 }
 
+int util_recv_udp_batch(const int in_socket, DatagramBatch& in_batch) {
+	struct mmsghdr msgs[MAX_DATAGRAM_BATCH];
+	struct iovec iov[MAX_DATAGRAM_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+
+	for (int i = 0; i < MAX_DATAGRAM_BATCH; ++i) {
+		// leave room for the NULL byte
+		iov[i].iov_base = in_batch.data[i];
+		iov[i].iov_len = BUFFER_SIZE - 1;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &in_batch.peer[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(in_batch.peer[i]);
+	}
+
+	// MSG_WAITFORONE - block for the first datagram, then take only what is already queued
+	in_batch.count = 0;
+	const int num_msgs = recvmmsg(in_socket, msgs, MAX_DATAGRAM_BATCH, MSG_WAITFORONE, NULL);
+	if (num_msgs < 0) {
+		if (EINTR != errno) {
+			fprintf(stderr, "util (batch) - recvmmsg error: %s\n", strerror(errno));
+		}
+		return -1;
+	}
+
+	for (int i = 0; i < num_msgs; ++i) {
+		if (0 != (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+			fprintf(stderr, "util (batch) - datagram does not fit in %d bytes\n", BUFFER_SIZE - 1);
+			in_batch.data[i][0] = 0;
+			in_batch.length[i] = -1;
+			continue;
+		}
+
+		in_batch.length[i] = msgs[i].msg_len;
+		in_batch.data[i][msgs[i].msg_len] = 0;
+
+		// a frame's opcode is its second byte
+		UTIL_TRACE(TRACE_RECV_UDP, in_socket, (msgs[i].msg_len > 1) ? static_cast<unsigned char>(in_batch.data[i][1]) : TRACE_NO_OPCODE, msgs[i].msg_len);
+	}
+	in_batch.count = num_msgs;
+
+	return num_msgs;
+}
+
+int util_add_udp_frame(DatagramBatch& in_batch, const unsigned char in_opcode, const unsigned short in_flags, const char* const in_payload, const unsigned int in_payload_len, const struct sockaddr_in& in_to) {
+	if (in_batch.count >= MAX_DATAGRAM_BATCH) {
+		fprintf(stderr, "util (batch) - batch is full\n");
+		return -1;
+	}
+
+	if (in_payload_len > static_cast<unsigned int>(BUFFER_SIZE - FRAME_HEADER_SIZE)) {
+		fprintf(stderr, "util (batch) - payload of %u bytes does not fit in a datagram\n", in_payload_len);
+		return -1;
+	}
+
+	char* const datagram = in_batch.data[in_batch.count];
+	util_encode_frame_header(in_opcode, in_flags, in_payload_len, datagram);
+	if (in_payload_len > 0) {
+		memcpy(datagram + FRAME_HEADER_SIZE, in_payload, in_payload_len);
+	}
+	in_batch.length[in_batch.count] = FRAME_HEADER_SIZE + in_payload_len;
+	in_batch.peer[in_batch.count] = in_to;
+	++in_batch.count;
+
+	return 0;
+}
+
+int util_send_udp_batch(const int in_socket, DatagramBatch& in_batch) {
+	struct mmsghdr msgs[MAX_DATAGRAM_BATCH];
+	struct iovec iov[MAX_DATAGRAM_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+
+	for (int i = 0; i < in_batch.count; ++i) {
+		iov[i].iov_base = in_batch.data[i];
+		iov[i].iov_len = in_batch.length[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &in_batch.peer[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(in_batch.peer[i]);
+	}
+
+	int return_code = 0;
+	int num_sent = 0;
+	while (num_sent < in_batch.count) {
+		const int num_msgs = sendmmsg(in_socket, msgs + num_sent, in_batch.count - num_sent, 0);
+		if (num_msgs < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+
+			// only the first datagram failed - report it and carry on with the rest
+			fprintf(stderr, "util (batch) send called failed!  Error is %s\n", strerror(errno));
+			return_code = -1;
+			++num_sent;
+			continue;
+		}
+		num_sent += num_msgs;
+	}
+
+	for (int i = 0; i < in_batch.count; ++i) {
+		UTIL_TRACE(TRACE_SEND_UDP, in_socket, static_cast<unsigned char>(in_batch.data[i][1]), in_batch.length[i] - FRAME_HEADER_SIZE);
+	}
+	in_batch.count = 0;
+
+	return return_code;
+}
+
+
+
+//
+// FRAMING METHODS
+//
+
+
+void util_encode_frame_header(const unsigned char in_opcode, const unsigned short in_flags, const unsigned int in_length, char* in_buf) {
+	const unsigned short net_flags = htons(in_flags);
+	const unsigned int net_length = htonl(in_length);
+
+	in_buf[0] = static_cast<char>(FRAME_VERSION);
+	in_buf[1] = static_cast<char>(in_opcode);
+	memcpy(in_buf + 2, &net_flags, sizeof(net_flags));
+	memcpy(in_buf + 4, &net_length, sizeof(net_length));
+}
+
+int util_decode_frame_header(const char* const in_buf, FrameHeader& in_header) {
+	unsigned short net_flags;
+	unsigned int net_length;
+	memcpy(&net_flags, in_buf + 2, sizeof(net_flags));
+	memcpy(&net_length, in_buf + 4, sizeof(net_length));
+
+	in_header.version = static_cast<unsigned char>(in_buf[0]);
+	in_header.opcode = static_cast<unsigned char>(in_buf[1]);
+	in_header.flags = ntohs(net_flags);
+	in_header.length = ntohl(net_length);
+
+	if (FRAME_VERSION != in_header.version) {
+		fprintf(stderr, "util (frame) - unsupported frame version %d\n", in_header.version);
+		return -1;
+	}
+
+	if (in_header.length > MAX_FRAME_PAYLOAD) {
+		fprintf(stderr, "util (frame) - payload of %u bytes is too large\n", in_header.length);
+		return -1;
+	}
+
+	return 0;
+}
+
+int util_decode_frame(const char* const in_buf, const int in_buf_len, FrameHeader& in_header, const char*& in_payload) {
+	if (in_buf_len < FRAME_HEADER_SIZE || -1 == util_decode_frame_header(in_buf, in_header)) {
+		return -1;
+	}
+
+	// a datagram is exactly one frame - no more, no less
+	if (in_header.length != static_cast<unsigned int>(in_buf_len - FRAME_HEADER_SIZE)) {
+		fprintf(stderr, "util (frame) - frame of %u bytes in a %d byte buffer\n", in_header.length, in_buf_len);
+		return -1;
+	}
+
+	in_payload = in_buf + FRAME_HEADER_SIZE;
+	return 0;
+}
+
+int util_send_frame(const int in_socket, const unsigned char in_opcode, const unsigned short in_flags, const char* const in_payload, const unsigned int in_payload_len) {
+	UTIL_TRACE(TRACE_SEND, in_socket, in_opcode, in_payload_len);
+
+	char header[FRAME_HEADER_SIZE];
+	util_encode_frame_header(in_opcode, in_flags, in_payload_len, header);
+
+	// header and payload go out in one syscall
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = FRAME_HEADER_SIZE;
+	iov[1].iov_base = const_cast<char*>(in_payload);
+	iov[1].iov_len = in_payload_len;
+
+	return util_send_iov(in_socket, iov, (0 == in_payload_len) ? 1 : 2);
+}
+
+int util_send_udp_frame(const int in_socket, const unsigned char in_opcode, const unsigned short in_flags, const char* const in_payload, const unsigned int in_payload_len, const struct sockaddr* in_to) {
+	UTIL_TRACE(TRACE_SEND_UDP, in_socket, in_opcode, in_payload_len);
+
+	char header[FRAME_HEADER_SIZE];
+	util_encode_frame_header(in_opcode, in_flags, in_payload_len, header);
+
+	// header and payload make up one datagram
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = FRAME_HEADER_SIZE;
+	iov[1].iov_base = const_cast<char*>(in_payload);
+	iov[1].iov_len = in_payload_len;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = const_cast<struct sockaddr*>(in_to);
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = (0 == in_payload_len) ? 1 : 2;
+
+	if (sendmsg(in_socket, &msg, 0) < 0) {
+		fprintf(stderr, "util (frame) send called failed!  Error is %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int util_recv_frame(const int in_socket, ConnectionReader& in_reader, FrameHeader& in_header, const char*& in_payload) {
+	for (;;) {
+		const int status = in_reader.next_frame(in_header, in_payload);
+		if (-1 == status) {
+			return -1;
+		}
+		if (1 == status) {
+			break;
+		}
+
+		if (-1 == in_reader.fill(in_socket)) {
+			return -1;
+		}
+	}
+
+	UTIL_TRACE(TRACE_RECV, in_socket, in_header.opcode, in_header.length);
+
+	return 0;
+}
+
+
+
+//
+// CONNECTION READER
+//
+
+
+ConnectionReader::ConnectionReader(const size_t in_fill_size) :
+	m_buffer(),
+	m_begin(0),
+	m_end(0),
+	m_fill_size(in_fill_size) {
+}
+
+int ConnectionReader::fill(const int in_socket, const int in_flags) {
+	make_room(m_fill_size);
+
+	for (;;) {
+		const ssize_t num_bytes = recv(in_socket, &m_buffer[m_end], m_buffer.size() - m_end, in_flags);
+		if (num_bytes > 0) {
+			m_end += num_bytes;
+			return num_bytes;
+		}
+
+		if (num_bytes < 0 && EINTR == errno) {
+			continue;
+		}
+		// nothing to read yet on a MSG_DONTWAIT / non-blocking socket is not an error
+		if (num_bytes < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			return -1;
+		}
+		fprintf(stderr, "util (reader) - recv error or client disconnect: %s\n", strerror(errno));
+		return -1;
+	}
+}
+
+size_t ConnectionReader::available() const {
+	return m_end - m_begin;
+}
+
+const char* ConnectionReader::peek(const size_t in_len) const {
+	if (available() < in_len || m_buffer.empty()) {
+		return NULL;
+	}
+
+	return &m_buffer[m_begin];
+}
+
+void ConnectionReader::consume(const size_t in_len) {
+	assert(in_len <= available());
+	m_begin += in_len;
+
+	// an empty buffer starts over at the front for free
+	if (m_begin == m_end) {
+		m_begin = 0;
+		m_end = 0;
+	}
+}
+
+int ConnectionReader::next_frame(FrameHeader& out_header, const char*& out_payload, const unsigned int in_max_payload) {
+	const char* const header = peek(FRAME_HEADER_SIZE);
+	if (NULL == header) {
+		return 0;
+	}
+
+	if (-1 == util_decode_frame_header(header, out_header)) {
+		return -1;
+	}
+
+	// refuse before buffering it, not after
+	if (out_header.length > in_max_payload) {
+		fprintf(stderr, "util (reader) - frame of %u bytes is larger than %u\n", out_header.length, in_max_payload);
+		return -1;
+	}
+
+	const char* const frame = peek(FRAME_HEADER_SIZE + out_header.length);
+	if (NULL == frame) {
+		// a frame bigger than the fill size must still fit in one piece
+		make_room(FRAME_HEADER_SIZE + out_header.length - available());
+		return 0;
+	}
+
+	out_payload = frame + FRAME_HEADER_SIZE;
+	consume(FRAME_HEADER_SIZE + out_header.length);
+	return 1;
+}
+
+void ConnectionReader::make_room(const size_t in_free) {
+	if (m_buffer.size() - m_end >= in_free) {
+		return;
+	}
+
+	// reuse consumed space before growing - only a partial frame ever moves
+	if (m_begin > 0) {
+		memmove(&m_buffer[0], &m_buffer[m_begin], m_end - m_begin);
+		m_end -= m_begin;
+		m_begin = 0;
+	}
+
+	if (m_buffer.size() - m_end < in_free) {
+		m_buffer.resize(m_end + in_free);
+	}
+}
@@ -8,14 +8,168 @@
  * @brief Generic socket library
  */
 
+#include <climits>
+#include <cstddef>
+#include <vector>
+
+#include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 
 /** Maximum number of queued connections for listen() */
-const int LISTEN_QUEUE_LENGTH = 32;
+const int LISTEN_QUEUE_LENGTH = SOMAXCONN;
 /** Maximum amount of data that can be sent or recv'd */
 const int BUFFER_SIZE = 4096;
 
+/** Most iovec entries the kernel accepts in a single writev() / sendmsg() */
+const int MAX_SEND_IOV = IOV_MAX;
+/** Most datagrams moved by a single recvmmsg() / sendmmsg() call */
+const int MAX_DATAGRAM_BATCH = 64;
+
+/** Version of the session wire format.  Carried in every frame header. */
+const unsigned char FRAME_VERSION = 1;
+/** Size of the fixed header that starts every frame */
+const int FRAME_HEADER_SIZE = 8;
+/** Largest payload either side will accept in a single frame */
+const unsigned int MAX_FRAME_PAYLOAD = 16 * 1024 * 1024;
+
+/** How long a resolved host name is reused before it is looked up again.  Value is in seconds. */
+const int DEFAULT_RESOLVER_TTL = 60;
+/** How long a failed lookup is remembered before it is tried again.  Value is in seconds. */
+const int DEFAULT_RESOLVER_NEGATIVE_TTL = 5;
+/** Most looked up host names kept at once.  Expired ones are dropped first to make room. */
+const size_t RESOLVER_CACHE_SIZE = 1024;
+/** Environment variable naming a hosts file whose entries override name resolution */
+const char* const RESOLVER_HOSTS_ENV = "CHAT_HOSTS_FILE";
+
+/**
+  * Fixed header that starts every frame on a session connection.
+  *
+  * On the wire it is version (1 byte), opcode (1 byte), flags (2 bytes) and payload
+  * length (4 bytes), with the multi-byte fields in network byte order.  The payload
+  * follows immediately.
+  */
+struct FrameHeader {
+	/** Wire format version - must be FRAME_VERSION */
+	unsigned char version;
+	/** One of the OP_* values from strings.h */
+	unsigned char opcode;
+	/** Opcode specific flags */
+	unsigned short flags;
+	/** Number of payload bytes after the header */
+	unsigned int length;
+};
+
+/**
+  * A batch of UDP datagrams and their peers, moved with one recvmmsg() or sendmmsg().
+  */
+struct DatagramBatch {
+	/** Number of datagrams in the batch */
+	int count;
+	/** Datagram contents.  Received datagrams are NULL terminated. */
+	char data[MAX_DATAGRAM_BATCH][BUFFER_SIZE];
+	/** Number of bytes in each datagram.  -1 for a received datagram that did not fit. */
+	int length[MAX_DATAGRAM_BATCH];
+	/** Sender of each received datagram, or receiver of each datagram to send */
+	struct sockaddr_in peer[MAX_DATAGRAM_BATCH];
+};
+
+/**
+  * Buffered reader for one stream connection.
+  *
+  * Each fill() takes as much as the socket has in one large read.  The framing layer
+  * then gets exact-length views straight into the buffer, so payloads are never
+  * copied out.  Consumed space is reused: when the free space at the end runs low,
+  * the unread bytes (at most one partial frame) move back to the front.  That keeps
+  * every view contiguous, which a wrapping ring buffer could not promise.
+  */
+class ConnectionReader {
+public:
+	/**
+	  * Creates an empty reader.  No memory is allocated until the first fill().
+	  *
+	  * @pre none
+	  * @post The reader is empty
+	  * @param in_fill_size Free space to make available for each read
+	  */
+	explicit ConnectionReader(const size_t in_fill_size = BUFFER_SIZE);
+
+	/**
+	  * Reads whatever the socket has, up to the fill size, in a single recv().
+	  *
+	  * @pre in_socket is a valid socket file descriptor
+	  * @post The bytes read follow the unread bytes already buffered
+	  * @param in_socket Socket file descriptor to read from
+	  * @param in_flags Flags to pass to recv()
+	  * @return Number of bytes read if successful; -1 if error, disconnect or nothing to read (errno is EAGAIN).
+	  */
+	int fill(const int in_socket,
+	         const int in_flags = 0);
+
+	/**
+	  * Number of unread bytes in the buffer.
+	  *
+	  * @pre none
+	  * @post none
+	  * @return Number of unread bytes
+	  */
+	size_t available() const;
+
+	/**
+	  * Views the next in_len unread bytes without consuming them.
+	  *
+	  * @pre none
+	  * @post none
+	  * @param in_len Number of bytes wanted
+	  * @return Pointer to in_len contiguous bytes, valid until the next fill() or next_frame(); NULL if fewer are buffered
+	  */
+	const char* peek(const size_t in_len) const;
+
+	/**
+	  * Marks bytes as read.
+	  *
+	  * @pre in_len <= available()
+	  * @post The bytes are no longer available
+	  * @param in_len Number of bytes to consume
+	  */
+	void consume(const size_t in_len);
+
+	/**
+	  * Takes the next complete frame out of the buffer.
+	  *
+	  * @pre none
+	  * @post A complete frame has been consumed if one was buffered
+	  * @param out_header Header of the frame
+	  * @param out_payload Set to out_header.length payload bytes, valid until the next fill() or next_frame()
+	  * @param in_max_payload Largest payload the caller will accept
+	  * @return 1 if a frame was consumed; 0 if the frame is not complete yet; -1 if it is malformed or too large
+	  */
+	int next_frame(FrameHeader& out_header,
+	               const char*& out_payload,
+	               const unsigned int in_max_payload = MAX_FRAME_PAYLOAD);
+
+private:
+	/**
+	  * Makes sure there are at least in_free bytes of space after the unread bytes.
+	  *
+	  * @pre none
+	  * @post in_free bytes can be read in without moving anything
+	  * @param in_free Number of free bytes needed
+	  */
+	void make_room(const size_t in_free);
+
+	/** Received bytes.  Unread ones are [m_begin, m_end). */
+	std::vector<char> m_buffer;
+	/** Offset of the first unread byte */
+	size_t m_begin;
+	/** Offset one past the last unread byte */
+	size_t m_end;
+	/** Free space to make available for each read */
+	size_t m_fill_size;
+};
+
 
 /**
   * Creates and binds a server socket.
@@ -24,14 +178,17 @@ const int BUFFER_SIZE = 4096;
   * @post A new socket is created
   * @param in_socket_type The type of socket to create e.g. SOCK_DGRAM or SOCK_STREAM
   * @param in_protocol The socket protocol e.g. IPPROTO_UDP or IPPROTO_TCP
-  * @param in_host The hostname or IP address to bind to.  NULL if any address is valid
+  * @param in_host The hostname or IPv4 / IPv6 address to bind to.  NULL for any address - IPv4
+  *                or IPv6 for SOCK_STREAM, IPv4 only for other types
   * @param in_port The port number to bind to.  0 for OS to choose for you
+  * @param in_reuse_port Set SO_REUSEPORT so several sockets can share the port
   * @return Socket file descriptor if successful; -1 if error.
   */
 int util_create_server_socket(const int in_socket_type,
                               const int in_protocol,
                               const char* const in_host,
-                              const int in_port);
+                              const int in_port,
+                              const bool in_reuse_port = false);
 
 /**
   * Creates a client socket and connects to the specified host / port.
@@ -40,8 +197,8 @@ int util_create_server_socket(const int in_socket_type,
   * @post A new socket is created
   * @param in_socket_type The type of socket to create e.g. SOCK_DGRAM or SOCK_STREAM
   * @param in_protocol The socket protocol e.g. IPPROTO_UDP or IPPROTO_TCP
-  * @param in_host The hostname or IP address to bind to.  NULL if any address is valid
-  * @param in_port The port number to bind to.  0 for the OS to choose one for you
+  * @param in_host The hostname or IPv4 / IPv6 address to connect to
+  * @param in_port The port number to connect to
   * @return Socket file descriptor if successful; -1 if error.
   */
 int util_create_client_socket(const int in_socket_type,
@@ -49,6 +206,37 @@ int util_create_client_socket(const int in_socket_type,
                               const char* const in_host,
                               const int in_port);
 
+/**
+  * Creates a client socket and connects to an IPv4 or IPv6 address that has already
+  * been resolved.
+  *
+  * @pre in_addr points to in_addr_len bytes
+  * @post A new socket is created
+  * @param in_socket_type The type of socket to create e.g. SOCK_DGRAM or SOCK_STREAM
+  * @param in_protocol The socket protocol e.g. IPPROTO_UDP or IPPROTO_TCP
+  * @param in_addr The address to connect to.  Its family picks the socket's.
+  * @param in_addr_len Length of in_addr
+  * @return Socket file descriptor if successful; -1 if error.
+  */
+int util_create_client_socket(const int in_socket_type,
+                              const int in_protocol,
+                              const struct sockaddr* const in_addr,
+                              const socklen_t in_addr_len);
+
+/**
+  * Creates a client socket and connects to an address that has already been resolved.
+  *
+  * @pre none
+  * @post A new socket is created
+  * @param in_socket_type The type of socket to create e.g. SOCK_DGRAM or SOCK_STREAM
+  * @param in_protocol The socket protocol e.g. IPPROTO_UDP or IPPROTO_TCP
+  * @param in_sin The address to connect to
+  * @return Socket file descriptor if successful; -1 if error.
+  */
+int util_create_client_socket(const int in_socket_type,
+                              const int in_protocol,
+                              const struct sockaddr_in& in_sin);
+
 /**
   * Starts listen()'ing on the provided socket.
   *
@@ -60,11 +248,22 @@ int util_create_client_socket(const int in_socket_type,
 int util_listen(const int in_socket);
 
 /**
-  * Initializes a sockaddr_in instance
+  * Puts the socket into non-blocking mode.
+  *
+  * @pre in_socket is a valid socket file descriptor
+  * @post in_socket has O_NONBLOCK set
+  * @param in_socket Socket file descriptor to modify
+  * @return 0 if successful; -1 if error.
+  */
+int util_set_nonblocking(const int in_socket);
+
+/**
+  * Initializes a sockaddr_in instance.  Host names are resolved through util_resolve(),
+  * asking only for IPv4 addresses.
   *
   * @pre in_sin has been created and is not NULL
   * @post in_sin has been initialized
-  * @param in_host The hostname / IP address to use.  NULL if any address is valid
+  * @param in_host The hostname / IPv4 address to use.  NULL if any address is valid
   * @param in_port The port number to use.  0 for the OS to choose one for you
   * @param in_sin The structure to initialize
   * @return 0 if successful; -1 if error.
@@ -73,6 +272,64 @@ int util_create_sockaddr(const char* const in_host,
                          const int in_port,
                          struct sockaddr_in* in_sin);
 
+/**
+  * Resolves a host name with getaddrinfo(), answering from an in-process cache when
+  * it can.  Answers are kept for the resolver TTL and failures for the negative TTL.
+  * Names in the hosts file named by CHAT_HOSTS_FILE, and names added with
+  * util_resolver_add_host(), are answered without a lookup and never expire.  Safe to
+  * call from any thread.
+  *
+  * @pre in_host is not NULL
+  * @post out_addr holds the first address found
+  * @param in_host The hostname / IPv4 / IPv6 address to resolve
+  * @param in_port The port number to put in the address
+  * @param in_family AF_INET or AF_INET6 for only that family; AF_UNSPEC for either, IPv4 first
+  * @param out_addr The resolved address
+  * @param out_addr_len Length of the resolved address
+  * @return 0 if successful; -1 if error.
+  */
+int util_resolve(const char* const in_host,
+                 const int in_port,
+                 const int in_family,
+                 struct sockaddr_storage& out_addr,
+                 socklen_t& out_addr_len);
+
+/**
+  * Sets how long resolved names and failed lookups are cached.  Names already cached
+  * are dropped, so the new times apply to every later lookup.
+  *
+  * @pre none
+  * @post Later lookups are cached for the new times
+  * @param in_ttl Seconds a resolved name is reused.  0 turns the cache off.
+  * @param in_negative_ttl Seconds a failed lookup is remembered.  0 turns that off.
+  */
+void util_resolver_set_ttl(const int in_ttl,
+                           const int in_negative_ttl);
+
+/**
+  * Makes a host name resolve to a fixed address, like an /etc/hosts entry that only
+  * this process sees.  Useful for pointing tests at local stand-ins.
+  *
+  * @pre none
+  * @post in_host resolves to in_address until the process exits
+  * @param in_host The hostname to override
+  * @param in_address Numeric IPv4 or IPv6 address it resolves to
+  * @return 0 if successful; -1 if in_address is not a numeric address.
+  */
+int util_resolver_add_host(const char* const in_host,
+                           const char* const in_address);
+
+/**
+  * Adds every entry in a hosts file with util_resolver_add_host().  The file uses
+  * the /etc/hosts format: an address followed by one or more names, with # comments.
+  *
+  * @pre none
+  * @post Every name in the file resolves to its address
+  * @param in_path Path of the hosts file
+  * @return 0 if successful; -1 if the file could not be read.
+  */
+int util_resolver_load_hosts(const char* const in_path);
+
 /**
   * Retrieves the port number assigned to the socket.
   *
@@ -83,6 +340,14 @@ int util_create_sockaddr(const char* const in_host,
   */
 int util_get_port_number(const int in_socket);
 
+/**
+  * Raises the soft limit on open file descriptors up to the hard limit.
+  *
+  * @pre none
+  * @post RLIMIT_NOFILE soft limit equals the hard limit if permitted
+  */
+void util_raise_descriptor_limit();
+
 /**
   * Sends an integer value using TCP.
   *
@@ -109,6 +374,83 @@ int util_send_tcp(const int in_socket,
                   const char* const in_buf,
                   const int in_buf_len);
 
+/**
+  * Sends every byte of a buffer using TCP, resuming after partial writes.
+  *
+  * @pre in_socket is a valid blocking socket file descriptor
+  * @post in_buf has been sent
+  * @param in_socket Socket file descriptor to use
+  * @param in_buf Byte array to send
+  * @param in_buf_len Number of bytes to send
+  * @return 0 if successful; -1 if error.
+  */
+int util_send_all(const int in_socket,
+                  const char* const in_buf,
+                  const size_t in_buf_len);
+
+/**
+  * Sends a list of buffers using TCP with as few syscalls as possible.
+  * Partial writes are resumed until every byte has been sent.
+  *
+  * @pre in_socket is a valid socket file descriptor.  in_iov_count <= MAX_SEND_IOV
+  * @post Every buffer has been sent.  in_iov has been modified.
+  * @param in_socket Socket file descriptor to use
+  * @param in_iov Buffers to send, in order
+  * @param in_iov_count Number of entries in in_iov
+  * @return 0 if successful; -1 if error.
+  */
+int util_send_iov(const int in_socket,
+                  struct iovec* in_iov,
+                  int in_iov_count);
+
+/**
+  * Sends as much of a list of buffers as the socket accepts without blocking.
+  *
+  * @pre in_socket is a valid socket file descriptor.  in_iov_count <= MAX_SEND_IOV
+  * @post A prefix of the buffers has been sent
+  * @param in_socket Socket file descriptor to use
+  * @param in_iov Buffers to send, in order
+  * @param in_iov_count Number of entries in in_iov
+  * @param in_flags Extra send() flags, e.g. MSG_MORE when more data follows right away
+  * @return Number of bytes sent (0 if the socket buffer is full) if successful; -1 if error.
+  */
+int util_try_send_iov(const int in_socket,
+                      const struct iovec* const in_iov,
+                      const int in_iov_count,
+                      const int in_flags = 0);
+
+/**
+  * Sends as much of a range of a file as the socket accepts without blocking.  The
+  * data goes from the page cache to the socket without passing through user space.
+  *
+  * @pre in_socket is a valid non-blocking socket file descriptor.  in_file_fd is open for reading.
+  *      SIGPIPE is ignored - sendfile() has no MSG_NOSIGNAL.
+  * @post A prefix of the range has been sent
+  * @param in_socket Socket file descriptor to use
+  * @param in_file_fd File to send from
+  * @param in_offset Offset of the range in the file
+  * @param in_len Length of the range
+  * @return Number of bytes sent (0 if the socket buffer is full) if successful; -1 if error.
+  */
+int util_try_sendfile(const int in_socket,
+                      const int in_file_fd,
+                      const off_t in_offset,
+                      const size_t in_len);
+
+/**
+  * Receives exactly in_buf_len bytes using TCP, resuming after partial reads.
+  *
+  * @pre in_socket is a valid blocking socket file descriptor
+  * @post in_buf holds in_buf_len received bytes
+  * @param in_socket Socket file descriptor to use
+  * @param in_buf Buffer to store the received bytes
+  * @param in_buf_len Number of bytes to receive
+  * @return 0 if successful; -1 if error or disconnect.
+  */
+int util_recv_all(const int in_socket,
+                  char* in_buf,
+                  const size_t in_buf_len);
+
 /**
   * Receive an integer value using TCP.
   *
@@ -124,13 +466,14 @@ int util_recv_tcp(const int in_socket,
                   const int in_flags = 0);
 
 /**
-  * Receive a generic byte array using TCP.
+  * Receive a generic byte array using TCP.  This is a stream, so it may be only part
+  * of what the sender wrote.
   *
-  * @pre in_socket is a valid socket file descriptor.  in_ret_buf is an allocated buffer.  in_ret_buf_len is 1 less than the buffer size.
-  * @post in_ret_buf contains the recv'd value and the last position in the buffer is 0.
+  * @pre in_socket is a valid socket file descriptor.  in_ret_buf has room for in_ret_buf_len bytes.
+  * @post in_ret_buf contains the recv'd value followed by a NULL byte.
   * @param in_socket Socket file descriptor to use
   * @param in_ret_buf Buffer to store the recv'd value
-  * @param in_ret_buf_len The number of bytes to recv()
+  * @param in_ret_buf_len Size of in_ret_buf.  At most in_ret_buf_len - 1 bytes are received.
   * @param in_flags Flags to pass to recv()
   * @return Number of bytes received if successful; -1 if error.
   */
@@ -188,13 +531,14 @@ int util_recv_udp(const int in_socket,
                   const int in_flags = 0);
 
 /**
-  * Receive a generic byte array using UDP.
+  * Receive a generic byte array using UDP.  A datagram that does not fit is an error
+  * rather than being silently cut short.
   *
-  * @pre in_socket is a valid socket file descriptor.  in_ret_buf is an allocated buffer.  in_ret_buf_len is 1 less than the buffer size.
-  * @post in_ret_buf contains the recv'd value and the last position in the buffer is 0.
+  * @pre in_socket is a valid socket file descriptor.  in_ret_buf has room for in_ret_buf_len bytes.
+  * @post in_ret_buf contains the recv'd value followed by a NULL byte.
   * @param in_socket Socket file descriptor to use
   * @param in_ret_buf Buffer to store the recv'd value
-  * @param in_ret_buf_len The number of bytes to recv()
+  * @param in_ret_buf_len Size of in_ret_buf.  Datagrams of up to in_ret_buf_len - 1 bytes fit.
   * @param in_from The UDP sender information
   * @param in_from_len Length of the sender's UDP information
   * @param in_flags Flags to pass to recv()
@@ -207,5 +551,149 @@ int util_recv_udp(const int in_socket,
                   socklen_t in_from_len,
                   const int in_flags = 0);
 
+/**
+  * Receives as many queued datagrams as fit in a batch with one syscall.  Waits
+  * for the first datagram only.
+  *
+  * @pre in_socket is a valid UDP socket file descriptor
+  * @post in_batch holds the received datagrams and their senders
+  * @param in_socket Socket file descriptor to use
+  * @param in_batch Batch to fill.  Its previous contents are discarded.
+  * @return Number of datagrams received if successful; -1 if error.
+  */
+int util_recv_udp_batch(const int in_socket,
+                        DatagramBatch& in_batch);
+
+/**
+  * Adds a frame to a batch of datagrams to send.
+  *
+  * @pre in_payload points to in_payload_len bytes
+  * @post in_batch holds one more datagram if there was room
+  * @param in_batch Batch to add to
+  * @param in_opcode Frame opcode
+  * @param in_flags Frame flags
+  * @param in_payload Payload bytes.  May be NULL if in_payload_len is 0
+  * @param in_payload_len Number of payload bytes
+  * @param in_to Receiver of the datagram
+  * @return 0 if successful; -1 if the batch is full or the frame does not fit in a datagram.
+  */
+int util_add_udp_frame(DatagramBatch& in_batch,
+                       const unsigned char in_opcode,
+                       const unsigned short in_flags,
+                       const char* const in_payload,
+                       const unsigned int in_payload_len,
+                       const struct sockaddr_in& in_to);
+
+/**
+  * Sends every datagram in a batch with as few syscalls as possible.
+  * A datagram the kernel refuses is reported and skipped.
+  *
+  * @pre in_socket is a valid UDP socket file descriptor
+  * @post Every datagram has been sent or reported and in_batch is empty
+  * @param in_socket Socket file descriptor to use
+  * @param in_batch Datagrams to send
+  * @return 0 if every datagram was sent; -1 if any failed.
+  */
+int util_send_udp_batch(const int in_socket,
+                        DatagramBatch& in_batch);
+
+/**
+  * Writes a frame header into a buffer.
+  *
+  * @pre in_buf has room for FRAME_HEADER_SIZE bytes
+  * @post in_buf holds the encoded header
+  * @param in_opcode Frame opcode
+  * @param in_flags Frame flags
+  * @param in_length Payload length
+  * @param in_buf Buffer to write the header into
+  */
+void util_encode_frame_header(const unsigned char in_opcode,
+                              const unsigned short in_flags,
+                              const unsigned int in_length,
+                              char* in_buf);
+
+/**
+  * Reads a frame header from a buffer.
+  *
+  * @pre in_buf holds at least FRAME_HEADER_SIZE bytes
+  * @post in_header holds the decoded header
+  * @param in_buf Buffer holding the encoded header
+  * @param in_header Variable to store the decoded header
+  * @return 0 if successful; -1 if the version is unknown or the payload is too large.
+  */
+int util_decode_frame_header(const char* const in_buf,
+                             FrameHeader& in_header);
+
+/**
+  * Decodes a buffer that must hold exactly one frame, such as a datagram.
+  *
+  * @pre in_buf holds in_buf_len bytes
+  * @post in_header holds the decoded header
+  * @param in_buf Buffer holding the frame
+  * @param in_buf_len Number of bytes in in_buf
+  * @param in_header Variable to store the decoded header
+  * @param in_payload Set to the in_header.length payload bytes inside in_buf
+  * @return 0 if successful; -1 if the buffer is not exactly one valid frame.
+  */
+int util_decode_frame(const char* const in_buf,
+                      const int in_buf_len,
+                      FrameHeader& in_header,
+                      const char*& in_payload);
+
+/**
+  * Sends one frame (header and payload) using TCP.
+  *
+  * @pre in_socket is a valid socket file descriptor
+  * @post The frame has been sent
+  * @param in_socket Socket file descriptor to use
+  * @param in_opcode Frame opcode
+  * @param in_flags Frame flags
+  * @param in_payload Payload bytes.  May be NULL if in_payload_len is 0
+  * @param in_payload_len Number of payload bytes
+  * @return 0 if successful; -1 if error.
+  */
+int util_send_frame(const int in_socket,
+                    const unsigned char in_opcode,
+                    const unsigned short in_flags,
+                    const char* const in_payload,
+                    const unsigned int in_payload_len);
+
+/**
+  * Sends one frame as a single UDP datagram.
+  *
+  * @pre in_socket is a valid socket file descriptor
+  * @post The datagram has been sent to the specified address
+  * @param in_socket Socket file descriptor to use
+  * @param in_opcode Frame opcode
+  * @param in_flags Frame flags
+  * @param in_payload Payload bytes.  May be NULL if in_payload_len is 0
+  * @param in_payload_len Number of payload bytes
+  * @param in_to Holds the address of the UDP receiver
+  * @return 0 if successful; -1 if error.
+  */
+int util_send_udp_frame(const int in_socket,
+                        const unsigned char in_opcode,
+                        const unsigned short in_flags,
+                        const char* const in_payload,
+                        const unsigned int in_payload_len,
+                        const struct sockaddr* in_to);
+
+/**
+  * Receives one complete frame using TCP.  Bytes that arrive after the frame stay
+  * in in_reader for the next call, so nothing is ever read twice.
+  *
+  * @pre in_socket is a valid blocking socket file descriptor
+  * @post The frame has been consumed from in_reader
+  * @param in_socket Socket file descriptor to use
+  * @param in_reader Reader for in_socket
+  * @param in_header Variable to store the frame header
+  * @param in_payload Set to in_header.length payload bytes, valid until in_reader is used again
+  * @return 0 if successful; -1 if error or disconnect.
+  */
+int util_recv_frame(const int in_socket,
+                    ConnectionReader& in_reader,
+                    FrameHeader& in_header,
+                    const char*& in_payload);
+
 #endif /* __CSCI_5273_SOCKET_UTILS_H */
 
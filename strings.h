@@ -5,26 +5,156 @@
  * @file strings.h
  * @author Marc Schweikert
  * @date 26 September 2014
- * @brief String Constants
+ * @brief String and protocol constants
  */
 
 #include <string>
 
-/** Chat Coordinator - Start */
-const std::string CMD_COORDINATOR_START		= "Start";
-/** Chat Coordinator - Find */
-const std::string CMD_COORDINATOR_FIND		= "Find";
-/** Chat Coordinator - Terminate */
-const std::string CMD_COORDINATOR_TERMINATE	= "Terminate";
-
-/** Chat Server - Submit */
-const std::string CMD_SERVER_SUBMIT			= "Submit";
-/** Chat Server - Get Next */
-const std::string CMD_SERVER_GET_NEXT		= "GetNext";
-/** Chat Server - Get All */
-const std::string CMD_SERVER_GET_ALL		= "GetAll";
-/** Chat Server - Leave */
-const std::string CMD_SERVER_LEAVE			= "Leave";
+/*
+ * Chat Coordinator datagram opcodes.  Every datagram is a single frame (see FrameHeader
+ * in socket_utils.h) whose payload starts with a REQUEST_ID_SIZE byte request ID in
+ * network byte order.  A reply echoes the ID of the request it answers.
+ */
+
+/** Chat Coordinator request - Start.  Payload is the request ID and the session name. */
+const unsigned char OP_COORDINATOR_START		= 0x01;
+/** Chat Coordinator request - Find.  Payload is the request ID and the session name. */
+const unsigned char OP_COORDINATOR_FIND			= 0x02;
+/** Chat Coordinator request - Terminate.  Payload is the request ID and the session name.  Not answered. */
+const unsigned char OP_COORDINATOR_TERMINATE	= 0x03;
+/**
+  * Chat Coordinator request - Report.  Session servers send one every few seconds.  Payload is the
+  * request ID, the server's 4 byte process ID and then one record per session it serves: 4 byte
+  * client count, 4 byte message count, 4 byte name length and the session name.  Not answered.
+  */
+const unsigned char OP_COORDINATOR_REPORT		= 0x04;
+/**
+  * Chat Coordinator request - List.  Payload is the request ID and the name of the last session
+  * on the previous page of the reply.  Empty for the first page.
+  */
+const unsigned char OP_COORDINATOR_LIST			= 0x05;
+
+/**
+  * Chat Coordinator reply.  Payload is the request ID, a 4 byte TCP port (-1 if the request
+  * failed) and a 4 byte session ID.  A session ID other than 0 means the server hosts several
+  * sessions, so the client must select it with OP_SERVER_SELECT_SESSION before using it.
+  */
+const unsigned char OP_COORDINATOR_REPLY		= 0x81;
+/**
+  * Chat Coordinator reply to List.  Payload is the request ID and one page of text with one record
+  * per line: the record type followed by space separated key=value pairs.  The first page starts
+  * with the coordinator's own records.  A session record ends with name=, which runs to the end of
+  * the line.  FLAG_LIST_MORE is set if more sessions follow.
+  */
+const unsigned char OP_COORDINATOR_LIST_REPLY	= 0x82;
+
+/** Frame flag on OP_COORDINATOR_LIST_REPLY - ask again for the sessions after this page */
+const unsigned short FLAG_LIST_MORE				= 0x0001;
+
+/** Size of the request ID that starts every coordinator datagram */
+const unsigned int REQUEST_ID_SIZE				= 4;
+
+/*
+ * Control channel opcodes.  The coordinator sends these to a session server it
+ * started ahead of time (see -p in chat_coordinator.cc) or to the server that hosts
+ * every session (see -m).  Only the hosting server answers.
+ */
+
+/** Control - Assign.  The session server now serves a session.  Payload is the session name. */
+const unsigned char OP_CONTROL_ASSIGN			= 0x01;
+
+/** Control reply - the session is ready.  Payload is its 4 byte session ID. */
+const unsigned char OP_CONTROL_READY			= 0x81;
+/** Control reply - the session could not be created.  No payload. */
+const unsigned char OP_CONTROL_ERROR			= 0x82;
+
+/*
+ * Chat Server frame opcodes - see FrameHeader in socket_utils.h.
+ * Requests are sent by the client, responses by the server.
+ *
+ * The frame flags of every request name the channel it is for.  A connection to a
+ * single session server carries its session on channel 0.  On a hosting server each
+ * channel is bound with OP_SERVER_SELECT_SESSION, so one connection can carry many
+ * sessions.  Frames the server builds in response (no message, count, push, stats)
+ * carry the request's channel in their flags.  Stored OP_SERVER_MESSAGE frames keep
+ * flags 0 and belong to the response they are part of.
+ */
+
+/** Chat Server request - Submit.  Payload is the message text. */
+const unsigned char OP_SERVER_SUBMIT			= 0x01;
+/** Chat Server request - Get Next.  No payload. */
+const unsigned char OP_SERVER_GET_NEXT			= 0x02;
+/**
+  * Chat Server request - Get All.  Payload is empty, or one byte of GET_ALL_* options.
+  * Answered with OP_SERVER_MESSAGE_COUNT and then the messages.
+  */
+const unsigned char OP_SERVER_GET_ALL			= 0x03;
+/** Chat Server request - Leave.  Closes the channel, and the connection with its last channel.  No payload. */
+const unsigned char OP_SERVER_LEAVE				= 0x04;
+/** Chat Server request - Subscribe.  Unread and new messages are pushed from now on.  No payload. */
+const unsigned char OP_SERVER_SUBSCRIBE			= 0x05;
+/** Chat Server request - Unsubscribe.  Stops the pushes.  No payload. */
+const unsigned char OP_SERVER_UNSUBSCRIBE		= 0x06;
+/**
+  * Chat Server request - Select Session.  Binds the channel in the frame flags to a hosted session.
+  * Each session may be bound to one channel per connection, and the channel must be below 1024.
+  * Payload is the 4 byte session ID.
+  */
+const unsigned char OP_SERVER_SELECT_SESSION	= 0x07;
+/** Chat Server request - Stats.  Answered with OP_SERVER_STATS_REPLY.  No payload. */
+const unsigned char OP_SERVER_STATS				= 0x08;
+/**
+  * Chat Server request - Resume.  Payload is empty, or a RESUME_TOKEN_SIZE byte token from an
+  * earlier OP_SERVER_RESUME_TOKEN.  A channel whose connection dropped left its read position
+  * behind under that token, and this channel carries on from it.  Answered with
+  * OP_SERVER_RESUME_TOKEN.
+  */
+const unsigned char OP_SERVER_RESUME			= 0x09;
+
+/** Chat Server response - one chat message.  Payload is the message text. */
+const unsigned char OP_SERVER_MESSAGE			= 0x81;
+/** Chat Server response - no unread messages.  No payload. */
+const unsigned char OP_SERVER_NO_MESSAGE		= 0x82;
+/** Chat Server response - number of OP_SERVER_MESSAGE frames that follow.  Payload is a 4 byte count. */
+const unsigned char OP_SERVER_MESSAGE_COUNT		= 0x83;
+/** Chat Server push - new messages for a subscriber.  Payload is one or more OP_SERVER_MESSAGE frames. */
+const unsigned char OP_SERVER_PUSH				= 0x84;
+/**
+  * Chat Server response - snapshot of the server's counters.  Payload is text with one record
+  * per line: the record type followed by space separated key=value pairs.
+  */
+const unsigned char OP_SERVER_STATS_REPLY		= 0x85;
+/**
+  * Chat Server response - the channel has no session: it was never selected, or the session it
+  * selected does not exist.  Sent in place of the response.  A failed selection is not answered
+  * itself, so every request has exactly one response.  No payload.
+  */
+const unsigned char OP_SERVER_NO_SESSION		= 0x86;
+/**
+  * Chat Server response - several chat messages in one compressed block (see compress.h).
+  * Payload is the 4 byte length of the original block, then the block.  The original block
+  * is a run of OP_SERVER_MESSAGE frames, laid out like an OP_SERVER_PUSH payload.  A block
+  * as long as the original did not compress and is sent as is.
+  */
+const unsigned char OP_SERVER_MESSAGE_BATCH		= 0x87;
+/**
+  * Chat Server response - messages the client had not read yet were trimmed from the history.
+  * Sent just before the response or push that carries on from the oldest message still kept.
+  * Payload is the 4 byte number of messages skipped.
+  */
+const unsigned char OP_SERVER_GAP				= 0x88;
+/**
+  * Chat Server response - the token to resume the channel's read position with after the
+  * connection drops.  Unguessable and opaque to the client.  Payload is RESUME_TOKEN_SIZE bytes followed by the
+  * name of the session on the channel.
+  */
+const unsigned char OP_SERVER_RESUME_TOKEN		= 0x89;
+
+/** Size of a resume token */
+const unsigned int RESUME_TOKEN_SIZE			= 8;
+
+/** Get All option - the client accepts OP_SERVER_MESSAGE_BATCH frames in the response */
+const unsigned char GET_ALL_ACCEPT_BATCH		= 0x01;
 
 /** Chat Client - Start */
 const std::string CMD_CLIENT_START			= "Start";
@@ -36,6 +166,14 @@ const std::string CMD_CLIENT_SUBMIT			= "Submit";
 const std::string CMD_CLIENT_GET_NEXT		= "GetNext";
 /** Chat Client - Get All */
 const std::string CMD_CLIENT_GET_ALL		= "GetAll";
+/** Chat Client - Subscribe */
+const std::string CMD_CLIENT_SUBSCRIBE		= "Subscribe";
+/** Chat Client - Unsubscribe */
+const std::string CMD_CLIENT_UNSUBSCRIBE	= "Unsubscribe";
+/** Chat Client - List */
+const std::string CMD_CLIENT_LIST			= "List";
+/** Chat Client - Stats */
+const std::string CMD_CLIENT_STATS			= "Stats";
 /** Chat Client - Leave */
 const std::string CMD_CLIENT_LEAVE			= "Leave";
 /** Chat Client - Exit */
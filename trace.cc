@@ -0,0 +1,195 @@
+/**
+ * @file trace.cc
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief Binary socket traffic tracing implementation
+ */
+
+#include "trace.h"
+
+#ifdef TRACE
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+  * One thread's events.  Only the owning thread writes to it; the dump reads
+  * whatever has been published through head.
+  */
+struct TraceRing {
+	TraceRing() :
+		head(0),
+		thread(0),
+		next(NULL) {
+	}
+
+	/** Recorded events.  Event number n is in slot n % TRACE_RING_SIZE. */
+	TraceEvent events[TRACE_RING_SIZE];
+	/** Number of events ever recorded */
+	uint64_t head;
+	/** Thread number written to the trace file */
+	uint32_t thread;
+	/** Next ring in g_rings */
+	TraceRing* next;
+
+private:
+	// a ring is never copied
+	TraceRing(const TraceRing&);
+	TraceRing& operator=(const TraceRing&);
+};
+
+/** Every ring ever created, newest first.  Rings are never freed. */
+static TraceRing* g_rings = NULL;
+/** Number of threads that have recorded an event */
+static uint32_t g_num_threads = 0;
+/** Set once the dump has been hooked up to SIGUSR2 and exit() */
+static int g_dump_installed = 0;
+/** The calling thread's ring.  NULL until it records its first event. */
+static __thread TraceRing* t_ring = NULL;
+
+/**
+  * SIGUSR2 handler.  Dumps the rings.
+  *
+  * @pre none
+  * @post The trace file is up to date
+  * @param in_signal Signal number
+  */
+static void dump_on_signal(int in_signal) {
+	(void)in_signal;
+
+	// the interrupted code may be about to look at errno
+	const int saved_errno = errno;
+	trace_dump();
+	errno = saved_errno;
+}
+
+/**
+  * Creates the calling thread's ring and, for the first thread, hooks the dump up
+  * to SIGUSR2 and exit().
+  *
+  * @pre t_ring is NULL
+  * @post t_ring is in g_rings
+  * @return The new ring
+  */
+static TraceRing* create_ring() {
+	if (0 == __atomic_exchange_n(&g_dump_installed, 1, __ATOMIC_ACQ_REL)) {
+		struct sigaction dump_action;
+		memset(&dump_action, 0, sizeof(dump_action));
+		dump_action.sa_handler = dump_on_signal;
+		dump_action.sa_flags = SA_RESTART;
+		sigemptyset(&dump_action.sa_mask);
+		sigaction(SIGUSR2, &dump_action, NULL);
+		atexit(trace_dump);
+	}
+
+	TraceRing* const ring = new TraceRing();
+	ring->thread = __atomic_fetch_add(&g_num_threads, 1, __ATOMIC_RELAXED);
+
+	// push onto the list without a lock - the dump may be walking it right now
+	ring->next = __atomic_load_n(&g_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&g_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+
+	t_ring = ring;
+	return ring;
+}
+
+/**
+  * Writes a whole buffer, retrying after partial writes and interruptions.
+  *
+  * @pre in_fd is open for writing
+  * @post in_buf has been written unless there was an error
+  * @param in_fd File descriptor to write to
+  * @param in_buf Data to write
+  * @param in_buf_len Length of in_buf
+  * @return 0 if successful; -1 if error
+  */
+static int write_all(const int in_fd,
+                     const char* in_buf,
+                     size_t in_buf_len) {
+	while (in_buf_len > 0) {
+		const ssize_t num_bytes = write(in_fd, in_buf, in_buf_len);
+		if (num_bytes < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		in_buf += num_bytes;
+		in_buf_len -= num_bytes;
+	}
+
+	return 0;
+}
+
+void trace_record(const unsigned char in_event,
+                  const int in_fd,
+                  const unsigned char in_opcode,
+                  const unsigned int in_length) {
+	TraceRing* const ring = (NULL == t_ring) ? create_ring() : t_ring;
+
+	// we are the only writer, so head can be read without an atomic
+	const uint64_t head = ring->head;
+	TraceEvent& event = ring->events[head & (TRACE_RING_SIZE - 1)];
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	event.timestamp_ns = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+	event.fd = in_fd;
+	event.length = in_length;
+	event.event = in_event;
+	event.opcode = in_opcode;
+	event.reserved = 0;
+	event.reserved2 = 0;
+
+	// publish the event to the dump
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_dump() {
+	// trace.<pid>.bin - built by hand because snprintf() is not async-signal-safe
+	char file_name[32] = "trace.";
+	char digits[16];
+	int num_digits = 0;
+	for (unsigned long pid = getpid(); 0 == num_digits || pid > 0; pid /= 10) {
+		digits[num_digits++] = '0' + (pid % 10);
+	}
+	size_t name_len = strlen(file_name);
+	while (num_digits > 0) {
+		file_name[name_len++] = digits[--num_digits];
+	}
+	memcpy(file_name + name_len, ".bin", sizeof(".bin"));
+
+	const int trace_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0) {
+		return;
+	}
+
+	for (const TraceRing* ring = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE); NULL != ring; ring = ring->next) {
+		const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		const uint64_t count = (head < TRACE_RING_SIZE) ? head : TRACE_RING_SIZE;
+
+		TraceFileHeader header;
+		header.thread = ring->thread;
+		header.count = count;
+
+		// oldest first - the events up to the end of the array, then the ones that wrapped
+		const size_t first = (head - count) & (TRACE_RING_SIZE - 1);
+		const size_t before_wrap = (first + count > TRACE_RING_SIZE) ? TRACE_RING_SIZE - first : count;
+		if (-1 == write_all(trace_fd, reinterpret_cast<const char*>(&header), sizeof(header)) ||
+		    -1 == write_all(trace_fd, reinterpret_cast<const char*>(&ring->events[first]), before_wrap * sizeof(TraceEvent)) ||
+		    -1 == write_all(trace_fd, reinterpret_cast<const char*>(&ring->events[0]), (count - before_wrap) * sizeof(TraceEvent))) {
+			break;
+		}
+	}
+
+	close(trace_fd);
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef __CSCI_5273_TRACE_H
+#define __CSCI_5273_TRACE_H
+
+/**
+ * @file trace.h
+ * @author Marc Schweikert
+ * @date 26 September 2014
+ * @brief Compile-time switchable binary tracing of socket traffic
+ *
+ * Built without TRACE defined, UTIL_TRACE() expands to nothing and none of this
+ * costs anything.  Built with -DTRACE, every UTIL_TRACE() appends one TraceEvent
+ * to a ring buffer owned by the calling thread.  Recording takes no locks and
+ * makes no syscalls beyond reading the clock; once a ring is full the oldest
+ * events are overwritten.
+ *
+ * The rings are written to trace.<pid>.bin in the working directory when the
+ * process receives SIGUSR2 and when it exits through exit().  Each dump replaces
+ * the previous one.  The file holds, for every thread that recorded anything, a
+ * TraceFileHeader followed by its events oldest first.  All fields are in host
+ * byte order.
+ */
+
+#include <stdint.h>
+
+
+/** Event type - bytes sent on a TCP socket */
+const unsigned char TRACE_SEND		= 1;
+/** Event type - bytes received on a TCP socket */
+const unsigned char TRACE_RECV		= 2;
+/** Event type - datagram sent */
+const unsigned char TRACE_SEND_UDP	= 3;
+/** Event type - datagram received */
+const unsigned char TRACE_RECV_UDP	= 4;
+
+/** Opcode recorded for traffic that is not a frame */
+const unsigned char TRACE_NO_OPCODE	= 0;
+
+/** Number of events each thread keeps.  Must be a power of two. */
+const unsigned int TRACE_RING_SIZE	= 64 * 1024;
+
+/**
+  * One recorded event.
+  */
+struct TraceEvent {
+	/** CLOCK_MONOTONIC time of the event in nanoseconds */
+	uint64_t timestamp_ns;
+	/** Socket the traffic was on */
+	int32_t fd;
+	/** Number of bytes, or the frame payload length for framed traffic */
+	uint32_t length;
+	/** One of the TRACE_* event types */
+	uint8_t event;
+	/** One of the OP_* values from strings.h, or TRACE_NO_OPCODE */
+	uint8_t opcode;
+	/** Unused - keeps the layout free of compiler padding */
+	uint16_t reserved;
+	/** Unused - keeps the layout free of compiler padding */
+	uint32_t reserved2;
+};
+
+/**
+  * Starts each thread's section of a trace file.
+  */
+struct TraceFileHeader {
+	/** Thread number, in the order threads first recorded an event */
+	uint32_t thread;
+	/** Number of TraceEvents that follow */
+	uint32_t count;
+};
+
+#ifdef TRACE
+
+/**
+  * Records one event in the calling thread's ring.  Use UTIL_TRACE() instead so
+  * the call compiles out when tracing is off.
+  *
+  * @pre none
+  * @post The event is in the calling thread's ring
+  * @param in_event One of the TRACE_* event types
+  * @param in_fd Socket the traffic was on
+  * @param in_opcode Frame opcode, or TRACE_NO_OPCODE
+  * @param in_length Number of bytes
+  */
+void trace_record(const unsigned char in_event,
+                  const int in_fd,
+                  const unsigned char in_opcode,
+                  const unsigned int in_length);
+
+/**
+  * Writes every thread's ring to the trace file.  Only async-signal-safe calls are
+  * made, so this is also the SIGUSR2 handler's body.  Events recorded while the
+  * dump runs may or may not be included.
+  *
+  * @pre none
+  * @post The trace file holds the current contents of every ring
+  */
+void trace_dump();
+
+#define UTIL_TRACE(event, fd, opcode, length) trace_record((event), (fd), (opcode), (length))
+
+#else
+
+#define UTIL_TRACE(event, fd, opcode, length) ((void)0)
+
+#endif
+
+#endif